@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS 5
+#define SCRIPT_DIRECTORY "scripts"
+#define USAGE "Usage %s: [--runs <n>] <nord-binary> [<nord-binary> ...]\n"
+#define HRULE "================================================================================\n"
+
+// Benchmarks are plain nord scripts. Each one is run RUNS times against every
+// binary given on the command line, and we report the fastest and mean wall
+// clock time. Passing two binaries (say, before and after a change) gives a
+// side-by-side comparison.
+
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+    char **scripts;
+} script_list_t;
+
+script_list_t *script_list_create(void)
+{
+    script_list_t *list;
+
+    list = (script_list_t *)malloc(sizeof(script_list_t));
+    list->size = 0;
+    list->capacity = 8;
+    list->scripts = (char **)malloc(sizeof(char *) * list->capacity);
+
+    return list;
+}
+
+void script_list_destroy(script_list_t *list)
+{
+    for (int i = 0; i < list->size; i++)
+    {
+        free(list->scripts[i]);
+    }
+    free(list->scripts);
+    free(list);
+}
+
+void script_list_add(script_list_t *list, char *path)
+{
+    if (list->size >= list->capacity)
+    {
+        list->capacity *= 2;
+        list->scripts = realloc(list->scripts, sizeof(char *) * list->capacity);
+    }
+
+    list->scripts[list->size++] = path;
+}
+
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+void discover_scripts(script_list_t *list, const char *base)
+{
+    DIR *directory = opendir(base);
+    struct dirent *entry;
+
+    if (directory == NULL)
+    {
+        perror(base);
+        exit(1);
+    }
+
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char *entry_path;
+        size_t len = strlen(entry->d_name);
+
+        if (len < 2 || strcmp(entry->d_name + len - 2, ".n") != 0)
+            continue;
+
+        asprintf(&entry_path, "%s/%s", base, entry->d_name);
+        script_list_add(list, entry_path);
+    }
+
+    closedir(directory);
+
+    // Keep the report in a stable order
+    qsort(list->scripts, list->size, sizeof(char *), compare_paths);
+}
+
+double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Run a single script once, returning the elapsed time in milliseconds or a
+// negative number if the interpreter did not exit cleanly.
+double time_script(const char *binary, const char *script)
+{
+    int status;
+    double start = now_ms();
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        dup2(devnull, 2);
+        close(devnull);
+
+        execl(binary, binary, script, NULL);
+        exit(127);
+    }
+
+    waitpid(pid, &status, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    return now_ms() - start;
+}
+
+void usage(char *name)
+{
+    printf(USAGE, name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = RUNS;
+    int first_binary = 1;
+    int failures = 0;
+
+    if (argc > 2 && strcmp(argv[1], "--runs") == 0)
+    {
+        runs = atoi(argv[2]);
+        first_binary = 3;
+    }
+
+    if (first_binary >= argc || runs <= 0)
+        usage(argv[0]);
+
+    script_list_t *list = script_list_create();
+    discover_scripts(list, SCRIPT_DIRECTORY);
+
+    printf("%sBenchmarking %zu scripts, best / mean of %d runs (ms)\n%s", HRULE, list->size, runs, HRULE);
+
+    printf("%-28s", "script");
+    for (int b = first_binary; b < argc; b++)
+        printf("%26s", argv[b]);
+    printf("\n");
+
+    for (int i = 0; i < list->size; i++)
+    {
+        printf("%-28s", list->scripts[i] + strlen(SCRIPT_DIRECTORY) + 1);
+
+        for (int b = first_binary; b < argc; b++)
+        {
+            double best = 0, total = 0;
+            int failed = 0;
+
+            for (int r = 0; r < runs; r++)
+            {
+                double elapsed = time_script(argv[b], list->scripts[i]);
+
+                if (elapsed < 0)
+                {
+                    failed = 1;
+                    break;
+                }
+
+                if (r == 0 || elapsed < best)
+                    best = elapsed;
+                total += elapsed;
+            }
+
+            if (failed)
+            {
+                printf("%26s", "FAILED");
+                failures += 1;
+            }
+            else
+            {
+                char cell[32];
+                snprintf(cell, sizeof(cell), "%.1f / %.1f", best, total / runs);
+                printf("%26s", cell);
+            }
+        }
+
+        printf("\n");
+    }
+
+    printf(HRULE);
+
+    script_list_destroy(list);
+    return failures;
+}
@@ -3,26 +3,66 @@
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "machine/binary.h"
 #include "machine/vm.h"
 #include "compiler/compile.h"
+#include "compiler/ir.h"
 #include "compiler/lex.h"
 #include "compiler/parse.h"
+#include "compiler/peephole.h"
+
+#define USAGE "Usage: %s [--heap-limit=<bytes>] [--emit-ir] [--peephole-stats] <file-1> <file-2> ...\n"
 
 int main(int argc, char *argv[])
 {
     int status = 0;
+    bool emit_ir = false;
+    bool show_peephole_stats = false;
 
     if (argc == 1)
     {
-        printf("Usage: %s <file-1> <file-2> ...\n", argv[0]);
+        printf(USAGE, argv[0]);
         goto done;
     }
 
     for (int i = 1; i < argc; i++)
     {
+        if (strncmp(argv[i], "--heap-limit=", 13) == 0)
+        {
+            char *bytes = argv[i] + 13, *end;
+            unsigned long long limit = strtoull(bytes, &end, 10);
+
+            // The limit is a plain, positive number of bytes
+            if (!isdigit((unsigned char)*bytes) || *end != '\0' || limit == 0)
+            {
+                fprintf(stderr, USAGE, argv[0]);
+                status = 1;
+                goto done;
+            }
+
+            gc_set_heap_limit(limit);
+            continue;
+        }
+
+        // Print the IR for the optimized code, instead of running it
+        if (strcmp(argv[i], "--emit-ir") == 0)
+        {
+            emit_ir = true;
+            continue;
+        }
+
+        // Report what the peephole optimizer removed, once we're done
+        if (strcmp(argv[i], "--peephole-stats") == 0)
+        {
+            show_peephole_stats = true;
+            continue;
+        }
+
         FILE *fp = fopen(argv[i], "r");
 
         if (fp == NULL)
@@ -48,13 +88,41 @@ int main(int argc, char *argv[])
         context.position = 0;
 
         ast_t *syntax_tree = parse(&context);
-        binary_t *binary = compile(argv[i], input, syntax_tree);
+        binary_t *binary = compile(argv[i], input, syntax_tree, context.arena);
+
+        if (emit_ir)
+        {
+            char *listing = ir_dump(binary);
+            printf("%s", listing);
+            free(listing);
+            free(input);
+            continue;
+        }
+
         vm_t *vm = vm_create(binary);
         vm_execute(vm);
         free(input);
+
+        if (vm->error != NULL)
+        {
+            fflush(stdout);
+            fprintf(stderr, "%s: %s\n", argv[i], vm->error);
+            status = 1;
+            goto done;
+        }
     }
 
 done:
+    if (show_peephole_stats)
+    {
+        peephole_stats_t stats = peephole_stats();
+        fflush(stdout);
+        fprintf(stderr, "peephole: %zu self moves, %zu redundant loads, %zu dead writes, "
+                        "%zu constant branches, %zu unreachable, %zu push/pops, %zu empty jumps\n",
+                stats.self_moves, stats.redundant_loads, stats.dead_writes, stats.constant_branches,
+                stats.unreachable, stats.push_pops, stats.empty_jumps);
+    }
+
     fflush(stdout);
     fflush(stderr);
     return status;
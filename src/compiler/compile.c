@@ -10,9 +10,14 @@
 #include <string.h>
 
 #include "compile.h"
+#include "fold.h"
+#include "ir.h"
+#include "peephole.h"
+#include "lang/builtins.h"
 #include "lang/module.h"
 #include "machine/bytecode.h"
 #include "machine/value.h"
+#include "machine/vm.h"
 #include "util/error.h"
 #include "util/macros.h"
 
@@ -22,18 +27,61 @@
 #define INSTRUCTION3(OP, ARG1, ARG2) (instruction_t){ OP, .fields={ .pair={ARG1, ARG2 } } }
 #define INSTRUCTION2(OP, ARG1) INSTRUCTION3(OP, 0, ARG1)
 
+#define BRANCH(OP, ARG1, ARG2, OFFSET) (instruction_t){ OP, .fields={ .branch={ARG1, ARG2, OFFSET} } }
+#define JUMP(OFFSET) BRANCH(OP_JMP, 0, 0, OFFSET)
+
+// Variables live in the registers below this, and are spilled to memory once
+// those are all taken. The registers above are left for temporaries.
+#define VARIABLE_REGISTERS 224
+
+typedef struct spill_slot_t
+{
+    uint32_t address;
+    struct spill_slot_t *next;
+} spill_slot_t;
+
+// A variable that dies once a later statement in its block is compiled
+typedef struct dying_variable_t
+{
+    sym_pointer_t location;
+    struct dying_variable_t *next;
+} dying_variable_t;
+
+// Where new variables can go, besides the top of the registers in use
+typedef struct
+{
+    // Registers below rp whose variables are no longer used
+    uint8_t holes[VARIABLE_REGISTERS];
+    int num_holes;
+    // Spill slots whose variables are no longer used. Nodes are never
+    // changed once they're on the list, so copying this struct is enough to
+    // take a snapshot.
+    spill_slot_t *free_slots;
+} register_state_t;
+
 typedef struct
 {
     // Name of the module we are compiling
     const char *name;
     // Source code that is being compiled
     const char *listing;
+    // Owns everything that doesn't outlive the compile, starting with the
+    // tokens and syntax tree from the parser
+    arena_t *arena;
     symbol_map_t *symbols;
+    // Where each string literal we've seen lives in the constant pool
+    symbol_map_t *strings;
     binary_t *binary;
     code_block_t *current_code_block;
-    uint8_t rp;
+    // The first register above every variable, where temporaries start
+    uint16_t rp;
+    register_state_t registers;
+    // Every spill slot the function we're compiling has used
+    spill_slot_t *function_slots;
     uint64_t mp;
     uint64_t cp;
+    // How many function declarations deep we are
+    uint8_t depth;
     symbol_t member_context;
 } compile_context_t;
 
@@ -41,18 +89,19 @@ typedef struct
 {
     uint8_t location;
     value_type_e type;
-    code_block_t *code;
 } compile_result_t;
 
 compile_result_t compile_ast(ast_t *ast, compile_context_t *context);
 
-compile_context_t *context_create(const char *name, const char *listing)
+compile_context_t *context_create(const char *name, const char *listing, arena_t *arena)
 {
     compile_context_t *context = malloc(sizeof(compile_context_t));
 
     context->name = name;
     context->listing = listing;
-    context->symbols = symbol_map_create();
+    context->arena = arena;
+    context->symbols = symbol_map_create_in(arena);
+    context->strings = symbol_map_create_in(arena);
     context->binary = binary_create();
     context->binary->data = memory_create(1);
     context->binary->code = code_collection_create();
@@ -61,11 +110,14 @@ compile_context_t *context_create(const char *name, const char *listing)
     context->member_context = (symbol_t){ 0 };
     code_collection_add_block(context->binary->code, context->current_code_block);
     context->rp = 1;
+    context->registers = (register_state_t){ 0 };
+    context->function_slots = NULL;
     context->cp = 0;
+    context->depth = 0;
 
     // Set up true and false
-    memory_set(context->binary->data, 0, (value_t){VAL_BOOLEAN, false});
-    memory_set(context->binary->data, 1, (value_t){VAL_BOOLEAN, true});
+    memory_set(context->binary->data, 0, value_from_bool(false));
+    memory_set(context->binary->data, 1, value_from_bool(true));
 
     context->mp = 2;
 
@@ -74,31 +126,17 @@ compile_context_t *context_create(const char *name, const char *listing)
 
 void context_destroy(compile_context_t *context)
 {
-    symbol_map_destroy(context->symbols);
-    // NOTE: We don't free the code block, since that is returned (and this is
-    //       an internal data structure).
+    // NOTE: We don't free the binary, since that is returned. Everything else
+    //       lives in the arena.
+    arena_destroy(context->arena);
     free(context);
 }
 
-static inline compile_result_t write_out_builtin(compile_context_t *context, char *name, uint8_t nargs, uint8_t *args)
+static inline compile_result_t write_out_builtin(compile_context_t *context, int builtin, uint8_t nargs, uint8_t *args)
 {
-    symbol_t fn_symbol = symbol_map_get(context->symbols, name);
+    assert(builtin >= 0);
 
-    if (fn_symbol.location.type == LOC_UNDEF)
-    {
-        memory_set(context->binary->data, context->mp, string_create(name));
-        fn_symbol.location.type = LOC_BUILTIN;
-        fn_symbol.location.address = context->mp++;
-        fn_symbol.name = name;
-        fn_symbol.type = SYM_FN;
-
-        symbol_map_t *map = context->symbols;
-        while (map->parent != NULL)
-            map = map->parent;
-        symbol_map_set(map, fn_symbol);
-    }
-
-    uint8_t reset_register = context->rp;
+    uint16_t reset_register = context->rp;
 
     // We push args onto the stack in reverse order because we'll pop them
     // off in the builtin
@@ -114,10 +152,530 @@ static inline compile_result_t write_out_builtin(compile_context_t *context, cha
 
     // Number of args -> $0
     code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, 0, nargs));
-    code_block_write(context->current_code_block, INSTRUCTION(OP_CALL_DYNAMIC, fn_symbol.location.address));
+    code_block_write(context->current_code_block, INSTRUCTION(OP_CALL_BUILTIN, builtin));
     code_block_write(context->current_code_block, INSTRUCTION(OP_POP, context->rp));
 
-    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN };
+}
+
+// Registers are addressed relative to the current call frame, so a register
+// symbol declared outside of the function we're compiling can't be used
+// directly. Top-level registers are reachable via getglobal / setglobal, but
+// anything belonging to an enclosing function is out of reach. Spilled
+// top-level variables are in memory, so they can be used as they are.
+static bool symbol_is_global(compile_context_t *context, symbol_t symbol, ast_t *ast)
+{
+    bool variable = symbol.location.type == LOC_REGISTER || symbol.location.type == LOC_SPILLED;
+
+    if (!variable || symbol.depth == context->depth)
+        return false;
+
+    if (symbol.depth != 0)
+    {
+        char *error;
+        location_t loc = {ast->location.start, ast->location.end};
+        asprintf(&error, "Cannot use \"%s\" from an enclosing function", symbol.name);
+        printf("%s", format_error_found_here(context->name, context->listing, error, loc));
+        exit(1);
+    }
+
+    return symbol.location.type == LOC_REGISTER;
+}
+
+// What we know at compile time about the type of a symbol's value
+static value_type_e symbol_static_type(compile_context_t *context, symbol_t symbol)
+{
+    if (symbol.type == SYM_FN)
+        return VAL_FUNCTION;
+
+    if ((symbol.location.type != LOC_REGISTER && symbol.location.type != LOC_SPILLED) || symbol.value_type == VAL_ABSENT)
+        return VAL_UNKNOWN;
+
+    // Any function we call might assign to a global, so only constants keep
+    // their type across function boundaries
+    if (symbol.depth != context->depth && symbol.type != SYM_CONSTANT)
+        return VAL_UNKNOWN;
+
+    return symbol.value_type;
+}
+
+// Once a variable has been assigned a value of some other type, we can't
+// assume either type anymore
+static void symbol_forget_type(compile_context_t *context, char *name)
+{
+    symbol_map_t *scope = symbol_map_context(context->symbols, name);
+
+    if (scope == NULL)
+        return;
+
+    symbol_t symbol = symbol_map_get_local(scope, name);
+    symbol.value_type = VAL_UNKNOWN;
+    symbol_map_set(scope, symbol);
+}
+
+// Work out the type of an expression without compiling it, following the same
+// rules as the compile_* functions below
+static value_type_e infer_type(ast_t *ast, compile_context_t *context)
+{
+    switch (ast->type)
+    {
+        case AST_LITERAL:
+            switch (ast->op.literal.token.type)
+            {
+                case TOK_NUMBER: return VAL_INT;
+                case TOK_STRING: return VAL_STRING;
+                case TOK_FLOAT: return VAL_FLOAT;
+                case TOK_TRUE:
+                case TOK_FALSE: return VAL_BOOLEAN;
+                case TOK_NIL: return VAL_NIL;
+                case TOK_IDENTIFIER:
+                    return symbol_static_type(context, symbol_map_get(context->symbols, ast->op.literal.value));
+                default: return VAL_UNKNOWN;
+            }
+
+        case AST_GROUP:
+            return infer_type(ast->op.group, context);
+
+        case AST_ASSIGN:
+            return infer_type(ast->op.assign.value, context);
+
+        case AST_TUPLE:
+            return VAL_TUPLE;
+
+        case AST_RANGE:
+            return VAL_RANGE;
+
+        case AST_UNARY:
+            if (ast->op.unary.operator.type == TOK_BANG)
+                return VAL_BOOLEAN;
+            return infer_type(ast->op.unary.operand, context);
+
+        case AST_BINARY:
+            switch (ast->op.binary.operator.type)
+            {
+                case TOK_PLUS:
+                case TOK_MINUS:
+                case TOK_ASTERISK:
+                case TOK_MODULO:
+                    return arithmetic_cast(infer_type(ast->op.binary.left, context),
+                                           infer_type(ast->op.binary.right, context));
+                case TOK_SLASH:
+                    return VAL_FLOAT;
+                case TOK_DOT:
+                    return VAL_UNKNOWN;
+                default:
+                    return VAL_BOOLEAN;
+            }
+
+        default:
+            return VAL_UNKNOWN;
+    }
+}
+
+// Forget the type of any variable assigned a value of a different type within
+// the tree. Returns whether anything was forgotten.
+static bool forget_assigned_types(ast_t *ast, compile_context_t *context)
+{
+    bool forgot = false;
+
+    if (ast == NULL)
+        return false;
+
+    switch (ast->type)
+    {
+        case AST_ASSIGN:
+        {
+            symbol_t symbol = symbol_map_get(context->symbols, ast->op.assign.name);
+            value_type_e type = symbol_static_type(context, symbol);
+
+            if (type != VAL_UNKNOWN && type != infer_type(ast->op.assign.value, context))
+            {
+                symbol_forget_type(context, ast->op.assign.name);
+                forgot = true;
+            }
+
+            return forget_assigned_types(ast->op.assign.value, context) || forgot;
+        }
+
+        case AST_BINARY:
+            forgot = forget_assigned_types(ast->op.binary.left, context);
+            return forget_assigned_types(ast->op.binary.right, context) || forgot;
+
+        case AST_DECLARE:
+            return forget_assigned_types(ast->op.declare.initial_value, context);
+
+        case AST_UNARY:
+            return forget_assigned_types(ast->op.unary.operand, context);
+
+        case AST_GROUP:
+            return forget_assigned_types(ast->op.group, context);
+
+        case AST_STMT_LIST:
+        case AST_EXPR_LIST:
+        case AST_TUPLE:
+            for (int i = 0; i < ast->op.list.size; i++)
+                forgot = forget_assigned_types(ast->op.list.items[i], context) || forgot;
+            return forgot;
+
+        case AST_FUNCTION_DECL:
+            return forget_assigned_types(ast->op.fn.body, context);
+
+        case AST_FUNCTION_CALL:
+            return forget_assigned_types(ast->op.call.args, context);
+
+        case AST_IF_STMT:
+            forgot = forget_assigned_types(ast->op.if_stmt.condition, context);
+            return forget_assigned_types(ast->op.if_stmt.body, context) || forgot;
+
+        case AST_FOR_STMT:
+            forgot = forget_assigned_types(ast->op.for_stmt.iterable, context);
+            return forget_assigned_types(ast->op.for_stmt.body, context) || forgot;
+
+        case AST_RANGE:
+            forgot = forget_assigned_types(ast->op.range.begin, context);
+            return forget_assigned_types(ast->op.range.end, context) || forgot;
+
+        default:
+            return false;
+    }
+}
+
+// Pick the variant of an arithmetic or compare-and-jump opcode specialized for the
+// types of its operands, if there is one
+static uint8_t specialize_opcode(uint8_t opcode, value_type_e left, value_type_e right)
+{
+    if (left != right)
+        return opcode;
+
+    switch (left)
+    {
+        case VAL_INT:
+            switch (opcode)
+            {
+                case OP_ADD: return OP_ADD_INT;
+                case OP_SUBTRACT: return OP_SUBTRACT_INT;
+                case OP_MULTIPLY: return OP_MULTIPLY_INT;
+                case OP_JMP_EQUAL: return OP_JMP_EQUAL_INT;
+                case OP_JMP_NOT_EQUAL: return OP_JMP_NOT_EQUAL_INT;
+                case OP_JMP_LESSTHAN: return OP_JMP_LESSTHAN_INT;
+                case OP_JMP_NOT_LESSTHAN: return OP_JMP_NOT_LESSTHAN_INT;
+                default: return opcode;
+            }
+
+        case VAL_FLOAT:
+            switch (opcode)
+            {
+                case OP_ADD: return OP_ADD_FLOAT;
+                case OP_SUBTRACT: return OP_SUBTRACT_FLOAT;
+                case OP_MULTIPLY: return OP_MULTIPLY_FLOAT;
+                case OP_JMP_EQUAL: return OP_JMP_EQUAL_FLOAT;
+                case OP_JMP_NOT_EQUAL: return OP_JMP_NOT_EQUAL_FLOAT;
+                case OP_JMP_LESSTHAN: return OP_JMP_LESSTHAN_FLOAT;
+                case OP_JMP_NOT_LESSTHAN: return OP_JMP_NOT_LESSTHAN_FLOAT;
+                default: return opcode;
+            }
+
+        case VAL_STRING:
+            switch (opcode)
+            {
+                case OP_ADD: return OP_CONCAT;
+                case OP_JMP_EQUAL: return OP_JMP_EQUAL_STRING;
+                case OP_JMP_NOT_EQUAL: return OP_JMP_NOT_EQUAL_STRING;
+                default: return opcode;
+            }
+
+        default:
+            return opcode;
+    }
+}
+
+//-- Register allocation
+//
+// Temporaries are allocated like a stack, starting at rp, and are given back
+// as soon as the expression that needed them is done. Variables are below
+// rp. Before a statement list is compiled, we work out the last statement
+// that uses each name in it, and once that statement is compiled, the
+// registers of any variables declared in the list that die there become
+// holes. A later declaration takes a hole when that saves a register without
+// costing a move, or when the registers run out. When there are no holes
+// left either, variables are spilled to slots in memory instead.
+
+// Registers from rp up to and including last are about to be used, so make
+// sure there are that many
+static void check_registers(compile_context_t *context, int last, ast_t *ast)
+{
+    if (last < VM_NUM_REGISTERS)
+        return;
+
+    location_t loc = {ast->location.start, ast->location.end};
+    char *error = "Expression is too complex, it needs more registers than there are.";
+    printf("%s", format_error_found_here(context->name, context->listing, error, loc));
+    exit(1);
+}
+
+static void note_use(symbol_map_t *uses, char *name, uint32_t statement)
+{
+    symbol_t use = symbol_map_get_local(uses, name);
+
+    // The address is the statement, the type just marks the name as seen
+    if (use.location.type == LOC_UNDEF)
+        use = (symbol_t){ .name=name, .location={ .type=LOC_REGISTER } };
+
+    if (use.location.address != UINT32_MAX)
+    {
+        use.location.address = statement;
+        symbol_map_set(uses, use);
+    }
+}
+
+// Record statement as the last use of every name mentioned in the tree. A
+// name mentioned in a function could be used whenever the function is
+// called, so it's recorded as being used forever.
+static void note_uses(ast_t *ast, symbol_map_t *uses, uint32_t statement)
+{
+    if (ast == NULL)
+        return;
+
+    switch (ast->type)
+    {
+        case AST_LITERAL:
+            if (ast->op.literal.token.type == TOK_IDENTIFIER)
+                note_use(uses, ast->op.literal.value, statement);
+            break;
+
+        case AST_ASSIGN:
+            note_use(uses, ast->op.assign.name, statement);
+            note_uses(ast->op.assign.value, uses, statement);
+            break;
+
+        case AST_DECLARE:
+            note_use(uses, ast->op.declare.name, statement);
+            note_uses(ast->op.declare.initial_value, uses, statement);
+            break;
+
+        case AST_BINARY:
+            note_uses(ast->op.binary.left, uses, statement);
+            note_uses(ast->op.binary.right, uses, statement);
+            break;
+
+        case AST_UNARY:
+            note_uses(ast->op.unary.operand, uses, statement);
+            break;
+
+        case AST_GROUP:
+            note_uses(ast->op.group, uses, statement);
+            break;
+
+        case AST_STMT_LIST:
+        case AST_EXPR_LIST:
+        case AST_VAR_LIST:
+        case AST_TUPLE:
+            for (int i = 0; i < ast->op.list.size; i++)
+                note_uses(ast->op.list.items[i], uses, statement);
+            break;
+
+        case AST_FUNCTION_DECL:
+            note_uses(ast->op.fn.body, uses, UINT32_MAX);
+            break;
+
+        case AST_FUNCTION_CALL:
+            note_use(uses, ast->op.call.name, statement);
+            note_uses(ast->op.call.args, uses, statement);
+            break;
+
+        case AST_IF_STMT:
+            note_uses(ast->op.if_stmt.condition, uses, statement);
+            note_uses(ast->op.if_stmt.body, uses, statement);
+            break;
+
+        case AST_FOR_STMT:
+            if (ast->op.for_stmt.var != NULL)
+                note_use(uses, ast->op.for_stmt.var, statement);
+            note_uses(ast->op.for_stmt.iterable, uses, statement);
+            note_uses(ast->op.for_stmt.body, uses, statement);
+            break;
+
+        case AST_RANGE:
+            note_uses(ast->op.range.begin, uses, statement);
+            note_uses(ast->op.range.end, uses, statement);
+            break;
+
+        default:
+            ;
+    }
+}
+
+// Returns whether an instruction does nothing but write its first operand
+static bool writes_destination(instruction_t instruction)
+{
+    switch (instruction.opcode)
+    {
+        case OP_NIL:
+        case OP_LOAD:
+        case OP_LOADV:
+        case OP_MOVE:
+        case OP_GETGLOBAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_MODULO:
+        case OP_ADD_INT:
+        case OP_ADD_FLOAT:
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_FLOAT:
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_FLOAT:
+        case OP_CONCAT:
+        case OP_AND:
+        case OP_OR:
+        case OP_NOT:
+        case OP_TUPLE:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool is_branch(instruction_t instruction)
+{
+    return (instruction.opcode >= OP_JMP && instruction.opcode <= OP_JMP_NOT_EQUAL_STRING)
+        || instruction.opcode == OP_FORITER;
+}
+
+// Copy a value that the code written since start calculated into dest. If
+// the value was calculated into rp by the last of that code, and nothing
+// jumps around it, that instruction can write it to dest itself.
+static void write_value_to(compile_context_t *context, uint8_t dest, compile_result_t value, size_t start)
+{
+    code_block_t *block = context->current_code_block;
+
+    if (value.location == dest)
+        return;
+
+    bool straight = value.location == context->rp && block->size > start;
+    for (size_t i = start; straight && i < block->size; i++)
+        straight = !is_branch(block->code[i]);
+
+    if (straight)
+    {
+        instruction_t *last = &block->code[block->size - 1];
+
+        if (writes_destination(*last) && last->fields.pair.arg1 == context->rp)
+        {
+            last->fields.pair.arg1 = dest;
+            return;
+        }
+    }
+
+    code_block_write(block, INSTRUCTION(OP_MOVE, dest, value.location));
+}
+
+static uint32_t spill_slot(compile_context_t *context)
+{
+    spill_slot_t *slot = context->registers.free_slots;
+
+    if (slot != NULL)
+    {
+        context->registers.free_slots = slot->next;
+        return slot->address;
+    }
+
+    slot = arena_alloc(context->arena, sizeof(spill_slot_t));
+    slot->address = context->mp++;
+    slot->next = context->function_slots;
+    context->function_slots = slot;
+
+    memory_set(context->binary->data, slot->address, value_from_type(VAL_NIL));
+    return slot->address;
+}
+
+// Find a home for a new variable, whose value was calculated by the code
+// written since start
+static sym_pointer_t place_variable(compile_context_t *context, compile_result_t value, size_t start)
+{
+    register_state_t *registers = &context->registers;
+
+    // A value that's already sitting in rp can stay there for free, as long
+    // as there's room. Otherwise, reuse a dead variable's register.
+    if (registers->num_holes > 0 && (value.location != context->rp || context->rp >= VARIABLE_REGISTERS))
+    {
+        uint8_t hole = registers->holes[--registers->num_holes];
+        write_value_to(context, hole, value, start);
+        return (sym_pointer_t){ .type=LOC_REGISTER, .address=hole };
+    }
+
+    if (context->rp < VARIABLE_REGISTERS)
+    {
+        // If we were initialized from another variable, take a copy, rather
+        // than sharing its register
+        write_value_to(context, context->rp, value, start);
+        return (sym_pointer_t){ .type=LOC_REGISTER, .address=context->rp++ };
+    }
+
+    uint32_t slot = spill_slot(context);
+    code_block_write(context->current_code_block, INSTRUCTION(OP_STORE, value.location, slot));
+    return (sym_pointer_t){ .type=LOC_SPILLED, .address=slot };
+}
+
+// A variable is dead, so its register or spill slot can be reused
+static void release_variable(compile_context_t *context, sym_pointer_t location)
+{
+    register_state_t *registers = &context->registers;
+
+    if (location.type == LOC_SPILLED)
+    {
+        spill_slot_t *slot = arena_alloc(context->arena, sizeof(spill_slot_t));
+        slot->address = location.address;
+        slot->next = registers->free_slots;
+        registers->free_slots = slot;
+        return;
+    }
+
+    if (location.type != LOC_REGISTER)
+        return;
+
+    registers->holes[registers->num_holes++] = location.address;
+}
+
+// Spill slots belong to a function, rather than to one call of it, so a
+// function that has spilled saves them on the stack around its calls, in case
+// the callee ends up calling it again
+static void save_spill_slots(compile_context_t *context, uint8_t scratch)
+{
+    for (spill_slot_t *slot = context->function_slots; slot != NULL; slot = slot->next)
+    {
+        code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, scratch, slot->address));
+        code_block_write(context->current_code_block, INSTRUCTION(OP_PUSH, scratch));
+    }
+}
+
+static void restore_spill_slots(compile_context_t *context, spill_slot_t *slot, uint8_t scratch)
+{
+    if (slot == NULL)
+        return;
+
+    restore_spill_slots(context, slot->next, scratch);
+    code_block_write(context->current_code_block, INSTRUCTION(OP_POP, scratch));
+    code_block_write(context->current_code_block, INSTRUCTION(OP_STORE, scratch, slot->address));
+}
+
+// Write a forward jump whose offset isn't known yet, returning where it is
+static size_t write_placeholder(compile_context_t *context, instruction_t jump)
+{
+    code_block_write(context->current_code_block, jump);
+    return context->current_code_block->size - 1;
+}
+
+// Point a placeholder at whatever is written next
+static void patch_jump(compile_context_t *context, size_t placeholder)
+{
+    code_block_t *block = context->current_code_block;
+
+    assert(block->size - placeholder < INT16_MAX);
+    block->code[placeholder].fields.branch.offset = block->size - placeholder;
 }
 
 //-- Compile AST nodes
@@ -125,16 +683,16 @@ static inline compile_result_t write_out_builtin(compile_context_t *context, cha
 compile_result_t compile_statement_list(ast_t *ast, compile_context_t *context)
 {
     // Create our inner scope for this block
-    symbol_map_t *inner_scope = symbol_map_create();
+    symbol_map_t *inner_scope = symbol_map_create_in(context->arena);
     inner_scope->parent = context->symbols;
     context->symbols = inner_scope;
 
-    // Create a new code block for this block
-    code_block_t *previous_block =  context->current_code_block;
-    code_block_t *inner_block = code_block_create();
-    context->current_code_block = inner_block;
+    // Variables declared in this block are gone once it's done
+    register_state_t previous_registers = context->registers;
+    uint16_t previous_rp = context->rp;
 
-    compile_result_t result;
+    // An empty block has no value of its own
+    compile_result_t result = { .location=context->rp, .type=VAL_UNKNOWN };
 
     // If it's not a statement list, simply compile the one statement
     if (ast->type != AST_STMT_LIST)
@@ -143,21 +701,55 @@ compile_result_t compile_statement_list(ast_t *ast, compile_context_t *context)
     }
     else
     {
+        symbol_map_t *uses = symbol_map_create_in(context->arena);
+        for (int i = 0; i < ast->op.list.size; i++)
+            note_uses(ast->op.list.items[i], uses, i);
+
+        // The variables that die after each statement
+        dying_variable_t **dying = arena_alloc(context->arena, ast->op.list.size * sizeof(dying_variable_t *));
+
+        // The top of the variables live in this block. Temporaries above it
+        // are given back after every statement.
+        uint16_t top = context->rp;
+
         for (int i = 0; i < ast->op.list.size; i++)
         {
-            result = compile_ast(ast->op.list.items[i], context);
+            ast_t *statement = ast->op.list.items[i];
+            result = compile_ast(statement, context);
+
+            if (statement->type == AST_DECLARE)
+            {
+                sym_pointer_t location = symbol_map_get_local(context->symbols, statement->op.declare.name).location;
+                if (location.type == LOC_REGISTER && location.address >= top)
+                    top = location.address + 1;
+            }
+
+            context->rp = top;
+
+            if (statement->type == AST_DECLARE)
+            {
+                uint32_t last_use = symbol_map_get_local(uses, statement->op.declare.name).location.address;
+
+                if (last_use != UINT32_MAX)
+                {
+                    dying_variable_t *variable = arena_alloc(context->arena, sizeof(dying_variable_t));
+                    variable->location = symbol_map_get_local(context->symbols, statement->op.declare.name).location;
+                    variable->next = dying[last_use];
+                    dying[last_use] = variable;
+                }
+            }
+
+            for (dying_variable_t *variable = dying[i]; variable != NULL; variable = variable->next)
+                release_variable(context, variable->location);
         }
     }
 
-    // Restore code block
-    context->current_code_block = previous_block;
+    context->registers = previous_registers;
+    context->rp = previous_rp;
 
     // Restore scope
     context->symbols = context->symbols->parent;
-    symbol_map_destroy(inner_scope);
 
-    // Modify result to include our generated block
-    result.code = inner_block;
     return result;
 }
 
@@ -168,15 +760,41 @@ compile_result_t compile_literal(ast_t *ast, compile_context_t *context)
     switch (ast->op.literal.token.type)
     {
         case TOK_NUMBER:
-            code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, context->rp, atoi(ast->op.literal.value)));
+        {
+            int number = atoi(ast->op.literal.value);
+
+            // loadv only has room for 16 bits, so anything bigger goes in the
+            // constant pool
+            if (number >= INT16_MIN && number <= INT16_MAX)
+            {
+                code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, context->rp, number));
+            }
+            else
+            {
+                memory_set(context->binary->data, context->mp, value_from_int(number));
+                code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, context->mp++));
+            }
             type = VAL_INT;
             break;
+        }
 
         case TOK_STRING:
-            memory_set(context->binary->data, context->mp, value(ast->op.literal.value));
-            code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, context->mp++));
+        {
+            // Literals are interned, and each one only takes up one slot in
+            // the constant pool no matter how often it appears
+            symbol_t constant = symbol_map_get_local(context->strings, ast->op.literal.value);
+
+            if (constant.location.type == LOC_UNDEF)
+            {
+                constant = (symbol_t){ .name=ast->op.literal.value, .type=SYM_CONSTANT, .location={ .type=LOC_MEMORY, .address=context->mp++ } };
+                memory_set(context->binary->data, constant.location.address, string_intern(ast->op.literal.value));
+                symbol_map_set(context->strings, constant);
+            }
+
+            code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, constant.location.address));
             type = VAL_STRING;
             break;
+        }
 
         case TOK_FLOAT:
             memory_set(context->binary->data, context->mp, value(atof(ast->op.literal.value)));
@@ -207,18 +825,32 @@ compile_result_t compile_literal(ast_t *ast, compile_context_t *context)
                     exit(1);
                 }
 
-                type = VAL_UNKNOWN;
                 if (identifier.type == SYM_FN)
                 {
-                    type = VAL_FUNCTION;
+                    // Nothing to load
                 }
                 else if (identifier.location.type == LOC_MEMORY)
                 {
                     code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, identifier.location.address));
                     identifier.location.type = LOC_REGISTER;
                     identifier.location.address = context->rp++;
+                    identifier.depth = context->depth;
                     symbol_map_set(context->symbols, identifier);
                 }
+                else if (symbol_is_global(context, identifier, ast))
+                {
+                    // Globals can be changed by anything we call, so they
+                    // are fetched fresh every time
+                    code_block_write(context->current_code_block, INSTRUCTION(OP_GETGLOBAL, context->rp, identifier.location.address));
+                    identifier.location.address = context->rp;
+                }
+                else if (identifier.location.type == LOC_SPILLED)
+                {
+                    code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, identifier.location.address));
+                    identifier.location.address = context->rp;
+                }
+
+                type = symbol_static_type(context, identifier);
 
                 result = identifier.location.address;
             }
@@ -228,49 +860,35 @@ compile_result_t compile_literal(ast_t *ast, compile_context_t *context)
             break;
     }
 
-    return (compile_result_t){ .location=result, .type=type, .code=NULL };
+    return (compile_result_t){ .location=result, .type=type };
 }
 
 compile_result_t compile_tuple(ast_t *ast, compile_context_t *context)
 {
-    uint8_t *registers = (uint8_t *)malloc(sizeof(uint8_t) * ast->op.list.size);
-    uint8_t restore_register = context->rp;
+    uint16_t first = context->rp;
 
-    // First, calculate the values of the tuple
+    // Calculate the values of the tuple into consecutive registers, so that
+    // one instruction can gather them all up
     for (int i = 0; i < ast->op.list.size; i++)
     {
         compile_result_t result = compile_ast(ast->op.list.items[i], context);
-        registers[i] = result.location;
 
-        if (registers[i] == context->rp)
-            context->rp++;
-    }
+        if (result.location != first + i)
+            code_block_write(context->current_code_block, INSTRUCTION(OP_MOVE, first + i, result.location));
 
-    // Now, push them on the stack in reverse order
-    for (int i = ast->op.list.size - 1; i >= 0; i--)
-    {
-        code_block_write(context->current_code_block, INSTRUCTION(OP_PUSH, registers[i]));
+        context->rp = first + i + 1;
     }
 
-    context->rp = restore_register;
-    free(registers);
-
-    // Now, set register 0 to the number of args
-    code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, 0, ast->op.list.size));
+    context->rp = first;
 
-    // Call tuple
-    value_t builtin_name = string_create("tuple");
-    memory_set(context->binary->data, context->mp, builtin_name);
+    code_block_write(context->current_code_block, INSTRUCTION(OP_TUPLE, context->rp, first, ast->op.list.size));
 
-    code_block_write(context->current_code_block, INSTRUCTION(OP_CALL_DYNAMIC, context->mp++));
-    code_block_write(context->current_code_block, INSTRUCTION(OP_POP, context->rp));
-
-    return (compile_result_t){ .location=context->rp, .type=VAL_TUPLE, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=VAL_TUPLE };
 }
 
 compile_result_t compile_range(ast_t *ast, compile_context_t *context)
 {
-    uint8_t restore_register = context->rp;
+    uint16_t restore_register = context->rp;
 
     uint8_t registers[2];
     registers[0] = compile_ast(ast->op.range.begin, context).location;
@@ -278,7 +896,8 @@ compile_result_t compile_range(ast_t *ast, compile_context_t *context)
     registers[1] = compile_ast(ast->op.range.end, context).location;
     context->rp = restore_register;
 
-    compile_result_t result = write_out_builtin(context, "range", 2, registers);
+    compile_result_t result = write_out_builtin(context, builtin_lookup("range"), 2, registers);
+    result.type = VAL_RANGE;
     return result;
 
 }
@@ -295,6 +914,7 @@ compile_result_t compile_unary(ast_t *ast, compile_context_t *context)
 
         case TOK_BANG:
             code_block_write(context->current_code_block, INSTRUCTION(OP_NOT, context->rp, right.location));
+            right.type = VAL_BOOLEAN;
             break;
 
         case TOK_RETURN:
@@ -305,28 +925,105 @@ compile_result_t compile_unary(ast_t *ast, compile_context_t *context)
             ;
     }
 
-    return (compile_result_t){ .location=context->rp, .type=right.type, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=right.type };
 }
 
-compile_result_t compile_binary_comparison(uint8_t opcode, uint8_t base_register, uint8_t condition, uint8_t left, uint8_t right)
+static bool is_comparison(enum token_type_e type)
 {
-    code_block_t *block = code_block_create();
+    switch (type)
+    {
+        case TOK_EQUAL_EQUAL:
+        case TOK_BANG_EQUAL:
+        case TOK_LESS:
+        case TOK_LESS_EQUAL:
+        case TOK_GREATER:
+        case TOK_GREATER_EQUAL:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// Compile the code to evaluate a condition, returning a jump that is taken
+// when the condition is false. Comparisons become a single compare-and-jump,
+// anything else is evaluated and then tested. The caller fills in the jump's
+// offset and writes it out.
+instruction_t compile_jump_if_false(ast_t *condition, compile_context_t *context)
+{
+    while (condition->type == AST_GROUP)
+        condition = condition->op.group;
+
+    if (condition->type != AST_BINARY || !is_comparison(condition->op.binary.operator.type))
+    {
+        compile_result_t result = compile_ast(condition, context);
+        return BRANCH(OP_JMP_FALSE, result.location, 0, 0);
+    }
+
+    compile_result_t left = compile_ast(condition->op.binary.left, context);
+    context->rp += 1;
+    compile_result_t right = compile_ast(condition->op.binary.right, context);
+    context->rp -= 1;
+
+    uint8_t opcode;
+    uint8_t first = left.location, second = right.location;
+
+    switch (condition->op.binary.operator.type)
+    {
+        case TOK_EQUAL_EQUAL:
+            opcode = OP_JMP_NOT_EQUAL;
+            break;
 
-    // This is the false case
-    code_block_write(block, INSTRUCTION(OP_LOAD, base_register, 0));
+        case TOK_BANG_EQUAL:
+            opcode = OP_JMP_EQUAL;
+            break;
+
+        case TOK_LESS:
+            opcode = OP_JMP_NOT_LESSTHAN;
+            break;
 
-    // This is the comparison instruction
-    code_block_write(block, INSTRUCTION(opcode, condition, left, right));
+        // a >= b is false when a < b
+        case TOK_GREATER_EQUAL:
+            opcode = OP_JMP_LESSTHAN;
+            break;
 
-    // This is the true case
-    code_block_write(block, INSTRUCTION(OP_LOAD, base_register, 1));
+        // a > b is false when !(b < a)
+        case TOK_GREATER:
+            opcode = OP_JMP_NOT_LESSTHAN;
+            first = right.location;
+            second = left.location;
+            break;
 
-    return (compile_result_t){ .location=base_register, .type=VAL_BOOLEAN, .code=block };
+        // a <= b is false when b < a
+        default:
+            opcode = OP_JMP_LESSTHAN;
+            first = right.location;
+            second = left.location;
+            break;
+    }
+
+    return BRANCH(specialize_opcode(opcode, left.type, right.type), first, second, 0);
+}
+
+// Compile a comparison for its value, as opposed to branching on it
+compile_result_t compile_comparison(ast_t *ast, compile_context_t *context)
+{
+    instruction_t jump = compile_jump_if_false(ast, context);
+
+    jump.fields.branch.offset = 3;
+    code_block_write(context->current_code_block, jump);
+    code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, 1));
+    code_block_write(context->current_code_block, JUMP(2));
+    code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, 0));
+
+    return (compile_result_t){ .location=context->rp, .type=VAL_BOOLEAN };
 }
 
 compile_result_t compile_binary(ast_t *ast, compile_context_t *context)
 {
-    compile_result_t intermediate_result = {0, VAL_ABSENT, NULL};
+    if (is_comparison(ast->op.binary.operator.type))
+        return compile_comparison(ast, context);
+
     compile_result_t left = compile_ast(ast->op.binary.left, context);
     context->rp += 1;
 
@@ -344,17 +1041,17 @@ compile_result_t compile_binary(ast_t *ast, compile_context_t *context)
     {
         //-- Arithmetic
         case TOK_PLUS:
-            instruction = INSTRUCTION(OP_ADD, context->rp, left.location, right.location);
+            instruction = INSTRUCTION(specialize_opcode(OP_ADD, left.type, right.type), context->rp, left.location, right.location);
             type = arithmetic_cast(left.type, right.type);
             break;
 
         case TOK_MINUS:
-            instruction = INSTRUCTION(OP_SUBTRACT, context->rp, left.location, right.location);
+            instruction = INSTRUCTION(specialize_opcode(OP_SUBTRACT, left.type, right.type), context->rp, left.location, right.location);
             type = arithmetic_cast(left.type, right.type);
             break;
 
         case TOK_ASTERISK:
-            instruction = INSTRUCTION(OP_MULTIPLY, context->rp, left.location, right.location);
+            instruction = INSTRUCTION(specialize_opcode(OP_MULTIPLY, left.type, right.type), context->rp, left.location, right.location);
             type = arithmetic_cast(left.type, right.type);
             break;
 
@@ -391,48 +1088,6 @@ compile_result_t compile_binary(ast_t *ast, compile_context_t *context)
             type = VAL_BOOLEAN;
             break;
 
-        case TOK_EQUAL_EQUAL:
-            intermediate_result = compile_binary_comparison(OP_EQUAL, context->rp + 2, 1, left.location, right.location);
-            instruction = INSTRUCTION(OP_MOVE, context->rp, intermediate_result.location);
-            type = VAL_BOOLEAN;
-            break;
-
-        case TOK_BANG_EQUAL:
-            intermediate_result = compile_binary_comparison(OP_EQUAL, context->rp + 2, 0, left.location, right.location);
-            instruction = INSTRUCTION(OP_MOVE, context->rp, intermediate_result.location);
-            type = VAL_BOOLEAN;
-            break;
-
-        case TOK_LESS:
-            intermediate_result = compile_binary_comparison(OP_LESSTHAN, context->rp + 2, 1, left.location, right.location);
-            instruction = INSTRUCTION(OP_MOVE, context->rp, intermediate_result.location);
-            type = VAL_BOOLEAN;
-            break;
-
-        case TOK_LESS_EQUAL:
-            intermediate_result = compile_binary_comparison(OP_LESSTHAN, context->rp + 2, 1, left.location, right.location);
-            code_block_merge(context->current_code_block, intermediate_result.code);
-            code_block_free(intermediate_result.code);
-            intermediate_result = compile_binary_comparison(OP_EQUAL, context->rp + 3, 1, left.location, right.location);
-            instruction = INSTRUCTION(OP_OR, context->rp, context->rp + 2, context->rp + 3);
-            type = VAL_BOOLEAN;
-            break;
-
-        case TOK_GREATER:
-            intermediate_result = compile_binary_comparison(OP_LESSTHAN, context->rp + 2, 0, left.location, right.location);
-            instruction = INSTRUCTION(OP_MOVE, context->rp, intermediate_result.location);
-            type = VAL_BOOLEAN;
-            break;
-
-        case TOK_GREATER_EQUAL:
-            intermediate_result = compile_binary_comparison(OP_LESSTHAN, context->rp + 2, 0, left.location, right.location);
-            code_block_merge(context->current_code_block, intermediate_result.code);
-            code_block_free(intermediate_result.code);
-            intermediate_result = compile_binary_comparison(OP_EQUAL, context->rp + 3, 1, left.location, right.location);
-            instruction = INSTRUCTION(OP_OR, context->rp, context->rp + 2, context->rp + 3);
-            type = VAL_BOOLEAN;
-            break;
-
         case TOK_DOT:
         {
             // Currently, the left side must be a literal
@@ -457,14 +1112,8 @@ compile_result_t compile_binary(ast_t *ast, compile_context_t *context)
             ;
     }
 
-    if (intermediate_result.code != NULL)
-    {
-        code_block_merge(context->current_code_block, intermediate_result.code);
-        code_block_free(intermediate_result.code);
-    }
-
     code_block_write(context->current_code_block, instruction);
-    return (compile_result_t){ .location=context->rp, .type=type, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=type };
 }
 
 compile_result_t compile_assign(ast_t *ast, compile_context_t *context)
@@ -491,6 +1140,7 @@ compile_result_t compile_assign(ast_t *ast, compile_context_t *context)
         exit(1);
     }
 
+    size_t start = context->current_code_block->size;
     compile_result_t rvalue = compile_ast(ast->op.assign.value, context);
 
     switch (rvalue.type)
@@ -502,42 +1152,62 @@ compile_result_t compile_assign(ast_t *ast, compile_context_t *context)
             break;
 
         default:
-            code_block_write(context->current_code_block, INSTRUCTION(OP_MOVE, symbol.location.address, rvalue.location));
+            if (rvalue.type != symbol.value_type)
+                symbol_forget_type(context, ast->op.assign.name);
+
+            if (symbol_is_global(context, symbol, ast))
+            {
+                code_block_write(context->current_code_block, INSTRUCTION(OP_SETGLOBAL, symbol.location.address, rvalue.location));
+                return (compile_result_t){ .location=rvalue.location, .type=rvalue.type };
+            }
+
+            if (symbol.location.type == LOC_SPILLED)
+            {
+                code_block_write(context->current_code_block, INSTRUCTION(OP_STORE, rvalue.location, symbol.location.address));
+                return (compile_result_t){ .location=rvalue.location, .type=rvalue.type };
+            }
+
+            write_value_to(context, symbol.location.address, rvalue, start);
             break;
     }
 
-    return (compile_result_t){ .location=symbol.location.address, .type=rvalue.type, NULL};
+    return (compile_result_t){ .location=symbol.location.address, .type=rvalue.type };
 }
 
 compile_result_t compile_declare(ast_t *ast, compile_context_t *context)
 {
-    value_type_e type = VAL_ABSENT;
-    symbol_t symbol = (symbol_t){ .location={ .address=0, .type=LOC_NONE }, .name=ast->op.declare.name };
+    symbol_t symbol = (symbol_t){ .name=ast->op.declare.name, .depth=context->depth };
     symbol.type = (ast->op.declare.var_type.type == TOK_VAR) ? SYM_VAR : SYM_CONSTANT;
 
+    size_t start = context->current_code_block->size;
+    compile_result_t initial_value = { .location=context->rp, .type=VAL_ABSENT };
+
+    // Variables without an initial value start out as nil, since whatever was
+    // in their register before is still there
     if (ast->op.declare.initial_value != NULL)
-    {
-        compile_result_t initial_value = compile_ast(ast->op.declare.initial_value, context);
-        type = initial_value.type;
+        initial_value = compile_ast(ast->op.declare.initial_value, context);
+    else
+        code_block_write(context->current_code_block, INSTRUCTION(OP_NIL, context->rp));
 
-        symbol.location.type = LOC_REGISTER;
-        if (type == VAL_FUNCTION)
-        {
-            symbol.location.type = LOC_MEMORY;
-        }
+    value_type_e type = initial_value.type;
+    symbol.value_type = type;
 
-        symbol.location.address = initial_value.location;
-        context->rp += 1;
-    }
+    if (type == VAL_FUNCTION)
+        symbol.location = (sym_pointer_t){ .type=LOC_MEMORY, .address=initial_value.location };
+    else
+        symbol.location = place_variable(context, initial_value, start);
 
     symbol_map_set(context->symbols, symbol);
-    return (compile_result_t){ .location=symbol.location.address, .type=type, .code=NULL};
+
+    // A spilled variable's value is still in the register it was calculated in
+    uint8_t location = (symbol.location.type == LOC_SPILLED) ? initial_value.location : symbol.location.address;
+    return (compile_result_t){ .location=location, .type=type };
 }
 
 compile_result_t compile_fn_declaration(ast_t *ast, compile_context_t *context)
 {
     // Create our inner scope for this function
-    symbol_map_t *inner_scope = symbol_map_create();
+    symbol_map_t *inner_scope = symbol_map_create_in(context->arena);
     inner_scope->parent = context->symbols;
     context->symbols = inner_scope;
 
@@ -549,15 +1219,21 @@ compile_result_t compile_fn_declaration(ast_t *ast, compile_context_t *context)
     context->cp = context->binary->code->size - 1;
     context->current_code_block = fn_block;
 
-    uint8_t restore_register = context->rp;
+    // Functions get a fresh register window. $0 is where our caller expects
+    // the return value, and the arguments follow it.
+    uint16_t restore_register = context->rp;
+    register_state_t previous_registers = context->registers;
+    spill_slot_t *previous_slots = context->function_slots;
+    context->rp = 1;
+    context->registers = (register_state_t){ 0 };
+    context->function_slots = NULL;
+    context->depth += 1;
 
     ast_t *args = ast->op.fn.args;
     value_t fn_def = function_def_create(
                 ast->op.fn.name,
                 (address_t){ .region=context->cp, .offset=0 },
-                (args == NULL) ? 0 : args->op.list.size,
-                NULL,
-                context->rp
+                (args == NULL) ? 0 : args->op.list.size
             );
     memory_set(context->binary->data, context->mp, fn_def);
 
@@ -566,6 +1242,8 @@ compile_result_t compile_fn_declaration(ast_t *ast, compile_context_t *context)
     symbol.type = SYM_FN;
     symbol.location.type = LOC_MEMORY;
     symbol.location.address = context->mp++;
+    symbol.depth = context->depth - 1;
+    symbol.value_type = VAL_FUNCTION;
 
     symbol_map_set(context->symbols, symbol);
 
@@ -578,24 +1256,14 @@ compile_result_t compile_fn_declaration(ast_t *ast, compile_context_t *context)
             arg.location.address = context->rp + i;
             arg.name = args->op.list.items[i]->op.literal.value;
             arg.type = SYM_VAR;
+            arg.depth = context->depth;
+            arg.value_type = VAL_UNKNOWN;
             symbol_map_set(context->symbols, arg);
         }
         context->rp += args->op.list.size;
     }
 
-    // Construct locals to keep track of
-    uint8_t *locals = (uint8_t *)malloc(context->rp - restore_register + 1);
-    for (int i = restore_register; i < context->rp + 1; i++)
-    {
-        locals[i - restore_register] = i;
-    }
-    locals[context->rp - restore_register + 1] = 0;
-
-    function_t *fn_prototype = (function_t *)fn_def.contents.object;
-    fn_prototype->locals = locals;
-
     compile_result_t fn_result = compile_ast(ast->op.fn.body, context);
-    code_block_free(fn_result.code);
 
     // If return was implicit, add it in now
     size_t last = context->current_code_block->size - 1;
@@ -603,30 +1271,47 @@ compile_result_t compile_fn_declaration(ast_t *ast, compile_context_t *context)
         code_block_write(context->current_code_block, INSTRUCTION(OP_RETURN, fn_result.location));
 
     // Reset state
-    symbol_map_t *map = context->symbols;
     context->symbols = context->symbols->parent;
-    symbol_map_destroy(map);
     context->cp = previous_code_pointer;
     context->current_code_block = previous_code_block;
 
     symbol_map_set(context->symbols, symbol);
     context->rp = restore_register;
+    context->registers = previous_registers;
+    context->function_slots = previous_slots;
+    context->depth -= 1;
 
-    // If the function is external, put it in our binary symbol map
+    // If the function is external, put it in our binary symbol map. That
+    // outlives the arena, so it needs its own copy of the name.
     if (ast->op.fn.exported)
+    {
+        symbol.name = strdup(symbol.name);
         symbol_map_set(context->binary->symbols, symbol);
+    }
 
-    return (compile_result_t){ .location=symbol.location.address, .type=VAL_FUNCTION, .code=NULL };
+    return (compile_result_t){ .location=symbol.location.address, .type=VAL_FUNCTION };
 }
 
 compile_result_t compile_fn_call_builtin(ast_t *ast, compile_context_t *context)
 {
     ast_t *args = ast->op.call.args;
-    uint8_t *arg_registers;
+    int builtin = builtin_lookup(ast->op.call.name);
+
+    if (builtin < 0)
+    {
+        char *error;
+        location_t loc = {ast->location.start, ast->location.end};
+        asprintf(&error, "Use of undeclared function \"%s\"", ast->op.call.name);
+        printf("%s", format_error_found_here(context->name, context->listing, error, loc));
+        exit(1);
+    }
+
+    uint8_t *arg_registers = NULL;
     uint8_t number_of_args = 0;
+    uint16_t reset_register = context->rp;
     if (args != NULL)
     {
-        arg_registers = (uint8_t *)malloc(sizeof(uint8_t) * args->op.list.size);
+        arg_registers = arena_alloc(context->arena, sizeof(uint8_t) * args->op.list.size);
         number_of_args = args->op.list.size;
 
         // First, calculate the values of our arguments
@@ -640,11 +1325,11 @@ compile_result_t compile_fn_call_builtin(ast_t *ast, compile_context_t *context)
         }
     }
 
-    compile_result_t result = write_out_builtin(context, ast->op.fn.name, number_of_args, arg_registers);
-
-    free(arg_registers);
+    // The arguments are only needed until they're pushed, and the result
+    // goes where the first one was
+    context->rp = reset_register;
 
-    return result;
+    return write_out_builtin(context, builtin, number_of_args, arg_registers);
 }
 
 compile_result_t compile_fn_call_native(ast_t *ast, compile_context_t *context)
@@ -655,52 +1340,21 @@ compile_result_t compile_fn_call_native(ast_t *ast, compile_context_t *context)
     // Native function calls must exist in memory
     assert(fn_symbol.location.type == LOC_MEMORY);
 
-    function_t *function = (function_t *)memory_get(context->binary->data, fn_symbol.location.address).contents.object;
-
-    // Now, iterate through the function args and save any locals that conflict
-    for (uint8_t i = 0; i < function->nargs; i++)
-    {
-
-        if (function->locals == NULL)
-        {
-            if (function->low_reg + i >= context->rp)
-                continue;
-
-            code_block_write(context->current_code_block, INSTRUCTION(OP_PUSH, function->low_reg + i));
-        }
-        else if (function->locals[i] < context->rp)
-            code_block_write(context->current_code_block, INSTRUCTION(OP_PUSH, function->locals[i]));
-    }
+    function_t *function = (function_t *)value_as_object(memory_get(context->binary->data, fn_symbol.location.address));
 
-
-    uint8_t restore_register = context->rp;
-    if (args != NULL)
+    if (args != NULL && args->op.list.size != function->nargs)
     {
-        if (args->op.list.size != function->nargs)
-        {
-            char *error;
-            location_t loc = {ast->location.start, ast->location.end};
-            asprintf(&error, "Function \"%s\" expected %d arguments, but was passed %ld.",
-                     function->name,
-                     function->nargs,
-                     args->op.list.size
-            );
-            printf("%s", format_error_found_here(context->name, context->listing, error, loc));
-            exit(1);
-        }
-
-        for (int i = 0; i < args->op.list.size; i++)
-        {
-            compile_result_t arg = compile_ast(args->op.list.items[i], context);
-
-            // If we weren't serendipitous, move things around
-            if (arg.location != function->locals[i])
-                code_block_write(context->current_code_block, INSTRUCTION(OP_MOVE, function->locals[i], arg.location));
-
-            context->rp += 1;
-        }
+        char *error;
+        location_t loc = {ast->location.start, ast->location.end};
+        asprintf(&error, "Function \"%s\" expected %d arguments, but was passed %ld.",
+                 function->name,
+                 function->nargs,
+                 args->op.list.size
+        );
+        printf("%s", format_error_found_here(context->name, context->listing, error, loc));
+        exit(1);
     }
-    else if (function->nargs > 0)
+    else if (args == NULL && function->nargs > 0)
     {
         char *error;
         location_t loc = {ast->location.start, ast->location.end};
@@ -712,23 +1366,40 @@ compile_result_t compile_fn_call_native(ast_t *ast, compile_context_t *context)
         exit(1);
     }
 
-    // Call the function
-    code_block_write(context->current_code_block, INSTRUCTION(OP_CALL, fn_symbol.location.address));
+    // The callee's register window starts at our next free register, which
+    // is also where the return value ends up. Arguments go right after it.
+    uint16_t call_register = context->rp;
+    bool save_slots = context->depth > 0 && context->function_slots != NULL;
 
-    // Restore RP
-    context->rp = restore_register;
+    // Arguments go in the registers after call_register, and spill slots are
+    // restored through the one right after it
+    check_registers(context, call_register + ((save_slots && function->nargs == 0) ? 1 : function->nargs), ast);
 
-    // Pop the return value
-    code_block_write(context->current_code_block, INSTRUCTION(OP_POP, context->rp));
+    if (save_slots)
+        save_spill_slots(context, call_register);
 
-    // Pop our locals back into registers
-    for (int i = function->nargs - 1; i >= 0; --i)
+    for (int i = 0; i < function->nargs; i++)
     {
-        if (function->low_reg + i < context->rp)
-            code_block_write(context->current_code_block, INSTRUCTION(OP_POP, function->low_reg + i));
+        uint8_t arg_register = call_register + 1 + i;
+
+        context->rp = arg_register;
+        compile_result_t arg = compile_ast(args->op.list.items[i], context);
+
+        // If we weren't serendipitous, move things around
+        if (arg.location != arg_register)
+            code_block_write(context->current_code_block, INSTRUCTION(OP_MOVE, arg_register, arg.location));
     }
 
-    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN, .code=NULL };
+    // Call the function
+    code_block_write(context->current_code_block, INSTRUCTION(OP_CALL, call_register, fn_symbol.location.address));
+
+    if (save_slots)
+        restore_spill_slots(context, context->function_slots, call_register + 1);
+
+    // Restore RP
+    context->rp = call_register;
+
+    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN };
 }
 
 compile_result_t compile_fn_call(ast_t *ast, compile_context_t *context)
@@ -753,94 +1424,88 @@ compile_result_t compile_fn_call(ast_t *ast, compile_context_t *context)
 
 compile_result_t compile_if_statement(ast_t *ast, compile_context_t *context)
 {
-    uint8_t restore_register = context->rp;
-
-    // Compile the parts of our if statement
-    compile_result_t if_condition = compile_ast(ast->op.if_stmt.condition, context);
-    compile_result_t if_body = compile_statement_list(ast->op.if_stmt.body, context);
-
-    // Increment rp if necessary
-    if (if_body.location == context->rp)
-        context->rp += 1;
-
-    // How far ahead to jump if we evaluate to false
-    code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, context->rp++, if_body.code->size + 1));
+    uint16_t restore_register = context->rp;
 
-    // Test the condition
-    code_block_write(context->current_code_block, INSTRUCTION(OP_LOAD, context->rp, 1));
-    code_block_write(context->current_code_block, INSTRUCTION(OP_EQUAL, 0, context->rp, if_condition.location));
-
-    // Jump if false
-    code_block_write(context->current_code_block, INSTRUCTION(OP_JMP, context->rp - 1));
+    // Jump over the body if the condition is false, once we know how long
+    // the body is
+    instruction_t jump = compile_jump_if_false(ast->op.if_stmt.condition, context);
+    size_t placeholder = write_placeholder(context, jump);
+    context->rp = restore_register;
 
+    compile_statement_list(ast->op.if_stmt.body, context);
     context->rp = restore_register;
 
-    code_block_merge(context->current_code_block, if_body.code);
-    code_block_free(if_body.code);
+    patch_jump(context, placeholder);
 
-    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN };
 }
 
 compile_result_t compile_for_statement(ast_t *ast, compile_context_t *context)
 {
+    // The loop keeps its state in three consecutive registers: a copy of the
+    // collection, the index of the next element, and the loop variable
+    uint16_t loop = context->rp;
+    uint16_t index = loop + 1;
+    uint16_t var = loop + 2;
+
+    check_registers(context, loop + 2, ast);
+
     // Compile our collection
     compile_result_t collection = compile_ast(ast->op.for_stmt.iterable, context);
 
-    // Next, make an iterator over the collection
-    compile_result_t iter_result = write_out_builtin(context, "iter", 1, &collection.location);
+    if (collection.location != loop)
+        code_block_write(context->current_code_block, INSTRUCTION(OP_MOVE, loop, collection.location));
 
-    // Need to keep track of our iterator
-    context->rp += 1;
+    code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, index, 0));
+    context->rp = var + 1;
 
     // Now, define a new symbol map for the for loop
-    symbol_map_t *for_map = symbol_map_create();
+    symbol_map_t *for_map = symbol_map_create_in(context->arena);
     for_map->parent = context->symbols;
     context->symbols = for_map;
 
-    // This will point to our local variable. We'll need this even if it's not
-    // defined by the user.
-    uint8_t var = context->rp++;
-    uint8_t nil = context->rp++;
-
-    code_block_write(context->current_code_block, INSTRUCTION(OP_NIL, nil));
-
     // If a local variable was defined, set it in the synbol map
     if (ast->op.for_stmt.var != NULL)
     {
-        symbol_t symbol = { .type=SYM_VAR, .name=ast->op.for_stmt.var, .location={ .type=LOC_REGISTER, .address=var } };
+        symbol_t symbol = { .type=SYM_VAR, .name=ast->op.for_stmt.var, .location={ .type=LOC_REGISTER, .address=var }, .depth=context->depth };
+
+        // Ranges only ever hold integers
+        if (collection.type == VAL_RANGE)
+            symbol.value_type = VAL_INT;
+
         symbol_map_set(context->symbols, symbol);
     }
 
-    // Compile our body
-    compile_result_t for_body = compile_statement_list(ast->op.for_stmt.body, context);
+    // The body runs more than once, so an assignment near its end can change
+    // the type of a variable used near its start. Forget the type of anything
+    // that could change, until nothing more does.
+    while (forget_assigned_types(ast->op.for_stmt.body, context))
+        ;
 
-    // Begin for-loop
-    code_block_write(context->current_code_block, INSTRUCTION(OP_DEREF, var, iter_result.location, 1));
+    // Enter the loop at the bottom, where foriter either loads the first
+    // element and jumps back up to the body, or falls through
+    size_t placeholder = write_placeholder(context, JUMP(0));
+    size_t body = context->current_code_block->size;
 
-    // Exit jump
-    code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, context->rp, for_body.code->size + 3));
-    code_block_write(context->current_code_block, INSTRUCTION(OP_EQUAL, 1, var, nil));
-    code_block_write(context->current_code_block, INSTRUCTION(OP_JMP, context->rp));
+    compile_statement_list(ast->op.for_stmt.body, context);
 
-    code_block_merge(context->current_code_block, for_body.code);
+    patch_jump(context, placeholder);
 
-    // Jump to the start of the loop
-    code_block_write(context->current_code_block, INSTRUCTION(OP_LOADV, context->rp, (for_body.code->size + 5) * -1));
-    code_block_write(context->current_code_block, INSTRUCTION(OP_JMP, context->rp));
-    code_block_free(for_body.code);
+    size_t foriter = context->current_code_block->size;
+    assert(foriter - body < INT16_MAX);
+    code_block_write(context->current_code_block, BRANCH(OP_FORITER, loop, 0, -(int16_t)(foriter - body)));
 
-    context->rp -= 2;
+    context->rp = loop;
 
     // Reset symbol map
     context->symbols = context->symbols->parent;
-    symbol_map_destroy(for_map);
 
-    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=VAL_UNKNOWN };
 }
 
 compile_result_t compile_module(ast_t *ast, compile_context_t *context)
 {
-    value_t module_name = string_create(ast->op.module.name);
+    value_t module_name = string_intern(ast->op.module.name);
 
     memory_set(context->binary->data, context->mp, module_name);
 
@@ -850,18 +1515,22 @@ compile_result_t compile_module(ast_t *ast, compile_context_t *context)
 
     code_block_write(context->current_code_block, INSTRUCTION(OP_IMPORT, context->mp++));
 
-    return (compile_result_t){ .location=context->rp, .type=VAL_MODULE, .code=NULL };
+    return (compile_result_t){ .location=context->rp, .type=VAL_MODULE };
 }
 
 compile_result_t compile_ast(ast_t *ast, compile_context_t *context)
 {
     compile_result_t result;
+
+    // A statement list has no location of its own, so its statements are
+    // checked as they're compiled instead
+    if (ast->type != AST_STMT_LIST)
+        check_registers(context, context->rp, ast);
+
     switch (ast->type)
     {
         case AST_STMT_LIST:
             result = compile_statement_list(ast, context);
-            // Here we merge the result into the current code block
-            code_block_merge(context->current_code_block, result.code);
             break;
 
         case AST_LITERAL:
@@ -922,10 +1591,13 @@ compile_result_t compile_ast(ast_t *ast, compile_context_t *context)
     return result;
 }
 
-binary_t *compile(const char *name, const char *listing, ast_t *ast)
+binary_t *compile(const char *name, const char *listing, ast_t *ast, arena_t *arena)
 {
-    compile_context_t *context = context_create(name, listing);
+    compile_context_t *context = context_create(name, listing, arena);
+    ast = fold_constants(name, listing, ast, arena);
     compile_ast(ast, context);
+    ir_optimize_binary(context->binary, context->arena);
+    peephole_optimize(context->binary->code, context->arena);
     binary_t *binary = context->binary;
     context_destroy(context);
     return binary;
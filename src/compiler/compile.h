@@ -11,6 +11,8 @@
 #include "machine/binary.h"
 #include "parse.h"
 
-binary_t *compile(const char *, const char *, ast_t *);
+// Compile a syntax tree into a binary. The tree's arena, and everything else
+// the compiler allocates along the way, is freed before this returns.
+binary_t *compile(const char *, const char *, ast_t *, arena_t *);
 
 #endif
@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fold.h"
+#include "symbol.h"
+#include "util/error.h"
+
+typedef struct
+{
+    // Name of the module we are folding, and its source, for errors
+    const char *name;
+    const char *listing;
+    arena_t *arena;
+    // The names in scope that matter to us. A let constant with a literal
+    // value is a SYM_CONSTANT whose address is an index into values, and a
+    // SYM_VAR is anything else that shadows one.
+    symbol_map_t *scope;
+    ast_t **values;
+    size_t num_values;
+    size_t values_capacity;
+} fold_context_t;
+
+// The value of a literal, as the VM would see it
+typedef struct
+{
+    value_type_e type;
+    union
+    {
+        int integer;
+        float real;
+        bool boolean;
+        const char *string;
+    };
+} constant_t;
+
+static ast_t *fold(ast_t *ast, fold_context_t *context);
+
+//-- Constants
+
+static bool constant_of(ast_t *ast, constant_t *constant)
+{
+    if (ast == NULL || ast->type != AST_LITERAL)
+        return false;
+
+    switch (ast->op.literal.token.type)
+    {
+        case TOK_NUMBER:
+            *constant = (constant_t){ .type=VAL_INT, .integer=atoi(ast->op.literal.value) };
+            return true;
+
+        // Floats are single precision once they're loaded
+        case TOK_FLOAT:
+            *constant = (constant_t){ .type=VAL_FLOAT, .real=(float)atof(ast->op.literal.value) };
+            return true;
+
+        case TOK_TRUE:
+        case TOK_FALSE:
+            *constant = (constant_t){ .type=VAL_BOOLEAN, .boolean=(ast->op.literal.token.type == TOK_TRUE) };
+            return true;
+
+        case TOK_STRING:
+            *constant = (constant_t){ .type=VAL_STRING, .string=ast->op.literal.value };
+            return true;
+
+        case TOK_NIL:
+            *constant = (constant_t){ .type=VAL_NIL };
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static ast_t *make_literal(fold_context_t *context, constant_t constant, location_t location)
+{
+    ast_t *literal = arena_alloc(context->arena, sizeof(ast_t));
+    char buffer[32];
+
+    literal->type = AST_LITERAL;
+    literal->location = location;
+    literal->op.literal.token.start = location.start;
+    literal->op.literal.token.end = location.end;
+
+    switch (constant.type)
+    {
+        case VAL_INT:
+            literal->op.literal.token.type = TOK_NUMBER;
+            snprintf(buffer, sizeof(buffer), "%d", constant.integer);
+            break;
+
+        // Nine significant digits are enough for any float to survive the
+        // trip through the literal
+        case VAL_FLOAT:
+            literal->op.literal.token.type = TOK_FLOAT;
+            snprintf(buffer, sizeof(buffer), "%.9g", constant.real);
+            break;
+
+        case VAL_BOOLEAN:
+            literal->op.literal.token.type = constant.boolean ? TOK_TRUE : TOK_FALSE;
+            literal->op.literal.value = constant.boolean ? "true" : "false";
+            return literal;
+
+        case VAL_STRING:
+            literal->op.literal.token.type = TOK_STRING;
+            literal->op.literal.value = (char *)constant.string;
+            return literal;
+
+        default:
+            literal->op.literal.token.type = TOK_NIL;
+            literal->op.literal.value = "nil";
+            return literal;
+    }
+
+    literal->op.literal.value = arena_alloc(context->arena, strlen(buffer) + 1);
+    strcpy(literal->op.literal.value, buffer);
+    return literal;
+}
+
+static bool is_number(constant_t constant)
+{
+    return constant.type == VAL_INT || constant.type == VAL_FLOAT;
+}
+
+// Numbers and booleans compare with each other by value
+static bool is_numberish(constant_t constant)
+{
+    return is_number(constant) || constant.type == VAL_BOOLEAN;
+}
+
+static double as_number(constant_t constant)
+{
+    switch (constant.type)
+    {
+        case VAL_FLOAT: return constant.real;
+        case VAL_BOOLEAN: return constant.boolean;
+        default: return constant.integer;
+    }
+}
+
+static float as_float(constant_t constant)
+{
+    return (constant.type == VAL_FLOAT) ? constant.real : constant.integer;
+}
+
+static bool truthy(constant_t constant)
+{
+    switch (constant.type)
+    {
+        case VAL_INT: return constant.integer != 0;
+        case VAL_FLOAT: return constant.real != 0;
+        case VAL_BOOLEAN: return constant.boolean;
+        case VAL_STRING: return constant.string[0] != '\0';
+        default: return false;
+    }
+}
+
+static bool equal(constant_t left, constant_t right)
+{
+    if (is_numberish(left) && is_numberish(right))
+        return as_number(left) == as_number(right);
+
+    if (left.type != right.type)
+        return false;
+
+    if (left.type == VAL_STRING)
+        return strcmp(left.string, right.string) == 0;
+
+    return left.type == VAL_NIL;
+}
+
+// Numbers order with each other, and strings with each other. The VM stops
+// with an error on anything else.
+static bool orderable(constant_t left, constant_t right)
+{
+    if (is_numberish(left) && is_numberish(right))
+        return true;
+
+    return left.type == VAL_STRING && right.type == VAL_STRING;
+}
+
+static bool less_than(constant_t left, constant_t right)
+{
+    if (left.type == VAL_STRING)
+        return strcmp(left.string, right.string) < 0;
+
+    return as_number(left) < as_number(right);
+}
+
+//-- Operators
+//
+// These give the same answers as the instructions the compiler would emit
+// otherwise. Anything that isn't worth the trouble, like an operation the VM
+// doesn't really support, is left alone for the VM to deal with.
+
+static bool fold_unary(enum token_type_e operator, constant_t operand, constant_t *result)
+{
+    switch (operator)
+    {
+        case TOK_MINUS:
+            if (operand.type == VAL_INT)
+                *result = (constant_t){ .type=VAL_INT, .integer=(int)(0u - (unsigned)operand.integer) };
+            else if (operand.type == VAL_FLOAT)
+                *result = (constant_t){ .type=VAL_FLOAT, .real=-operand.real };
+            else
+                return false;
+            return true;
+
+        case TOK_BANG:
+            if (operand.type == VAL_NIL)
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=!truthy(operand) };
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool fold_arithmetic(enum token_type_e operator, constant_t left, constant_t right, constant_t *result)
+{
+    if (!is_number(left) || !is_number(right))
+        return false;
+
+    if (operator == TOK_SLASH)
+    {
+        if (as_float(right) == 0)
+            return false;
+        *result = (constant_t){ .type=VAL_FLOAT, .real=as_float(left) / as_float(right) };
+        return true;
+    }
+
+    if (left.type == VAL_FLOAT || right.type == VAL_FLOAT)
+    {
+        float real;
+        switch (operator)
+        {
+            case TOK_PLUS: real = as_float(left) + as_float(right); break;
+            case TOK_MINUS: real = as_float(left) - as_float(right); break;
+            case TOK_ASTERISK: real = as_float(left) * as_float(right); break;
+            default: return false;
+        }
+
+        if (!isfinite(real))
+            return false;
+
+        *result = (constant_t){ .type=VAL_FLOAT, .real=real };
+        return true;
+    }
+
+    // Integers wrap around, like they do in the VM
+    unsigned a = left.integer, b = right.integer;
+    switch (operator)
+    {
+        case TOK_PLUS:
+            *result = (constant_t){ .type=VAL_INT, .integer=(int)(a + b) };
+            return true;
+
+        case TOK_MINUS:
+            *result = (constant_t){ .type=VAL_INT, .integer=(int)(a - b) };
+            return true;
+
+        case TOK_ASTERISK:
+            *result = (constant_t){ .type=VAL_INT, .integer=(int)(a * b) };
+            return true;
+
+        case TOK_MODULO:
+            if (right.integer == 0 || (left.integer == INT_MIN && right.integer == -1))
+                return false;
+            *result = (constant_t){ .type=VAL_INT, .integer=left.integer % right.integer };
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool fold_binary(fold_context_t *context, enum token_type_e operator, constant_t left, constant_t right, constant_t *result)
+{
+    switch (operator)
+    {
+        case TOK_PLUS:
+            if (left.type == VAL_STRING && right.type == VAL_STRING)
+            {
+                size_t length = strlen(left.string);
+                char *string = arena_alloc(context->arena, length + strlen(right.string) + 1);
+                strcpy(string, left.string);
+                strcpy(string + length, right.string);
+                *result = (constant_t){ .type=VAL_STRING, .string=string };
+                return true;
+            }
+            return fold_arithmetic(operator, left, right, result);
+
+        case TOK_MINUS:
+        case TOK_ASTERISK:
+        case TOK_SLASH:
+        case TOK_MODULO:
+            return fold_arithmetic(operator, left, right, result);
+
+        // Comparisons are all made out of equal and less than, the same way
+        // compile_jump_if_false does it
+        case TOK_EQUAL_EQUAL:
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=equal(left, right) };
+            return true;
+
+        case TOK_BANG_EQUAL:
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=!equal(left, right) };
+            return true;
+
+        case TOK_LESS:
+            if (!orderable(left, right))
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=less_than(left, right) };
+            return true;
+
+        case TOK_GREATER_EQUAL:
+            if (!orderable(left, right))
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=!less_than(left, right) };
+            return true;
+
+        case TOK_GREATER:
+            if (!orderable(left, right))
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=less_than(right, left) };
+            return true;
+
+        case TOK_LESS_EQUAL:
+            if (!orderable(left, right))
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=!less_than(right, left) };
+            return true;
+
+        // and / or only work on numbers and booleans
+        case TOK_AND:
+            if (!is_numberish(left) || !is_numberish(right))
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=truthy(left) && truthy(right) };
+            return true;
+
+        case TOK_OR:
+            if (!is_numberish(left) || !is_numberish(right))
+                return false;
+            *result = (constant_t){ .type=VAL_BOOLEAN, .boolean=truthy(left) || truthy(right) };
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+//-- Scopes
+
+static void push_scope(fold_context_t *context)
+{
+    symbol_map_t *scope = symbol_map_create_in(context->arena);
+    scope->parent = context->scope;
+    context->scope = scope;
+}
+
+static void pop_scope(fold_context_t *context)
+{
+    context->scope = context->scope->parent;
+}
+
+static bool is_constant(fold_context_t *context, char *name)
+{
+    return symbol_map_get(context->scope, name).type == SYM_CONSTANT;
+}
+
+// A new variable hides any constant of the same name from here on
+static void shadow(fold_context_t *context, char *name)
+{
+    if (name != NULL && is_constant(context, name))
+        symbol_map_set(context->scope, (symbol_t){ .name=name, .type=SYM_VAR, .location={ .type=LOC_NONE } });
+}
+
+static void bind_constant(fold_context_t *context, char *name, ast_t *value)
+{
+    if (context->num_values == context->values_capacity)
+    {
+        size_t capacity = (context->values_capacity == 0) ? 16 : context->values_capacity * 2;
+        context->values = arena_grow(context->arena, context->values,
+                                     context->values_capacity * sizeof(ast_t *),
+                                     capacity * sizeof(ast_t *));
+        context->values_capacity = capacity;
+    }
+
+    symbol_t constant = { .name=name, .type=SYM_CONSTANT, .location={ .type=LOC_MEMORY, .address=context->num_values } };
+    context->values[context->num_values++] = value;
+    symbol_map_set(context->scope, constant);
+}
+
+//-- Folding
+
+// Fold the last statement of a block, which is also the block's value. An if
+// that never runs still leaves its condition behind, since that's the value
+// the VM would have given the block.
+static ast_t *fold_last_statement(ast_t *ast, fold_context_t *context)
+{
+    ast_t *statement = fold(ast, context);
+
+    if (statement == NULL && ast->type == AST_IF_STMT)
+        return ast->op.if_stmt.condition;
+
+    return statement;
+}
+
+static ast_t *fold_statement_list(ast_t *ast, fold_context_t *context)
+{
+    push_scope(context);
+
+    if (ast->type != AST_STMT_LIST)
+    {
+        ast = fold_last_statement(ast, context);
+        pop_scope(context);
+        return ast;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < ast->op.list.size; i++)
+    {
+        ast_t *statement = (i + 1 < ast->op.list.size) ? fold(ast->op.list.items[i], context)
+                                                       : fold_last_statement(ast->op.list.items[i], context);
+
+        if (statement == NULL)
+            continue;
+
+        // Every use of a constant has been replaced by its value, so its
+        // declaration has nothing left to do. The last statement is a block's
+        // value though, so that one stays.
+        if (statement->type == AST_DECLARE && i + 1 < ast->op.list.size
+            && symbol_map_get_local(context->scope, statement->op.declare.name).type == SYM_CONSTANT)
+            continue;
+
+        ast->op.list.items[kept++] = statement;
+    }
+    ast->op.list.size = kept;
+
+    pop_scope(context);
+    return ast;
+}
+
+// Fold the body of an if, for or function, which has to stay a body even if
+// there's nothing left in it
+static ast_t *fold_body(ast_t *ast, fold_context_t *context)
+{
+    ast_t *body = fold_statement_list(ast, context);
+
+    if (body == NULL)
+    {
+        body = arena_alloc(context->arena, sizeof(ast_t));
+        body->type = AST_STMT_LIST;
+        body->location = ast->location;
+    }
+
+    return body;
+}
+
+static ast_t *fold(ast_t *ast, fold_context_t *context)
+{
+    constant_t left, right, result;
+
+    if (ast == NULL)
+        return NULL;
+
+    switch (ast->type)
+    {
+        case AST_LITERAL:
+            if (ast->op.literal.token.type == TOK_IDENTIFIER)
+            {
+                symbol_t symbol = symbol_map_get(context->scope, ast->op.literal.value);
+
+                if (symbol.type == SYM_CONSTANT)
+                {
+                    ast_t *value = arena_alloc(context->arena, sizeof(ast_t));
+                    *value = *context->values[symbol.location.address];
+                    value->location = ast->location;
+                    return value;
+                }
+            }
+            return ast;
+
+        case AST_GROUP:
+            ast->op.group = fold(ast->op.group, context);
+            if (constant_of(ast->op.group, &result))
+                return ast->op.group;
+            return ast;
+
+        case AST_UNARY:
+            ast->op.unary.operand = fold(ast->op.unary.operand, context);
+            if (constant_of(ast->op.unary.operand, &left) && fold_unary(ast->op.unary.operator.type, left, &result))
+                return make_literal(context, result, ast->location);
+            return ast;
+
+        case AST_BINARY:
+            // The left side of a dot names a module, not a value
+            if (ast->op.binary.operator.type == TOK_DOT)
+            {
+                ast->op.binary.right = fold(ast->op.binary.right, context);
+                return ast;
+            }
+
+            ast->op.binary.left = fold(ast->op.binary.left, context);
+            ast->op.binary.right = fold(ast->op.binary.right, context);
+            if (constant_of(ast->op.binary.left, &left) && constant_of(ast->op.binary.right, &right)
+                && fold_binary(context, ast->op.binary.operator.type, left, right, &result))
+                return make_literal(context, result, ast->location);
+            return ast;
+
+        case AST_ASSIGN:
+            // The declaration won't be around to complain about this once
+            // the compiler gets here
+            if (is_constant(context, ast->op.assign.name))
+            {
+                char *error;
+                location_t loc = {ast->location.start, ast->location.end};
+                asprintf(&error, "Cannot assign to constant \"%s\", value is immutable", ast->op.assign.name);
+                printf("%s", format_error_found_here(context->name, context->listing, error, loc));
+                exit(1);
+            }
+
+            ast->op.assign.value = fold(ast->op.assign.value, context);
+            return ast;
+
+        case AST_DECLARE:
+            ast->op.declare.initial_value = fold(ast->op.declare.initial_value, context);
+
+            if (ast->op.declare.var_type.type == TOK_LET && constant_of(ast->op.declare.initial_value, &result))
+                bind_constant(context, ast->op.declare.name, ast->op.declare.initial_value);
+            else
+                shadow(context, ast->op.declare.name);
+            return ast;
+
+        case AST_STMT_LIST:
+            return fold_statement_list(ast, context);
+
+        case AST_EXPR_LIST:
+        case AST_TUPLE:
+            for (size_t i = 0; i < ast->op.list.size; i++)
+                ast->op.list.items[i] = fold(ast->op.list.items[i], context);
+            return ast;
+
+        case AST_FUNCTION_DECL:
+            shadow(context, ast->op.fn.name);
+            push_scope(context);
+
+            if (ast->op.fn.args != NULL)
+            {
+                for (size_t i = 0; i < ast->op.fn.args->op.list.size; i++)
+                    shadow(context, ast->op.fn.args->op.list.items[i]->op.literal.value);
+            }
+
+            ast->op.fn.body = fold_body(ast->op.fn.body, context);
+            pop_scope(context);
+            return ast;
+
+        case AST_FUNCTION_CALL:
+            ast->op.call.args = fold(ast->op.call.args, context);
+            return ast;
+
+        case AST_IF_STMT:
+            ast->op.if_stmt.condition = fold(ast->op.if_stmt.condition, context);
+
+            // The body either always runs, in its own scope, or never does
+            if (constant_of(ast->op.if_stmt.condition, &result))
+                return truthy(result) ? fold_body(ast->op.if_stmt.body, context) : NULL;
+
+            ast->op.if_stmt.body = fold_body(ast->op.if_stmt.body, context);
+            return ast;
+
+        case AST_FOR_STMT:
+            ast->op.for_stmt.iterable = fold(ast->op.for_stmt.iterable, context);
+            push_scope(context);
+            shadow(context, ast->op.for_stmt.var);
+            ast->op.for_stmt.body = fold_body(ast->op.for_stmt.body, context);
+            pop_scope(context);
+            return ast;
+
+        case AST_RANGE:
+            ast->op.range.begin = fold(ast->op.range.begin, context);
+            ast->op.range.end = fold(ast->op.range.end, context);
+            return ast;
+
+        default:
+            return ast;
+    }
+}
+
+ast_t *fold_constants(const char *name, const char *listing, ast_t *ast, arena_t *arena)
+{
+    fold_context_t context = { .name=name, .listing=listing, .arena=arena };
+    context.scope = symbol_map_create_in(arena);
+
+    return fold_body(ast, &context);
+}
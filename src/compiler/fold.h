@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef FOLD_H
+#define FOLD_H
+
+#include "parse.h"
+
+// Evaluate whatever can be evaluated at compile time, rewriting the syntax
+// tree in place: arithmetic, comparisons and logic on literals become
+// literals, uses of let constants with literal values are replaced by those
+// values, and if statements with constant conditions are resolved. Anything
+// new is allocated from the arena. Returns the new root.
+ast_t *fold_constants(const char *name, const char *listing, ast_t *ast, arena_t *arena);
+
+#endif
@@ -0,0 +1,1412 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "machine/disassemble.h"
+#include "machine/value.h"
+
+#define NO_BLOCK UINT32_MAX
+
+// Which field of an instruction an operand is read from, so that it can be
+// pointed at another register holding the same value. Operands that follow
+// from another one, like the elements of a tuple, can't be.
+enum
+{
+    FIELD_NONE,
+    FIELD_PAIR_ARG1,
+    FIELD_PAIR_ARG2,
+    FIELD_TRIPLET_ARG2,
+    FIELD_TRIPLET_ARG3,
+    FIELD_BRANCH_ARG1,
+    FIELD_BRANCH_ARG2,
+};
+
+// The registers an instruction reads and writes, and how it affects control
+// flow
+typedef struct
+{
+    ir_kind_e kind;
+    int num_reads;
+    int num_args;
+    uint8_t reads[VM_NUM_REGISTERS];
+    uint8_t fields[VM_NUM_REGISTERS];
+    int num_writes;
+    int num_results;
+    uint8_t writes[VM_NUM_REGISTERS];
+    bool branches;
+    bool falls_through;
+} shape_t;
+
+// Append to an array that grows by doubling
+static void append(arena_t *arena, uint32_t **array, uint32_t *count, uint32_t item)
+{
+    uint32_t n = *count;
+
+    if (n == 0 || (n >= 2 && (n & (n - 1)) == 0))
+        *array = arena_grow(arena, *array, n * sizeof(uint32_t), (n ? n * 2 : 2) * sizeof(uint32_t));
+
+    (*array)[(*count)++] = item;
+}
+
+//-- Instruction shapes
+
+static void shape_read(shape_t *shape, int reg, uint8_t field)
+{
+    shape->fields[shape->num_reads] = field;
+    shape->reads[shape->num_reads++] = reg;
+}
+
+static void shape_write(shape_t *shape, int reg)
+{
+    shape->writes[shape->num_writes++] = reg;
+}
+
+static bool memory_is_written(ir_t *ir, uint32_t address)
+{
+    return address >= ir->memory_size || ir->written[address];
+}
+
+// A call slides the register window up to the call register. The callee
+// reads its arguments, and can write anything from the call register up. In
+// top-level code, it can also read and write any of our registers, since
+// they're globals.
+static void shape_call(ir_t *ir, instruction_t instruction, shape_t *shape)
+{
+    int call = instruction.fields.pair.arg1;
+    int nargs = VM_NUM_REGISTERS - 1 - call;
+    value_t value = memory_get(ir->binary->data, instruction.fields.pair.arg2);
+
+    if (value_type_of(value) == VAL_FUNCTION)
+        nargs = ((function_t *)value_as_object(value))->nargs;
+
+    for (int i = 1; i <= nargs && call + i < VM_NUM_REGISTERS; i++)
+        shape_read(shape, call + i, FIELD_NONE);
+
+    shape->num_args = shape->num_reads;
+
+    int first = ir->top_level ? 0 : call + 1;
+    for (int reg = first; reg < VM_NUM_REGISTERS; reg++)
+    {
+        if (ir->tracked[reg] && (reg <= call || reg > call + nargs))
+            shape_read(shape, reg, FIELD_NONE);
+    }
+
+    shape_write(shape, call);
+    shape->num_results = 1;
+
+    for (int reg = first; reg < VM_NUM_REGISTERS; reg++)
+    {
+        if (ir->tracked[reg] && reg != call)
+            shape_write(shape, reg);
+    }
+
+    shape->kind = IR_EFFECT;
+}
+
+static void decode(ir_t *ir, instruction_t instruction, shape_t *shape)
+{
+    shape->kind = IR_PURE;
+    shape->num_reads = shape->num_writes = 0;
+    shape->num_args = shape->num_results = -1;
+    shape->branches = false;
+    shape->falls_through = true;
+
+    switch (instruction.opcode)
+    {
+        case OP_NIL:
+            shape_write(shape, instruction.fields.pair.arg2);
+            break;
+
+        case OP_LOAD:
+            shape_write(shape, instruction.fields.pair.arg1);
+            if (memory_is_written(ir, instruction.fields.pair.arg2))
+                shape->kind = IR_FRESH;
+            break;
+
+        case OP_LOADV:
+            shape_write(shape, instruction.fields.pair.arg1);
+            break;
+
+        case OP_STORE:
+            shape_read(shape, instruction.fields.pair.arg1, FIELD_PAIR_ARG1);
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_MOVE:
+            shape_read(shape, instruction.fields.pair.arg2, FIELD_PAIR_ARG2);
+            shape_write(shape, instruction.fields.pair.arg1);
+            break;
+
+        case OP_GETGLOBAL:
+            shape_write(shape, instruction.fields.pair.arg1);
+            shape->kind = IR_FRESH;
+            break;
+
+        case OP_SETGLOBAL:
+            shape_read(shape, instruction.fields.pair.arg2, FIELD_PAIR_ARG2);
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_PUSH:
+            shape_read(shape, instruction.fields.pair.arg2, FIELD_PAIR_ARG2);
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_POP:
+            shape_write(shape, instruction.fields.pair.arg2);
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_JMP:
+            shape->kind = IR_EFFECT;
+            shape->branches = true;
+            shape->falls_through = false;
+            break;
+
+        case OP_JMP_TRUE:
+        case OP_JMP_FALSE:
+            shape_read(shape, instruction.fields.branch.arg1, FIELD_BRANCH_ARG1);
+            shape->kind = IR_EFFECT;
+            shape->branches = true;
+            break;
+
+        case OP_JMP_EQUAL:
+        case OP_JMP_NOT_EQUAL:
+        case OP_JMP_LESSTHAN:
+        case OP_JMP_NOT_LESSTHAN:
+        case OP_JMP_EQUAL_INT:
+        case OP_JMP_NOT_EQUAL_INT:
+        case OP_JMP_LESSTHAN_INT:
+        case OP_JMP_NOT_LESSTHAN_INT:
+        case OP_JMP_EQUAL_FLOAT:
+        case OP_JMP_NOT_EQUAL_FLOAT:
+        case OP_JMP_LESSTHAN_FLOAT:
+        case OP_JMP_NOT_LESSTHAN_FLOAT:
+        case OP_JMP_EQUAL_STRING:
+        case OP_JMP_NOT_EQUAL_STRING:
+            shape_read(shape, instruction.fields.branch.arg1, FIELD_BRANCH_ARG1);
+            shape_read(shape, instruction.fields.branch.arg2, FIELD_BRANCH_ARG2);
+            shape->kind = IR_EFFECT;
+            shape->branches = true;
+            break;
+
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_ADD_INT:
+        case OP_ADD_FLOAT:
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_FLOAT:
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_FLOAT:
+        case OP_CONCAT:
+        case OP_AND:
+        case OP_OR:
+            shape_read(shape, instruction.fields.triplet.arg2, FIELD_TRIPLET_ARG2);
+            shape_read(shape, instruction.fields.triplet.arg3, FIELD_TRIPLET_ARG3);
+            shape_write(shape, instruction.fields.triplet.arg1);
+            break;
+
+        case OP_NEGATE:
+        case OP_NOT:
+            shape_read(shape, instruction.fields.pair.arg2, FIELD_PAIR_ARG2);
+            shape_write(shape, instruction.fields.pair.arg1);
+            break;
+
+        // Every tuple is a new object
+        case OP_TUPLE:
+            for (int i = 0; i < instruction.fields.triplet.arg3; i++)
+                shape_read(shape, instruction.fields.triplet.arg2 + i, FIELD_NONE);
+            shape_write(shape, instruction.fields.triplet.arg1);
+            shape->kind = IR_FRESH;
+            break;
+
+        // The loop variable is only written when there's another element, so
+        // whatever was in it before is still needed
+        case OP_FORITER:
+            shape_read(shape, instruction.fields.branch.arg1, FIELD_NONE);
+            shape_read(shape, instruction.fields.branch.arg1 + 1, FIELD_NONE);
+            shape->num_args = 2;
+            shape_read(shape, instruction.fields.branch.arg1 + 2, FIELD_NONE);
+            shape_write(shape, instruction.fields.branch.arg1 + 1);
+            shape_write(shape, instruction.fields.branch.arg1 + 2);
+            shape->kind = IR_EFFECT;
+            shape->branches = true;
+            break;
+
+        case OP_CALL:
+            shape_call(ir, instruction, shape);
+            break;
+
+        // Builtins find the number of arguments in $0
+        case OP_CALL_BUILTIN:
+        case OP_CALL_DYNAMIC:
+            shape_read(shape, 0, FIELD_NONE);
+            shape->num_args = 0;
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_RETURN:
+            shape_read(shape, instruction.fields.pair.arg2, FIELD_PAIR_ARG2);
+            shape->kind = IR_EFFECT;
+            shape->falls_through = false;
+            break;
+
+        case OP_IMPORT:
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_SETINBOUND:
+            shape_read(shape, instruction.fields.pair.arg1, FIELD_PAIR_ARG1);
+            shape->kind = IR_EFFECT;
+            break;
+
+        case OP_GETOUTBOUND:
+            shape_write(shape, instruction.fields.pair.arg1);
+            shape->kind = IR_EFFECT;
+            break;
+
+        default:
+            shape->kind = IR_UNSUPPORTED;
+    }
+
+    if (shape->num_args < 0)
+        shape->num_args = shape->num_reads;
+
+    if (shape->num_results < 0)
+        shape->num_results = shape->num_writes;
+}
+
+static void set_field(instruction_t *instruction, uint8_t field, uint8_t reg)
+{
+    switch (field)
+    {
+        case FIELD_PAIR_ARG1: instruction->fields.pair.arg1 = reg; break;
+        case FIELD_PAIR_ARG2: instruction->fields.pair.arg2 = reg; break;
+        case FIELD_TRIPLET_ARG2: instruction->fields.triplet.arg2 = reg; break;
+        case FIELD_TRIPLET_ARG3: instruction->fields.triplet.arg3 = reg; break;
+        case FIELD_BRANCH_ARG1: instruction->fields.branch.arg1 = reg; break;
+        case FIELD_BRANCH_ARG2: instruction->fields.branch.arg2 = reg; break;
+        default: assert(false);
+    }
+}
+
+//-- Building
+
+static uint32_t new_value(ir_t *ir, uint8_t reg, uint32_t block, int32_t instruction, int32_t phi, uint32_t *versions)
+{
+    if (ir->num_values == ir->values_capacity)
+    {
+        uint32_t capacity = ir->values_capacity ? ir->values_capacity * 2 : 64;
+        ir->values = arena_grow(ir->arena, ir->values, ir->values_capacity * sizeof(ir_value_t), capacity * sizeof(ir_value_t));
+        ir->values_capacity = capacity;
+    }
+
+    uint32_t value = ir->num_values++;
+    ir->values[value] = (ir_value_t){
+        .reg=reg,
+        .version=versions[reg]++,
+        .block=block,
+        .instruction=instruction,
+        .phi=phi,
+        .alias=value,
+        .copy_of=value,
+    };
+
+    return value;
+}
+
+static void add_edge(ir_t *ir, uint32_t from, uint32_t to)
+{
+    ir_block_t *block = &ir->blocks[from];
+
+    for (int i = 0; i < block->num_succs; i++)
+    {
+        if (block->succs[i] == to)
+            return;
+    }
+
+    block->succs[block->num_succs++] = to;
+    append(ir->arena, &ir->blocks[to].preds, &ir->blocks[to].num_preds, from);
+}
+
+// Split the code into basic blocks, and connect them up
+static bool build_blocks(ir_t *ir, code_block_t *code)
+{
+    uint32_t n = code->size;
+    shape_t shape;
+    bool *leader = arena_alloc(ir->arena, n + 1);
+    uint32_t *block_at = arena_alloc(ir->arena, (n + 1) * sizeof(uint32_t));
+
+    leader[0] = true;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        decode(ir, code->code[i], &shape);
+
+        if (shape.branches)
+        {
+            int64_t target = (int64_t)i + code->code[i].fields.branch.offset;
+            if (target < 0 || target > n)
+                return false;
+
+            leader[target] = true;
+        }
+
+        if (shape.branches || !shape.falls_through)
+            leader[i + 1] = true;
+    }
+
+    // An empty block for the entry, one for each leader, and an empty one
+    // for the end
+    ir->num_blocks = 2;
+    for (uint32_t i = 0; i < n; i++)
+        ir->num_blocks += leader[i];
+
+    ir->blocks = arena_alloc(ir->arena, ir->num_blocks * sizeof(ir_block_t));
+
+    uint32_t block = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (leader[i])
+        {
+            block++;
+            ir->blocks[block].start = i;
+            block_at[i] = block;
+        }
+
+        ir->blocks[block].end = i + 1;
+        ir->instructions[i].block = block;
+    }
+
+    uint32_t end = ir->num_blocks - 1;
+    ir->blocks[end].start = ir->blocks[end].end = n;
+    block_at[n] = end;
+
+    add_edge(ir, 0, 1);
+
+    for (block = 1; block < end; block++)
+    {
+        uint32_t last = ir->blocks[block].end - 1;
+        decode(ir, code->code[last], &shape);
+
+        if (shape.branches)
+        {
+            ir->instructions[last].target = block_at[last + code->code[last].fields.branch.offset];
+            add_edge(ir, block, ir->instructions[last].target);
+        }
+
+        if (shape.falls_through)
+            add_edge(ir, block, block + 1);
+    }
+
+    return true;
+}
+
+// Find the blocks we can get to, in reverse postorder, and drop the edges
+// from the ones we can't
+static void order_blocks(ir_t *ir)
+{
+    uint32_t *stack = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    uint8_t *next = arena_alloc(ir->arena, ir->num_blocks);
+    uint32_t *postorder = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    uint32_t depth = 0, count = 0;
+
+    stack[depth++] = 0;
+    ir->blocks[0].reachable = true;
+
+    while (depth > 0)
+    {
+        ir_block_t *block = &ir->blocks[stack[depth - 1]];
+
+        if (next[stack[depth - 1]] < block->num_succs)
+        {
+            uint32_t succ = block->succs[next[stack[depth - 1]]++];
+
+            if (!ir->blocks[succ].reachable)
+            {
+                ir->blocks[succ].reachable = true;
+                stack[depth++] = succ;
+            }
+            continue;
+        }
+
+        postorder[count++] = stack[--depth];
+    }
+
+    ir->order = arena_alloc(ir->arena, count * sizeof(uint32_t));
+    ir->num_order = count;
+    for (uint32_t i = 0; i < count; i++)
+        ir->order[i] = postorder[count - 1 - i];
+
+    for (uint32_t b = 0; b < ir->num_blocks; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        uint32_t kept = 0;
+
+        for (uint32_t i = 0; i < block->num_preds; i++)
+        {
+            if (ir->blocks[block->preds[i]].reachable)
+                block->preds[kept++] = block->preds[i];
+        }
+
+        block->num_preds = kept;
+    }
+}
+
+static uint32_t intersect(ir_t *ir, uint32_t *rpo, uint32_t a, uint32_t b)
+{
+    while (a != b)
+    {
+        while (rpo[a] > rpo[b])
+            a = ir->blocks[a].idom;
+        while (rpo[b] > rpo[a])
+            b = ir->blocks[b].idom;
+    }
+
+    return a;
+}
+
+// Work out dominators, using the iterative algorithm from "A Simple, Fast
+// Dominance Algorithm" by Cooper, Harvey and Kennedy, then the dominator
+// tree and dominance frontiers
+static void find_dominators(ir_t *ir)
+{
+    uint32_t *rpo = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < ir->num_order; i++)
+        rpo[ir->order[i]] = i;
+
+    for (uint32_t b = 0; b < ir->num_blocks; b++)
+        ir->blocks[b].idom = NO_BLOCK;
+
+    ir->blocks[0].idom = 0;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (uint32_t i = 1; i < ir->num_order; i++)
+        {
+            ir_block_t *block = &ir->blocks[ir->order[i]];
+            uint32_t idom = NO_BLOCK;
+
+            for (uint32_t j = 0; j < block->num_preds; j++)
+            {
+                uint32_t pred = block->preds[j];
+
+                if (ir->blocks[pred].idom == NO_BLOCK)
+                    continue;
+
+                idom = (idom == NO_BLOCK) ? pred : intersect(ir, rpo, pred, idom);
+            }
+
+            if (block->idom != idom)
+            {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+
+    for (uint32_t i = 1; i < ir->num_order; i++)
+    {
+        uint32_t b = ir->order[i];
+        ir_block_t *idom = &ir->blocks[ir->blocks[b].idom];
+        append(ir->arena, &idom->children, &idom->num_children, b);
+    }
+
+    for (uint32_t i = 0; i < ir->num_order; i++)
+    {
+        uint32_t b = ir->order[i];
+        ir_block_t *block = &ir->blocks[b];
+
+        if (block->num_preds < 2)
+            continue;
+
+        for (uint32_t j = 0; j < block->num_preds; j++)
+        {
+            uint32_t runner = block->preds[j];
+
+            while (runner != block->idom)
+            {
+                ir_block_t *r = &ir->blocks[runner];
+
+                if (r->num_frontier == 0 || r->frontier[r->num_frontier - 1] != b)
+                    append(ir->arena, &r->frontier, &r->num_frontier, b);
+
+                runner = r->idom;
+            }
+        }
+    }
+}
+
+static void add_phi(ir_t *ir, uint32_t b, uint8_t reg)
+{
+    ir_block_t *block = &ir->blocks[b];
+
+    if ((block->num_phis & (block->num_phis - 1)) == 0)
+    {
+        uint32_t capacity = block->num_phis ? block->num_phis * 2 : 1;
+        block->phis = arena_grow(ir->arena, block->phis, block->num_phis * sizeof(ir_phi_t), capacity * sizeof(ir_phi_t));
+    }
+
+    block->phis[block->num_phis++] = (ir_phi_t){
+        .reg=reg,
+        .args=arena_alloc(ir->arena, block->num_preds * sizeof(uint32_t)),
+    };
+}
+
+// Put a phi for a register wherever two of its values might meet, which is
+// the iterated dominance frontier of the blocks that write it
+static void place_phis(ir_t *ir)
+{
+    uint32_t *has_phi = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    uint32_t *queued = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    uint32_t *worklist = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+
+    // Which blocks write each register
+    uint8_t (*writes)[VM_NUM_REGISTERS / 8] = arena_alloc(ir->arena, ir->num_blocks * VM_NUM_REGISTERS / 8);
+
+    for (uint32_t i = 0; i < ir->num_instructions; i++)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+
+        for (int j = 0; j < instruction->num_defs; j++)
+            writes[instruction->block][instruction->defs[j] / 8] |= 1 << (instruction->defs[j] % 8);
+    }
+
+    for (int reg = 0; reg < VM_NUM_REGISTERS; reg++)
+    {
+        if (!ir->tracked[reg])
+            continue;
+
+        uint32_t count = 0;
+
+        for (uint32_t b = 0; b < ir->num_blocks; b++)
+        {
+            if (ir->blocks[b].reachable && (writes[b][reg / 8] & (1 << (reg % 8))))
+            {
+                queued[b] = reg + 1;
+                worklist[count++] = b;
+            }
+        }
+
+        while (count > 0)
+        {
+            ir_block_t *block = &ir->blocks[worklist[--count]];
+
+            for (uint32_t i = 0; i < block->num_frontier; i++)
+            {
+                uint32_t b = block->frontier[i];
+
+                if (has_phi[b] == reg + 1)
+                    continue;
+
+                add_phi(ir, b, reg);
+                has_phi[b] = reg + 1;
+
+                if (queued[b] != reg + 1)
+                {
+                    queued[b] = reg + 1;
+                    worklist[count++] = b;
+                }
+            }
+        }
+    }
+}
+
+#define CSE_BUCKETS 1024
+
+// An instruction that has been done already, keyed on its opcode, the values
+// it read and any immediate
+typedef struct cse_entry_t
+{
+    uint8_t opcode;
+    uint32_t a;
+    uint32_t b;
+    uint32_t immediate;
+    uint32_t value;
+    struct cse_entry_t *next;
+} cse_entry_t;
+
+static uint32_t cse_hash(cse_entry_t *key)
+{
+    uint32_t hash = key->opcode;
+    hash = hash * 31 + key->a;
+    hash = hash * 31 + key->b;
+    hash = hash * 31 + key->immediate;
+    return hash % CSE_BUCKETS;
+}
+
+// A walk over the dominator tree, which keeps track of the value in every
+// register, and of the instructions that have been done, and puts things
+// back the way they were as it leaves each block
+typedef struct
+{
+    ir_t *ir;
+    uint32_t current[VM_NUM_REGISTERS];
+    // Registers changed on the way down, with the values they had before
+    uint32_t *log;
+    uint32_t log_size;
+    uint32_t log_capacity;
+    cse_entry_t **buckets;
+    // The buckets entries were added to on the way down
+    uint32_t *scope;
+    uint32_t scope_size;
+    uint32_t scope_capacity;
+    // The blocks on the way down, how far through its children each is, and
+    // how big the log and scope were when we got to it
+    uint32_t *stack;
+    uint32_t *next_child;
+    uint32_t *log_marks;
+    uint32_t *scope_marks;
+    uint32_t depth;
+} walk_t;
+
+static void walk_init(walk_t *walk, ir_t *ir)
+{
+    *walk = (walk_t){ .ir=ir };
+    walk->buckets = arena_alloc(ir->arena, CSE_BUCKETS * sizeof(cse_entry_t *));
+    walk->stack = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    walk->next_child = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    walk->log_marks = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    walk->scope_marks = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+}
+
+static uint32_t *grow(arena_t *arena, uint32_t *array, uint32_t size, uint32_t *capacity)
+{
+    if (size < *capacity)
+        return array;
+
+    uint32_t grown = *capacity ? *capacity * 2 : 64;
+    array = arena_grow(arena, array, *capacity * sizeof(uint32_t), grown * sizeof(uint32_t));
+    *capacity = grown;
+    return array;
+}
+
+static void walk_set(walk_t *walk, uint8_t reg, uint32_t value)
+{
+    walk->log = grow(walk->ir->arena, walk->log, walk->log_size + 1, &walk->log_capacity);
+    walk->log[walk->log_size++] = reg;
+    walk->log[walk->log_size++] = walk->current[reg];
+    walk->current[reg] = value;
+}
+
+static void walk_remember(walk_t *walk, cse_entry_t *entry)
+{
+    uint32_t bucket = cse_hash(entry);
+
+    entry->next = walk->buckets[bucket];
+    walk->buckets[bucket] = entry;
+
+    walk->scope = grow(walk->ir->arena, walk->scope, walk->scope_size, &walk->scope_capacity);
+    walk->scope[walk->scope_size++] = bucket;
+}
+
+static void walk_enter(walk_t *walk, uint32_t block)
+{
+    walk->stack[walk->depth] = block;
+    walk->next_child[walk->depth] = 0;
+    walk->log_marks[walk->depth] = walk->log_size;
+    walk->scope_marks[walk->depth] = walk->scope_size;
+    walk->depth++;
+}
+
+// Returns the next block to visit, or NO_BLOCK once we're done
+static uint32_t walk_next(walk_t *walk)
+{
+    while (walk->depth > 0)
+    {
+        uint32_t top = walk->depth - 1;
+        ir_block_t *block = &walk->ir->blocks[walk->stack[top]];
+
+        if (walk->next_child[top] < block->num_children)
+            return block->children[walk->next_child[top]++];
+
+        // Leaving the block, so undo whatever it did
+        while (walk->log_size > walk->log_marks[top])
+        {
+            walk->log_size -= 2;
+            walk->current[walk->log[walk->log_size]] = walk->log[walk->log_size + 1];
+        }
+
+        while (walk->scope_size > walk->scope_marks[top])
+        {
+            uint32_t bucket = walk->scope[--walk->scope_size];
+            walk->buckets[bucket] = walk->buckets[bucket]->next;
+        }
+
+        walk->depth--;
+    }
+
+    return NO_BLOCK;
+}
+
+// Number every value, replacing the registers each instruction reads and
+// writes with the values they hold
+static void rename_registers(ir_t *ir)
+{
+    uint32_t *versions = arena_alloc(ir->arena, VM_NUM_REGISTERS * sizeof(uint32_t));
+    walk_t walk;
+    walk_init(&walk, ir);
+
+    for (int reg = 0; reg < VM_NUM_REGISTERS; reg++)
+    {
+        if (ir->tracked[reg])
+            walk.current[reg] = new_value(ir, reg, 0, -1, -1, versions);
+    }
+
+    for (uint32_t b = 0; b != NO_BLOCK; b = walk_next(&walk))
+    {
+        ir_block_t *block = &ir->blocks[b];
+        walk_enter(&walk, b);
+
+        for (uint32_t i = 0; i < block->num_phis; i++)
+        {
+            block->phis[i].value = new_value(ir, block->phis[i].reg, b, -1, i, versions);
+            walk_set(&walk, block->phis[i].reg, block->phis[i].value);
+        }
+
+        for (uint32_t i = block->start; i < block->end; i++)
+        {
+            ir_instruction_t *instruction = &ir->instructions[i];
+
+            for (int j = 0; j < instruction->num_uses; j++)
+                instruction->uses[j] = walk.current[instruction->uses[j]];
+
+            for (int j = 0; j < instruction->num_defs; j++)
+            {
+                uint8_t reg = instruction->defs[j];
+                instruction->defs[j] = new_value(ir, reg, b, i, -1, versions);
+                walk_set(&walk, reg, instruction->defs[j]);
+            }
+        }
+
+        for (int i = 0; i < block->num_succs; i++)
+        {
+            ir_block_t *succ = &ir->blocks[block->succs[i]];
+
+            for (uint32_t j = 0; j < succ->num_preds; j++)
+            {
+                if (succ->preds[j] != b)
+                    continue;
+
+                for (uint32_t k = 0; k < succ->num_phis; k++)
+                    succ->phis[k].args[j] = walk.current[succ->phis[k].reg];
+            }
+        }
+
+        if (b == ir->num_blocks - 1)
+        {
+            block->exit_uses = arena_alloc(ir->arena, ir->num_tracked * sizeof(uint32_t));
+
+            uint32_t n = 0;
+            for (int reg = 0; reg < VM_NUM_REGISTERS; reg++)
+            {
+                if (ir->tracked[reg])
+                    block->exit_uses[n++] = walk.current[reg];
+            }
+        }
+    }
+}
+
+static ir_t *build(binary_t *binary, uint32_t region, bool *written, size_t memory_size, arena_t *arena)
+{
+    ir_t *ir = arena_alloc(arena, sizeof(ir_t));
+    code_block_t *code = binary->code->blocks[region];
+    shape_t shape;
+
+    ir->binary = binary;
+    ir->region = region;
+    ir->arena = arena;
+    ir->supported = true;
+    ir->top_level = region == 0;
+    ir->written = written;
+    ir->memory_size = memory_size;
+    ir->num_instructions = code->size;
+    ir->instructions = arena_alloc(arena, (code->size + 1) * sizeof(ir_instruction_t));
+
+    // Find every register the code uses, since a call could read or write
+    // any of them
+    for (uint32_t i = 0; i < code->size; i++)
+    {
+        decode(ir, code->code[i], &shape);
+
+        if (shape.kind == IR_UNSUPPORTED)
+        {
+            ir->supported = false;
+            return ir;
+        }
+
+        for (int j = 0; j < shape.num_reads; j++)
+            ir->tracked[shape.reads[j]] = true;
+        for (int j = 0; j < shape.num_writes; j++)
+            ir->tracked[shape.writes[j]] = true;
+    }
+
+    for (int reg = 0; reg < VM_NUM_REGISTERS; reg++)
+        ir->num_tracked += ir->tracked[reg];
+
+    // To start with, uses and defs are registers
+    for (uint32_t i = 0; i < code->size; i++)
+    {
+        ir_instruction_t *instruction = &ir->instructions[i];
+        decode(ir, code->code[i], &shape);
+
+        instruction->instruction = code->code[i];
+        instruction->kind = shape.kind;
+        instruction->num_uses = shape.num_reads;
+        instruction->num_args = shape.num_args;
+        instruction->uses = arena_alloc(arena, shape.num_reads * sizeof(uint32_t));
+        instruction->use_fields = arena_alloc(arena, shape.num_reads);
+        instruction->num_defs = shape.num_writes;
+        instruction->num_results = shape.num_results;
+        instruction->defs = arena_alloc(arena, shape.num_writes * sizeof(uint32_t));
+
+        for (int j = 0; j < shape.num_reads; j++)
+        {
+            instruction->uses[j] = shape.reads[j];
+            instruction->use_fields[j] = shape.fields[j];
+        }
+
+        for (int j = 0; j < shape.num_writes; j++)
+            instruction->defs[j] = shape.writes[j];
+    }
+
+    if (!build_blocks(ir, code))
+    {
+        ir->supported = false;
+        return ir;
+    }
+
+    order_blocks(ir);
+    find_dominators(ir);
+    place_phis(ir);
+    rename_registers(ir);
+
+    return ir;
+}
+
+// Find the memory that any code in the binary writes to
+static bool *find_written_memory(binary_t *binary, arena_t *arena, size_t *size)
+{
+    *size = binary->data->capacity;
+    bool *written = arena_alloc(arena, *size);
+
+    for (size_t i = 0; i < binary->code->size; i++)
+    {
+        code_block_t *code = binary->code->blocks[i];
+
+        for (size_t j = 0; j < code->size; j++)
+        {
+            instruction_t instruction = code->code[j];
+            bool writes = instruction.opcode == OP_STORE || instruction.opcode == OP_IMPORT;
+
+            if (writes && instruction.fields.pair.arg2 < *size)
+                written[instruction.fields.pair.arg2] = true;
+        }
+    }
+
+    return written;
+}
+
+ir_t *ir_build(binary_t *binary, uint32_t region, arena_t *arena)
+{
+    size_t memory_size;
+    bool *written = find_written_memory(binary, arena, &memory_size);
+
+    return build(binary, region, written, memory_size, arena);
+}
+
+//-- Optimization
+
+static uint32_t canonical(ir_t *ir, uint32_t value)
+{
+    while (ir->values[value].alias != value)
+        value = ir->values[value].alias;
+
+    return value;
+}
+
+static uint32_t root(ir_t *ir, uint32_t value)
+{
+    return ir->values[canonical(ir, value)].copy_of;
+}
+
+static cse_entry_t cse_key(ir_t *ir, ir_instruction_t *instruction)
+{
+    cse_entry_t key = { .opcode=instruction->instruction.opcode, .a=UINT32_MAX, .b=UINT32_MAX };
+
+    if (instruction->num_uses > 0)
+        key.a = root(ir, instruction->uses[0]);
+    if (instruction->num_uses > 1)
+        key.b = root(ir, instruction->uses[1]);
+
+    if (key.opcode == OP_LOAD || key.opcode == OP_LOADV)
+        key.immediate = instruction->instruction.fields.pair.arg2;
+
+    return key;
+}
+
+static bool cse_equal(cse_entry_t *x, cse_entry_t *y)
+{
+    return x->opcode == y->opcode && x->a == y->a && x->b == y->b && x->immediate == y->immediate;
+}
+
+// Walk the dominator tree, so that everything defined in the blocks above is
+// visible. A value is only reused while its register still holds it, which
+// is the case exactly when it's the register's current value; had anything
+// written the register on any path to here, there'd be a phi.
+static void propagate(ir_t *ir)
+{
+    walk_t walk;
+    walk_init(&walk, ir);
+
+    for (uint32_t v = 0; v < ir->num_values; v++)
+    {
+        if (ir->values[v].block == 0 && ir->values[v].instruction < 0)
+            walk.current[ir->values[v].reg] = v;
+    }
+
+    for (uint32_t b = 0; b != NO_BLOCK; b = walk_next(&walk))
+    {
+        ir_block_t *block = &ir->blocks[b];
+        walk_enter(&walk, b);
+
+        for (uint32_t i = 0; i < block->num_phis; i++)
+            walk_set(&walk, block->phis[i].reg, block->phis[i].value);
+
+        for (uint32_t i = block->start; i < block->end; i++)
+        {
+            ir_instruction_t *instruction = &ir->instructions[i];
+
+            // Copy propagation: read the oldest copy of each value that's
+            // still around
+            for (int j = 0; j < instruction->num_uses; j++)
+            {
+                uint32_t value = canonical(ir, instruction->uses[j]);
+                uint32_t original = ir->values[value].copy_of;
+
+                if (original != value && instruction->use_fields[j] != FIELD_NONE &&
+                    walk.current[ir->values[original].reg] == original)
+                {
+                    set_field(&instruction->instruction, instruction->use_fields[j], ir->values[original].reg);
+                    value = original;
+                    ir->stats.copies++;
+                }
+
+                instruction->uses[j] = value;
+            }
+
+            if (instruction->kind == IR_PURE && instruction->num_defs == 1)
+            {
+                uint32_t def = instruction->defs[0];
+                uint8_t dest = ir->values[def].reg;
+                uint32_t same = UINT32_MAX;
+
+                if (instruction->instruction.opcode == OP_MOVE)
+                {
+                    ir->values[def].copy_of = root(ir, instruction->uses[0]);
+
+                    if (root(ir, walk.current[dest]) == ir->values[def].copy_of)
+                        same = walk.current[dest];
+                }
+                else
+                {
+                    cse_entry_t key = cse_key(ir, instruction);
+                    cse_entry_t *entry = walk.buckets[cse_hash(&key)];
+
+                    while (entry != NULL && !cse_equal(entry, &key))
+                        entry = entry->next;
+
+                    if (entry != NULL && walk.current[ir->values[entry->value].reg] == entry->value)
+                    {
+                        ir->stats.common++;
+
+                        if (ir->values[entry->value].reg == dest)
+                        {
+                            same = entry->value;
+                        }
+                        else
+                        {
+                            // Copy it from where it already is instead
+                            instruction->instruction = (instruction_t){ OP_MOVE, .fields={ .pair={ dest, ir->values[entry->value].reg } } };
+                            instruction->uses = arena_alloc(ir->arena, sizeof(uint32_t));
+                            instruction->use_fields = arena_alloc(ir->arena, 1);
+                            instruction->uses[0] = entry->value;
+                            instruction->use_fields[0] = FIELD_PAIR_ARG2;
+                            instruction->num_uses = instruction->num_args = 1;
+                            ir->values[def].copy_of = entry->value;
+                        }
+                    }
+                    else
+                    {
+                        entry = arena_alloc(ir->arena, sizeof(cse_entry_t));
+                        *entry = key;
+                        entry->value = def;
+                        walk_remember(&walk, entry);
+                    }
+                }
+
+                // The register already holds the value, so there's nothing
+                // to do
+                if (same != UINT32_MAX)
+                {
+                    instruction->removed = true;
+                    ir->values[def].alias = same;
+                }
+            }
+
+            for (int j = 0; j < instruction->num_defs; j++)
+            {
+                uint32_t def = canonical(ir, instruction->defs[j]);
+                walk_set(&walk, ir->values[def].reg, def);
+            }
+        }
+    }
+}
+
+static void count_use(ir_t *ir, uint32_t value, uint32_t *worklist, uint32_t *count, int delta)
+{
+    ir_value_t *v = &ir->values[canonical(ir, value)];
+
+    v->uses += delta;
+
+    if (v->uses == 0 && worklist != NULL)
+        worklist[(*count)++] = canonical(ir, value);
+}
+
+// Remove whatever writes a value nothing reads, and phis nothing reads.
+// Instructions are only removed if remove_code is set.
+static void eliminate_dead_code(ir_t *ir, bool remove_code)
+{
+    uint32_t *worklist = arena_alloc(ir->arena, (ir->num_values + 1) * sizeof(uint32_t));
+    uint32_t count = 0;
+
+    for (uint32_t v = 0; v < ir->num_values; v++)
+        ir->values[v].uses = 0;
+
+    for (uint32_t i = 0; i < ir->num_order; i++)
+    {
+        ir_block_t *block = &ir->blocks[ir->order[i]];
+
+        for (uint32_t j = block->start; j < block->end; j++)
+        {
+            ir_instruction_t *instruction = &ir->instructions[j];
+
+            for (int k = 0; !instruction->removed && k < instruction->num_uses; k++)
+                count_use(ir, instruction->uses[k], NULL, NULL, 1);
+        }
+
+        for (uint32_t j = 0; j < block->num_phis; j++)
+        {
+            for (uint32_t k = 0; k < block->num_preds; k++)
+                count_use(ir, block->phis[j].args[k], NULL, NULL, 1);
+        }
+
+        for (uint32_t j = 0; block->exit_uses != NULL && j < ir->num_tracked; j++)
+            count_use(ir, block->exit_uses[j], NULL, NULL, 1);
+    }
+
+    for (uint32_t v = 0; v < ir->num_values; v++)
+    {
+        if (ir->values[v].alias == v && ir->values[v].uses == 0)
+            worklist[count++] = v;
+    }
+
+    while (count > 0)
+    {
+        ir_value_t *value = &ir->values[worklist[--count]];
+
+        if (value->phi >= 0)
+        {
+            ir_block_t *block = &ir->blocks[value->block];
+            ir_phi_t *phi = &block->phis[value->phi];
+
+            if (phi->dead)
+                continue;
+
+            phi->dead = true;
+            for (uint32_t k = 0; k < block->num_preds; k++)
+                count_use(ir, phi->args[k], worklist, &count, -1);
+        }
+        else if (value->instruction >= 0 && remove_code)
+        {
+            ir_instruction_t *instruction = &ir->instructions[value->instruction];
+            bool removable = instruction->kind == IR_PURE || instruction->kind == IR_FRESH;
+
+            if (instruction->removed || !removable || instruction->num_defs != 1)
+                continue;
+
+            instruction->removed = true;
+            ir->stats.dead++;
+
+            for (int k = 0; k < instruction->num_uses; k++)
+                count_use(ir, instruction->uses[k], worklist, &count, -1);
+        }
+    }
+}
+
+void ir_optimize(ir_t *ir)
+{
+    if (!ir->supported)
+        return;
+
+    propagate(ir);
+    eliminate_dead_code(ir, true);
+}
+
+//-- Lowering
+
+void ir_lower(ir_t *ir)
+{
+    if (!ir->supported)
+        return;
+
+    code_block_t *code = ir->binary->code->blocks[ir->region];
+    uint32_t *starts = arena_alloc(ir->arena, ir->num_blocks * sizeof(uint32_t));
+    uint32_t size = 0;
+
+    // Code we can't get to is dropped along with everything else
+    for (uint32_t b = 0; b < ir->num_blocks; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        starts[b] = size;
+
+        for (uint32_t i = block->start; i < block->end; i++)
+        {
+            if (block->reachable && !ir->instructions[i].removed)
+                size++;
+            else if (!block->reachable)
+                ir->stats.dead++;
+        }
+    }
+
+    size = 0;
+    for (uint32_t b = 0; b < ir->num_blocks; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+
+        for (uint32_t i = block->start; block->reachable && i < block->end; i++)
+        {
+            ir_instruction_t *instruction = &ir->instructions[i];
+
+            if (instruction->removed)
+                continue;
+
+            // Nothing jumps back to the entry block, so only branches have a
+            // target. Jumps only get shorter, so the offset still fits.
+            if (instruction->target != 0)
+                instruction->instruction.fields.branch.offset = (int32_t)starts[instruction->target] - (int32_t)size;
+
+            code->code[size++] = instruction->instruction;
+        }
+    }
+
+    code->size = size;
+}
+
+//-- Printing
+
+static void print_value(FILE *out, ir_t *ir, uint32_t value)
+{
+    ir_value_t *v = &ir->values[canonical(ir, value)];
+    fprintf(out, " $%d.%d", v->reg, v->version);
+}
+
+// Everything about an instruction that isn't a register, like an immediate
+// or an address, as the disassembler would show it
+static void print_operand(FILE *out, instruction_t instruction, const char *assembly)
+{
+    const char *rest;
+
+    switch (instruction.opcode)
+    {
+        case OP_LOAD:
+            // Constants are shown as their values
+            rest = strchr(assembly, '$');
+            rest = (rest != NULL) ? strchr(rest, ' ') : NULL;
+            if (rest != NULL && strncmp(assembly, "set", 3) == 0)
+                fprintf(out, " %.*s", (int)strcspn(rest + 1, "\n"), rest + 1);
+            else
+                fprintf(out, " @%d", instruction.fields.pair.arg2);
+            break;
+
+        case OP_LOADV:
+            fprintf(out, " %d", instruction.fields.pair_signed.arg2);
+            break;
+
+        case OP_STORE:
+        case OP_CALL:
+        case OP_CALL_DYNAMIC:
+        case OP_IMPORT:
+        case OP_SETINBOUND:
+        case OP_GETOUTBOUND:
+            fprintf(out, " @%d", instruction.fields.pair.arg2);
+            break;
+
+        // Global registers belong to the top-level code, and aren't values
+        // here
+        case OP_GETGLOBAL:
+            fprintf(out, " $%d", instruction.fields.pair.arg2);
+            break;
+
+        case OP_SETGLOBAL:
+            fprintf(out, " $%d", instruction.fields.pair.arg1);
+            break;
+
+        case OP_CALL_BUILTIN:
+            rest = strchr(assembly, ' ');
+            rest += strspn(rest, " ");
+            fprintf(out, " %.*s", (int)strcspn(rest, "\n"), rest);
+            break;
+
+        default:
+            ;
+    }
+}
+
+static void print_instruction(FILE *out, ir_t *ir, ir_instruction_t *instruction)
+{
+    char *assembly = disassemble_instruction(ir->binary->data, instruction->instruction);
+    int length = (assembly != NULL) ? (int)strcspn(assembly, " \n") : 0;
+
+    fprintf(out, "   ");
+
+    for (int i = 0; i < instruction->num_results; i++)
+    {
+        print_value(out, ir, instruction->defs[i]);
+        fprintf(out, (i == instruction->num_results - 1) ? " =" : ",");
+    }
+
+    fprintf(out, " %.*s", length, (assembly != NULL) ? assembly : "");
+    print_operand(out, instruction->instruction, assembly);
+
+    for (int i = 0; i < instruction->num_args; i++)
+        print_value(out, ir, instruction->uses[i]);
+
+    if (instruction->target != 0)
+        fprintf(out, " b%d", instruction->target);
+
+    fprintf(out, "\n");
+    free(assembly);
+}
+
+char *ir_print(ir_t *ir)
+{
+    char *listing = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&listing, &size);
+
+    if (!ir->supported)
+    {
+        fprintf(out, "    ; uses instructions the IR doesn't support\n");
+        fclose(out);
+        return listing;
+    }
+
+    for (uint32_t b = 1; b < ir->num_blocks; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        bool empty = block->start == block->end;
+
+        for (uint32_t i = 0; i < block->num_phis; i++)
+            empty = empty && block->phis[i].dead;
+
+        if (!block->reachable || empty)
+            continue;
+
+        // The entry block is empty, so there's no need to show it
+        fprintf(out, "b%d:", b);
+        const char *separator = " <-";
+        for (uint32_t i = 0; i < block->num_preds; i++)
+        {
+            if (block->preds[i] != 0)
+            {
+                fprintf(out, "%s b%d", separator, block->preds[i]);
+                separator = "";
+            }
+        }
+        fprintf(out, "\n");
+
+        for (uint32_t i = 0; i < block->num_phis; i++)
+        {
+            ir_phi_t *phi = &block->phis[i];
+
+            if (phi->dead)
+                continue;
+
+            fprintf(out, "   ");
+            print_value(out, ir, phi->value);
+            fprintf(out, " = phi");
+
+            for (uint32_t j = 0; j < block->num_preds; j++)
+                print_value(out, ir, phi->args[j]);
+
+            fprintf(out, "\n");
+        }
+
+        for (uint32_t i = block->start; i < block->end; i++)
+        {
+            if (!ir->instructions[i].removed)
+                print_instruction(out, ir, &ir->instructions[i]);
+        }
+    }
+
+    fclose(out);
+    return listing;
+}
+
+//-- Whole binaries
+
+void ir_optimize_binary(binary_t *binary, arena_t *arena)
+{
+    size_t memory_size;
+    bool *written = find_written_memory(binary, arena, &memory_size);
+
+    for (uint32_t region = 0; region < binary->code->size; region++)
+    {
+        ir_t *ir = build(binary, region, written, memory_size, arena);
+        ir_optimize(ir);
+        ir_lower(ir);
+    }
+}
+
+char *ir_dump(binary_t *binary)
+{
+    arena_t *arena = arena_create();
+    size_t memory_size;
+    bool *written = find_written_memory(binary, arena, &memory_size);
+    char *listing = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&listing, &size);
+
+    for (uint32_t region = 0; region < binary->code->size; region++)
+    {
+        ir_t *ir = build(binary, region, written, memory_size, arena);
+
+        // Only show the phis something reads
+        if (ir->supported)
+            eliminate_dead_code(ir, false);
+
+        char *region_listing = ir_print(ir);
+        fprintf(out, "\nCode Region: %d\n\n%s", region, region_listing);
+        free(region_listing);
+    }
+
+    fclose(out);
+    arena_destroy(arena);
+    return listing;
+}
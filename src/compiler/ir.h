@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef IR_H
+#define IR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "machine/binary.h"
+#include "machine/vm.h"
+#include "util/arena.h"
+
+// The IR is a control flow graph of basic blocks in SSA form, built over one
+// code region. The instructions are still bytecode, but every register they
+// read or write is also numbered as an SSA value: each write to a register
+// makes a new value, and phis merge the values a register might hold where
+// control flow joins. Optimizing rewrites the instructions, and lowering
+// writes whatever is left back into the region.
+
+// How much an instruction can be optimized
+typedef enum
+{
+    // Only writes its registers, and always writes the same thing given the
+    // same operands
+    IR_PURE,
+    // Only writes its registers, but might not write the same thing twice
+    IR_FRESH,
+    // Does something besides writing its registers
+    IR_EFFECT,
+    // Something the IR doesn't know how to handle
+    IR_UNSUPPORTED,
+} ir_kind_e;
+
+typedef struct
+{
+    // The register the value lives in, and which write to it this is.
+    // Version 0 is whatever the register holds on entry.
+    uint8_t reg;
+    uint32_t version;
+    uint32_t block;
+    // The instruction that defines the value, or -1 for a phi or an entry
+    // value. A phi's index in its block's phis, or -1 for anything else.
+    int32_t instruction;
+    int32_t phi;
+    // A value that this one turned out to be, which is in the same register,
+    // so nothing needs to be done to get it. Otherwise, the value itself.
+    uint32_t alias;
+    // The oldest value this one is a copy of, which may be in another
+    // register. Otherwise, the value itself.
+    uint32_t copy_of;
+    uint32_t uses;
+} ir_value_t;
+
+typedef struct
+{
+    uint8_t reg;
+    uint32_t value;
+    // The value the register holds coming from each predecessor of the block,
+    // in the same order as its preds
+    uint32_t *args;
+    bool dead;
+} ir_phi_t;
+
+typedef struct
+{
+    instruction_t instruction;
+    uint32_t block;
+    ir_kind_e kind;
+    // Values read and written. The first num_args uses and num_results defs
+    // are the instruction's own operands, and any others are registers a
+    // call or the like reads or writes implicitly.
+    uint32_t *uses;
+    uint8_t *use_fields;
+    uint16_t num_uses;
+    uint16_t num_args;
+    uint32_t *defs;
+    uint16_t num_defs;
+    uint16_t num_results;
+    // Where a branch goes
+    uint32_t target;
+    bool removed;
+} ir_instruction_t;
+
+typedef struct
+{
+    // The block's instructions are those from start up to end
+    uint32_t start;
+    uint32_t end;
+    uint32_t *preds;
+    uint32_t num_preds;
+    uint32_t succs[2];
+    uint8_t num_succs;
+    bool reachable;
+    // The immediate dominator, and the blocks it is the immediate dominator of
+    uint32_t idom;
+    uint32_t *children;
+    uint32_t num_children;
+    uint32_t *frontier;
+    uint32_t num_frontier;
+    ir_phi_t *phis;
+    uint32_t num_phis;
+    // For the block at the end of the code, the value of every register
+    // when we get there
+    uint32_t *exit_uses;
+} ir_block_t;
+
+typedef struct
+{
+    binary_t *binary;
+    uint32_t region;
+    arena_t *arena;
+    // Code with instructions the IR doesn't understand is left alone
+    bool supported;
+    // Registers in top-level code are globals, which anything called can read
+    bool top_level;
+    bool tracked[VM_NUM_REGISTERS];
+    uint32_t num_tracked;
+    // Memory that code writes to, which loads can't treat as constant
+    bool *written;
+    size_t memory_size;
+
+    ir_instruction_t *instructions;
+    uint32_t num_instructions;
+    // The first block is an empty entry block, and the last an empty block
+    // at the end of the code. The ones between are in code order.
+    ir_block_t *blocks;
+    uint32_t num_blocks;
+    // Reachable blocks, in reverse postorder
+    uint32_t *order;
+    uint32_t num_order;
+    ir_value_t *values;
+    uint32_t num_values;
+    uint32_t values_capacity;
+
+    // What optimizing did
+    struct {
+        uint32_t copies;
+        uint32_t common;
+        uint32_t dead;
+    } stats;
+} ir_t;
+
+// Build the IR for a region of a binary, allocating from arena
+ir_t *ir_build(binary_t *binary, uint32_t region, arena_t *arena);
+
+// Copy propagation and common subexpression elimination, then dead code
+// elimination
+void ir_optimize(ir_t *ir);
+
+// Write the IR back into its region, fixing up jump offsets
+void ir_lower(ir_t *ir);
+
+// Print the IR in a human-readable form
+char *ir_print(ir_t *ir);
+
+// Optimize every region of a binary
+void ir_optimize_binary(binary_t *binary, arena_t *arena);
+
+// Build the IR for every region of a binary and print it
+char *ir_dump(binary_t *binary);
+
+#endif
@@ -576,7 +576,7 @@ bool match(scan_context_t *context, int num, ...)
 char *token_value(scan_context_t *context, token_t t)
 {
     int len = t.end - t.start;
-    char *value = calloc(len + 1, sizeof(char));
+    char *value = arena_alloc(context->arena, len + 1);
 
     // If the token is a string, omit the quotes
     if (t.type == TOK_STRING)
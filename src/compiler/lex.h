@@ -11,6 +11,7 @@
 #include <stdint.h>
 
 #include "token.h"
+#include "util/arena.h"
 
 // State for a single instance of a lexical scanner.
 typedef struct {
@@ -19,6 +20,8 @@ typedef struct {
     uint64_t position;
     token_t previous;
     token_t lookahead;
+    // Where token values and the syntax tree are allocated, set up by parse()
+    arena_t *arena;
 } scan_context_t;
 
 // Return the next token for the given context
@@ -30,6 +33,7 @@ bool match(scan_context_t *, int, ...);
 // Rewind to the last seen token
 void backup(scan_context_t *);
 
+// Copy a token's text into the context's arena
 char *token_value(scan_context_t *, token_t);
 
 // Scan an input string, and return a list of tokens.
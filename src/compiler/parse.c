@@ -37,6 +37,7 @@ ast_t *function_call(scan_context_t *);
 
 ast_t *parse(scan_context_t *context)
 {
+    context->arena = arena_create();
     return statement_list(context);
 }
 
@@ -167,9 +168,9 @@ void print_ast(scan_context_t *context, ast_t *ast)
     print_ast_internal(context, ast, 0);
 }
 
-ast_t* make_assign_expr(char *name, ast_t *value)
+ast_t* make_assign_expr(scan_context_t *context, char *name, ast_t *value)
 {
-    ast_t *assign_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *assign_expr = arena_alloc(context->arena, sizeof(ast_t));
     assign_expr->type = AST_ASSIGN;
     assign_expr->op.assign.name = name;
     assign_expr->op.assign.value = value;
@@ -177,9 +178,9 @@ ast_t* make_assign_expr(char *name, ast_t *value)
     return assign_expr;
 }
 
-ast_t *make_binary_expr(ast_t *left, token_t operator, ast_t *right)
+ast_t *make_binary_expr(scan_context_t *context, ast_t *left, token_t operator, ast_t *right)
 {
-    ast_t *binary_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *binary_expr = arena_alloc(context->arena, sizeof(ast_t));
     binary_expr->type = AST_BINARY;
     binary_expr->op.binary.operator = operator;
     binary_expr->op.binary.left = left;
@@ -188,9 +189,9 @@ ast_t *make_binary_expr(ast_t *left, token_t operator, ast_t *right)
     return binary_expr;
 }
 
-ast_t *make_declare_expr(token_t var_type, char *name, ast_t *initial_value)
+ast_t *make_declare_expr(scan_context_t *context, token_t var_type, char *name, ast_t *initial_value)
 {
-    ast_t *declare_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *declare_expr = arena_alloc(context->arena, sizeof(ast_t));
     declare_expr->type = AST_DECLARE;
     declare_expr->op.declare.var_type = var_type;
     declare_expr->op.declare.name = name;
@@ -199,9 +200,9 @@ ast_t *make_declare_expr(token_t var_type, char *name, ast_t *initial_value)
     return declare_expr;
 }
 
-ast_t *make_unary_expr(token_t operator, ast_t *operand)
+ast_t *make_unary_expr(scan_context_t *context, token_t operator, ast_t *operand)
 {
-    ast_t *unary_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *unary_expr = arena_alloc(context->arena, sizeof(ast_t));
     unary_expr->type = AST_UNARY;
     unary_expr->op.unary.operator = operator;
     unary_expr->op.unary.operand = operand;
@@ -209,27 +210,27 @@ ast_t *make_unary_expr(token_t operator, ast_t *operand)
     return unary_expr;
 }
 
-ast_t *make_literal_expr(token_t literal)
+ast_t *make_literal_expr(scan_context_t *context, token_t literal)
 {
-    ast_t *literal_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *literal_expr = arena_alloc(context->arena, sizeof(ast_t));
     literal_expr->type = AST_LITERAL;
     literal_expr->op.literal.token = literal;
 
     return literal_expr;
 }
 
-ast_t *make_group_expr(ast_t *expr)
+ast_t *make_group_expr(scan_context_t *context, ast_t *expr)
 {
-    ast_t *group_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *group_expr = arena_alloc(context->arena, sizeof(ast_t));
     group_expr->type = AST_GROUP;
     group_expr->op.group = expr;
 
     return group_expr;
 }
 
-ast_t *make_fn_expr(char *name, bool exported, ast_t *args, ast_t *body)
+ast_t *make_fn_expr(scan_context_t *context, char *name, bool exported, ast_t *args, ast_t *body)
 {
-    ast_t *fn_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *fn_expr = arena_alloc(context->arena, sizeof(ast_t));
     fn_expr->type = AST_FUNCTION_DECL;
     fn_expr->op.fn.name = name;
     fn_expr->op.fn.exported = exported;
@@ -238,9 +239,9 @@ ast_t *make_fn_expr(char *name, bool exported, ast_t *args, ast_t *body)
     return fn_expr;
 }
 
-ast_t *make_call_expr(char *name, ast_t *args)
+ast_t *make_call_expr(scan_context_t *context, char *name, ast_t *args)
 {
-    ast_t *call_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *call_expr = arena_alloc(context->arena, sizeof(ast_t));
     call_expr->type = AST_FUNCTION_CALL;
     call_expr->op.call.name = name;
     call_expr->op.call.args = args;
@@ -248,28 +249,28 @@ ast_t *make_call_expr(char *name, ast_t *args)
 }
 
 // List handling
-ast_t *make_list_expr(size_t capacity)
+ast_t *make_list_expr(scan_context_t *context, size_t capacity)
 {
-    ast_t *list_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *list_expr = arena_alloc(context->arena, sizeof(ast_t));
     list_expr->type = AST_STMT_LIST;
     list_expr->op.list.size = 0;
     list_expr->op.list.capacity = capacity;
-    list_expr->op.list.items = (ast_t **)malloc(sizeof(ast_t) * capacity);
+    list_expr->op.list.items = arena_alloc(context->arena, sizeof(ast_t *) * capacity);
     return list_expr;
 }
 
-ast_t *make_if_expr(ast_t *condition, ast_t *body)
+ast_t *make_if_expr(scan_context_t *context, ast_t *condition, ast_t *body)
 {
-    ast_t *if_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *if_expr = arena_alloc(context->arena, sizeof(ast_t));
     if_expr->type = AST_IF_STMT;
     if_expr->op.if_stmt.condition = condition;
     if_expr->op.if_stmt.body = body;
     return if_expr;
 }
 
-ast_t *make_for_expr(char *var, ast_t *iterable, ast_t *body)
+ast_t *make_for_expr(scan_context_t *context, char *var, ast_t *iterable, ast_t *body)
 {
-    ast_t *for_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *for_expr = arena_alloc(context->arena, sizeof(ast_t));
     for_expr->type = AST_FOR_STMT;
     for_expr->op.for_stmt.var = var;
     for_expr->op.for_stmt.iterable = iterable;
@@ -277,29 +278,31 @@ ast_t *make_for_expr(char *var, ast_t *iterable, ast_t *body)
     return for_expr;
 }
 
-ast_t *make_range_expr(ast_t *begin, ast_t *end)
+ast_t *make_range_expr(scan_context_t *context, ast_t *begin, ast_t *end)
 {
-    ast_t *range_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *range_expr = arena_alloc(context->arena, sizeof(ast_t));
     range_expr->type = AST_RANGE;
     range_expr->op.range.begin = begin;
     range_expr->op.range.end = end;
     return range_expr;
 }
 
-ast_t *make_module_expr(char *module_name)
+ast_t *make_module_expr(scan_context_t *context, char *module_name)
 {
-    ast_t *module_expr = (ast_t *)malloc(sizeof(ast_t));
+    ast_t *module_expr = arena_alloc(context->arena, sizeof(ast_t));
     module_expr->type = AST_MODULE;
     module_expr->op.module.name = module_name;
     return module_expr;
 }
 
-void list_expr_append(ast_t *list, ast_t *item)
+void list_expr_append(scan_context_t *context, ast_t *list, ast_t *item)
 {
     if (list->op.list.size >= list->op.list.capacity - 1)
     {
+        list->op.list.items = arena_grow(context->arena, list->op.list.items,
+                                         sizeof(ast_t *) * list->op.list.capacity,
+                                         sizeof(ast_t *) * list->op.list.capacity * 2);
         list->op.list.capacity *= 2;
-        list->op.list.items = (ast_t **)realloc(list->op.list.items, sizeof(ast_t) * list->op.list.capacity);
     }
 
     list->op.list.items[list->op.list.size++] = item;
@@ -349,7 +352,7 @@ ast_t *statement_block(scan_context_t* context)
 
 ast_t *statement_list(scan_context_t* context)
 {
-    ast_t *statements = make_list_expr(10);
+    ast_t *statements = make_list_expr(context, 10);
 
     ast_t *current = statement(context);
 
@@ -358,7 +361,7 @@ ast_t *statement_list(scan_context_t* context)
         return statements;
     }
 
-    list_expr_append(statements, current);
+    list_expr_append(context, statements, current);
 
     while (peek(context).type != TOK_EOF && peek(context).type != TOK_EOF)
     {
@@ -370,7 +373,7 @@ ast_t *statement_list(scan_context_t* context)
         current = statement(context);
 
         if (current != NULL)
-            list_expr_append(statements, current);
+            list_expr_append(context, statements, current);
         else
             break;
     }
@@ -385,7 +388,7 @@ ast_t *statement(scan_context_t *context)
     if (peek(context).type == TOK_RETURN)
     {
         token_t ret = accept(context);
-        return make_unary_expr(ret, statement(context));
+        return make_unary_expr(context, ret, statement(context));
     }
 
     if (left == NULL)
@@ -440,7 +443,7 @@ ast_t *import_statement(scan_context_t *context)
 
     token_t module_name = accept(context);
 
-    return make_module_expr(token_value(context, module_name));
+    return make_module_expr(context, token_value(context, module_name));
 }
 
 ast_t *if_statement(scan_context_t *context)
@@ -480,7 +483,7 @@ ast_t *if_statement(scan_context_t *context)
         exit(1);
     }
 
-    return make_if_expr(condition, body);
+    return make_if_expr(context, condition, body);
 }
 
 ast_t *for_statement(scan_context_t *context)
@@ -539,7 +542,7 @@ ast_t *for_statement(scan_context_t *context)
         exit(1);
     }
 
-    return make_for_expr(var, iterable, body);
+    return make_for_expr(context, var, iterable, body);
 }
 
 ast_t *function_decl(scan_context_t *context)
@@ -594,7 +597,7 @@ ast_t *function_decl(scan_context_t *context)
     // TODO: Handle error
     assert(body != NULL);
 
-    left = make_fn_expr(name, exported, args, body);
+    left = make_fn_expr(context, name, exported, args, body);
 
     return left;
 }
@@ -631,7 +634,7 @@ ast_t *anonymous_decl(scan_context_t *context)
     // TODO: Handle error
     assert(body != NULL);
 
-    left = make_fn_expr(name, false, args, body);
+    left = make_fn_expr(context, name, false, args, body);
 
     return left;
 }
@@ -664,7 +667,7 @@ ast_t *variable_decl(scan_context_t *context)
         right = expression(context);
     }
 
-    left = make_declare_expr(var_type, token_value(context, name), right);
+    left = make_declare_expr(context, var_type, token_value(context, name), right);
     left->location.start = var_type.start;
     left->location.end = (right) ? right->location.end : name.end;
 
@@ -678,9 +681,9 @@ ast_t *expression_list(scan_context_t *context)
     if (expr == NULL)
         return NULL;
 
-    ast_t *left = make_list_expr(10);
+    ast_t *left = make_list_expr(context, 10);
 
-    list_expr_append(left, expr);
+    list_expr_append(context, left, expr);
     left->type = AST_EXPR_LIST;
 
     while (peek(context).type == TOK_COMMA)
@@ -691,7 +694,7 @@ ast_t *expression_list(scan_context_t *context)
         expr = expression(context);
         // TODO: Handle error
         assert(expr != NULL);
-        list_expr_append(left, expr);
+        list_expr_append(context, left, expr);
     }
 
     return left;
@@ -721,7 +724,6 @@ ast_t *assignment(scan_context_t *context)
 
     if (peek(context).type != TOK_EQUAL)
     {
-        free(left);
         backup(context);
         return conjunction(context);
     }
@@ -730,7 +732,7 @@ ast_t *assignment(scan_context_t *context)
     accept(context);
 
     ast_t *value = expression(context);
-    left = make_assign_expr(token_value(context, name), value);
+    left = make_assign_expr(context, token_value(context, name), value);
     left->location.start = name.start;
     left->location.end = name.end;
 
@@ -745,7 +747,7 @@ ast_t *conjunction(scan_context_t *context)
     {
         token_t operator = accept(context);
         ast_t *right = equality(context);
-        ast_t *new_left = make_binary_expr(left, operator, right);
+        ast_t *new_left = make_binary_expr(context, left, operator, right);
         new_left->location.start = left->location.start;
         new_left->location.end = right->location.end;
         left = new_left;
@@ -762,7 +764,7 @@ ast_t *equality(scan_context_t *context)
     {
         token_t operator = accept(context);
         ast_t *right = comparison(context);
-        ast_t *new_left = make_binary_expr(left, operator, right);
+        ast_t *new_left = make_binary_expr(context, left, operator, right);
         new_left->location.start = left->location.start;
         new_left->location.end = right->location.end;
         left = new_left;
@@ -779,7 +781,7 @@ ast_t *comparison(scan_context_t *context)
     {
         token_t operator = accept(context);
         ast_t *right = term(context);
-        ast_t *new_left = make_binary_expr(left, operator, right);
+        ast_t *new_left = make_binary_expr(context, left, operator, right);
         new_left->location.start = left->location.start;
         new_left->location.end = right->location.end;
         left = new_left;
@@ -796,7 +798,7 @@ ast_t *term(scan_context_t *context)
     {
         token_t operator = accept(context);
         ast_t *right = term_md(context);
-        ast_t *new_left = make_binary_expr(left, operator, right);
+        ast_t *new_left = make_binary_expr(context, left, operator, right);
         new_left->location.start = left->location.start;
         new_left->location.end = right->location.end;
         left = new_left;
@@ -819,7 +821,7 @@ ast_t *term_md(scan_context_t *context)
             return NULL;
         }
         ast_t *right = unary(context);
-        ast_t *new_left = make_binary_expr(left, operator, right);
+        ast_t *new_left = make_binary_expr(context, left, operator, right);
         new_left->location.start = left->location.start;
         new_left->location.end = right->location.end;
         left = new_left;
@@ -834,7 +836,7 @@ ast_t *unary(scan_context_t *context)
     {
         token_t operator = accept(context);
         ast_t *operand = unary(context);
-        ast_t *unary = make_unary_expr(operator, operand);
+        ast_t *unary = make_unary_expr(context, operator, operand);
         unary->location.start = operator.start;
         unary->location.end = operand->location.end;
         return unary;
@@ -871,7 +873,7 @@ ast_t *primary(scan_context_t *context)
     if (match(context, 7, TOK_IDENTIFIER, TOK_NUMBER, TOK_FLOAT, TOK_STRING, TOK_TRUE, TOK_FALSE, TOK_NIL))
     {
         token_t tok = accept(context);
-        ast_t *literal = make_literal_expr(tok);
+        ast_t *literal = make_literal_expr(context, tok);
         literal->op.literal.value = token_value(context, literal->op.literal.token);
         literal->location.start = tok.start;
         literal->location.end = tok.end;
@@ -897,10 +899,9 @@ ast_t *tuple(scan_context_t *context)
 
         if (expr->op.list.size == 1)
         {
-            ast_t *tmp = make_group_expr(expr->op.list.items[0]);
-            free(expr->op.list.items);
-            free(expr);
-            expr = tmp;
+            location_t location = expr->location;
+            expr = make_group_expr(context, expr->op.list.items[0]);
+            expr->location = location;
         }
         else
         {
@@ -937,7 +938,7 @@ ast_t *range(scan_context_t *context)
             return NULL;
         }
 
-        begin = make_literal_expr(tok);
+        begin = make_literal_expr(context, tok);
         begin->op.literal.value = token_value(context, tok);
 
         accept(context);
@@ -946,9 +947,9 @@ ast_t *range(scan_context_t *context)
         assert(match(context, 2, TOK_IDENTIFIER, TOK_NUMBER));
 
         tok = accept(context);
-        end = make_literal_expr(tok);
+        end = make_literal_expr(context, tok);
         end->op.literal.value = token_value(context, tok);
-        range = make_range_expr(begin, end);
+        range = make_range_expr(context, begin, end);
     }
 
     return range;
@@ -962,7 +963,7 @@ ast_t *member_access(scan_context_t *context)
         return NULL;
 
     token_t identifier = accept(context);
-    left = make_literal_expr(identifier);
+    left = make_literal_expr(context, identifier);
     left->op.literal.value = token_value(context, identifier);
     left->location.start = identifier.start;
     left->location.end = identifier.end;
@@ -981,7 +982,7 @@ ast_t *member_access(scan_context_t *context)
         right = member_access(context);
     }
 
-    return make_binary_expr(left, operator, right);
+    return make_binary_expr(context, left, operator, right);
 }
 
 ast_t *function_call(scan_context_t *context)
@@ -1009,7 +1010,7 @@ ast_t *function_call(scan_context_t *context)
     // TODO: Error handling
     assert(accept(context).type == TOK_R_PAREN);
 
-    left = make_call_expr(fn_name, args);
+    left = make_call_expr(context, fn_name, args);
     left->location.start = identifier.start;
     left->location.end = context->position;
 
@@ -0,0 +1,545 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "peephole.h"
+#include "machine/vm.h"
+
+// How far past a write we look for something reading the register
+#define WINDOW 8
+
+// What reads() and writes() return for instructions that might touch any
+// register, like calls
+#define ANY_REGISTER -1
+
+static peephole_stats_t stats;
+
+// A constant we know a register holds. Booleans and numbers compare with each
+// other by value, so both are kept as a number.
+typedef struct
+{
+    bool known;
+    bool boolean;
+    int32_t number;
+} constant_t;
+
+static bool is_branch(uint8_t opcode)
+{
+    return (opcode >= OP_JMP && opcode <= OP_JMP_NOT_EQUAL_STRING) || opcode == OP_FORITER;
+}
+
+static bool is_compare(uint8_t opcode)
+{
+    return opcode >= OP_JMP_EQUAL && opcode <= OP_JMP_NOT_EQUAL_STRING;
+}
+
+// The registers an instruction reads, or ANY_REGISTER
+static int reads(instruction_t instruction, uint8_t *registers)
+{
+    switch (instruction.opcode)
+    {
+        case OP_NIL:
+        case OP_LOAD:
+        case OP_LOADV:
+        case OP_GETGLOBAL:
+        case OP_POP:
+        case OP_JMP:
+        case OP_GETOUTBOUND:
+            return 0;
+
+        case OP_STORE:
+        case OP_SETINBOUND:
+            registers[0] = instruction.fields.pair.arg1;
+            return 1;
+
+        case OP_MOVE:
+        case OP_SETGLOBAL:
+        case OP_PUSH:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_RETURN:
+            registers[0] = instruction.fields.pair.arg2;
+            return 1;
+
+        case OP_JMP_TRUE:
+        case OP_JMP_FALSE:
+            registers[0] = instruction.fields.branch.arg1;
+            return 1;
+
+        // Builtins find the number of arguments in $0, and the arguments
+        // themselves on the stack
+        case OP_CALL_BUILTIN:
+        case OP_CALL_DYNAMIC:
+            registers[0] = 0;
+            return 1;
+
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_ADD_INT:
+        case OP_ADD_FLOAT:
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_FLOAT:
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_FLOAT:
+        case OP_CONCAT:
+        case OP_AND:
+        case OP_OR:
+            registers[0] = instruction.fields.triplet.arg2;
+            registers[1] = instruction.fields.triplet.arg3;
+            return 2;
+
+        case OP_TUPLE:
+            for (int i = 0; i < instruction.fields.triplet.arg3; i++)
+                registers[i] = instruction.fields.triplet.arg2 + i;
+            return instruction.fields.triplet.arg3;
+
+        case OP_FORITER:
+            for (int i = 0; i < 3; i++)
+                registers[i] = instruction.fields.branch.arg1 + i;
+            return 3;
+
+        default:
+            if (is_compare(instruction.opcode))
+            {
+                registers[0] = instruction.fields.branch.arg1;
+                registers[1] = instruction.fields.branch.arg2;
+                return 2;
+            }
+            return ANY_REGISTER;
+    }
+}
+
+// The registers an instruction writes, or ANY_REGISTER
+static int writes(instruction_t instruction, uint8_t *registers)
+{
+    switch (instruction.opcode)
+    {
+        case OP_NIL:
+        case OP_POP:
+            registers[0] = instruction.fields.pair.arg2;
+            return 1;
+
+        case OP_LOAD:
+        case OP_LOADV:
+        case OP_MOVE:
+        case OP_GETGLOBAL:
+        case OP_NEGATE:
+        case OP_NOT:
+        case OP_GETOUTBOUND:
+            registers[0] = instruction.fields.pair.arg1;
+            return 1;
+
+        case OP_STORE:
+        case OP_SETGLOBAL:
+        case OP_PUSH:
+        case OP_RETURN:
+        case OP_SETINBOUND:
+        case OP_CALL_BUILTIN:
+        case OP_CALL_DYNAMIC:
+            return 0;
+
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_ADD_INT:
+        case OP_ADD_FLOAT:
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_FLOAT:
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_FLOAT:
+        case OP_CONCAT:
+        case OP_AND:
+        case OP_OR:
+        case OP_TUPLE:
+            registers[0] = instruction.fields.triplet.arg1;
+            return 1;
+
+        case OP_FORITER:
+            registers[0] = instruction.fields.branch.arg1 + 1;
+            registers[1] = instruction.fields.branch.arg1 + 2;
+            return 2;
+
+        default:
+            if (is_branch(instruction.opcode))
+                return 0;
+            return ANY_REGISTER;
+    }
+}
+
+static bool contains(uint8_t *registers, int count, uint8_t reg)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (registers[i] == reg)
+            return true;
+    }
+    return false;
+}
+
+// Forget whatever an instruction overwrites
+static void clobber(constant_t *constants, instruction_t instruction)
+{
+    uint8_t written[VM_NUM_REGISTERS];
+    int count = writes(instruction, written);
+
+    if (count == ANY_REGISTER)
+    {
+        for (int i = 0; i < VM_NUM_REGISTERS; i++)
+            constants[i].known = false;
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+        constants[written[i]].known = false;
+}
+
+// A load or move into a register is dead if something in the window
+// overwrites the register before anything reads it, and control can't leave
+// in between
+static bool is_dead_write(code_block_t *block, bool *leaders, bool *removed, size_t i)
+{
+    uint8_t reg;
+    uint8_t registers[VM_NUM_REGISTERS];
+
+    switch (block->code[i].opcode)
+    {
+        case OP_NIL:
+            reg = block->code[i].fields.pair.arg2;
+            break;
+        case OP_LOAD:
+        case OP_LOADV:
+        case OP_MOVE:
+            reg = block->code[i].fields.pair.arg1;
+            break;
+        default:
+            return false;
+    }
+
+    // Counted as a self move instead
+    if (block->code[i].opcode == OP_MOVE && block->code[i].fields.pair.arg2 == reg)
+        return false;
+
+    for (size_t j = i + 1; j < block->size && j <= i + WINDOW; j++)
+    {
+        instruction_t next = block->code[j];
+
+        if (leaders[j])
+            return false;
+
+        if (removed[j])
+            continue;
+
+        int count = reads(next, registers);
+        if (count == ANY_REGISTER || contains(registers, count, reg))
+            return false;
+
+        if (is_branch(next.opcode) || next.opcode == OP_RETURN)
+            return false;
+
+        count = writes(next, registers);
+        if (count == ANY_REGISTER)
+            return false;
+        if (contains(registers, count, reg))
+            return true;
+    }
+
+    return false;
+}
+
+// Whether a branch is taken, if we know what it compares. Returns false if we
+// don't.
+static bool branch_is_decided(instruction_t instruction, constant_t *constants, bool *taken)
+{
+    constant_t a = constants[instruction.fields.branch.arg1];
+    constant_t b = constants[instruction.fields.branch.arg2];
+
+    switch (instruction.opcode)
+    {
+        case OP_JMP_TRUE:
+        case OP_JMP_FALSE:
+            if (!a.known)
+                return false;
+            *taken = (a.number != 0) == (instruction.opcode == OP_JMP_TRUE);
+            return true;
+
+        case OP_JMP_EQUAL_INT:
+        case OP_JMP_NOT_EQUAL_INT:
+        case OP_JMP_LESSTHAN_INT:
+        case OP_JMP_NOT_LESSTHAN_INT:
+            if (a.boolean || b.boolean)
+                return false;
+            // Fall through
+
+        case OP_JMP_EQUAL:
+        case OP_JMP_NOT_EQUAL:
+        case OP_JMP_LESSTHAN:
+        case OP_JMP_NOT_LESSTHAN:
+            if (!a.known || !b.known)
+                return false;
+            break;
+
+        default:
+            return false;
+    }
+
+    switch (instruction.opcode)
+    {
+        case OP_JMP_EQUAL:
+        case OP_JMP_EQUAL_INT:
+            *taken = a.number == b.number;
+            break;
+        case OP_JMP_NOT_EQUAL:
+        case OP_JMP_NOT_EQUAL_INT:
+            *taken = a.number != b.number;
+            break;
+        case OP_JMP_LESSTHAN:
+        case OP_JMP_LESSTHAN_INT:
+            *taken = a.number < b.number;
+            break;
+        default:
+            *taken = a.number >= b.number;
+    }
+
+    return true;
+}
+
+// Make one pass over a block. Returns whether anything changed.
+static bool peephole_block(code_block_t *block, arena_t *arena)
+{
+    size_t size = block->size;
+    bool *leaders = arena_alloc(arena, (size + 1) * sizeof(bool));
+    bool *removed = arena_alloc(arena, (size + 1) * sizeof(bool));
+    int32_t *targets = arena_alloc(arena, (size + 1) * sizeof(int32_t));
+    constant_t constants[VM_NUM_REGISTERS] = { 0 };
+    bool changed = false;
+    bool unreachable = false;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (!is_branch(block->code[i].opcode))
+            continue;
+
+        int32_t target = (int32_t)i + block->code[i].fields.branch.offset;
+
+        // Leave anything we don't understand alone
+        if (target < 0 || target > (int32_t)size)
+            return false;
+
+        targets[i] = target;
+        leaders[target] = true;
+    }
+
+    for (size_t i = 0; i < size; i++)
+    {
+        instruction_t *instruction = &block->code[i];
+        bool taken;
+
+        if (leaders[i])
+        {
+            for (int r = 0; r < VM_NUM_REGISTERS; r++)
+                constants[r].known = false;
+            unreachable = false;
+        }
+
+        if (unreachable)
+        {
+            removed[i] = true;
+            stats.unreachable++;
+            continue;
+        }
+
+        if (is_dead_write(block, leaders, removed, i))
+        {
+            removed[i] = true;
+            stats.dead_writes++;
+            continue;
+        }
+
+        switch (instruction->opcode)
+        {
+            case OP_MOVE:
+            {
+                uint8_t out = instruction->fields.pair.arg1;
+                uint8_t in = instruction->fields.pair.arg2;
+                instruction_t *previous = i > 0 ? &block->code[i - 1] : NULL;
+                bool undoes = previous != NULL && !leaders[i] && !removed[i - 1] &&
+                              previous->opcode == OP_MOVE &&
+                              previous->fields.pair.arg1 == in && previous->fields.pair.arg2 == out;
+
+                if (out == in || undoes)
+                {
+                    removed[i] = true;
+                    stats.self_moves++;
+                    continue;
+                }
+
+                constants[out] = constants[in];
+                continue;
+            }
+
+            // Only true and false are certain not to change, since the
+            // compiler puts them first and never stores there
+            case OP_LOAD:
+            case OP_LOADV:
+            {
+                uint8_t reg = instruction->fields.pair.arg1;
+                constant_t constant = { .known=true };
+
+                if (instruction->opcode == OP_LOADV)
+                {
+                    constant.number = instruction->fields.pair_signed.arg2;
+                }
+                else if (instruction->fields.pair.arg2 <= 1)
+                {
+                    constant.boolean = true;
+                    constant.number = instruction->fields.pair.arg2;
+                }
+                else
+                {
+                    constants[reg].known = false;
+                    continue;
+                }
+
+                if (constants[reg].known && constants[reg].boolean == constant.boolean &&
+                    constants[reg].number == constant.number)
+                {
+                    removed[i] = true;
+                    stats.redundant_loads++;
+                    continue;
+                }
+
+                constants[reg] = constant;
+                continue;
+            }
+
+            case OP_PUSH:
+            {
+                instruction_t *next = i + 1 < size ? &block->code[i + 1] : NULL;
+
+                if (next == NULL || next->opcode != OP_POP || leaders[i + 1])
+                    break;
+
+                uint8_t in = instruction->fields.pair.arg2;
+                uint8_t out = next->fields.pair.arg2;
+
+                if (in == out)
+                {
+                    removed[i] = true;
+                    stats.push_pops++;
+                }
+                else
+                {
+                    *instruction = (instruction_t){ OP_MOVE, .fields={ .pair={ out, in } } };
+                    constants[out] = constants[in];
+                }
+
+                removed[i + 1] = true;
+                stats.push_pops++;
+                changed = true;
+                i++;
+                continue;
+            }
+
+            case OP_JMP:
+                if (instruction->fields.branch.offset == 1)
+                {
+                    removed[i] = true;
+                    stats.empty_jumps++;
+                    continue;
+                }
+                unreachable = true;
+                continue;
+
+            case OP_RETURN:
+                unreachable = true;
+                continue;
+
+            default:
+                if (!is_compare(instruction->opcode) && instruction->opcode != OP_JMP_TRUE &&
+                    instruction->opcode != OP_JMP_FALSE)
+                    break;
+
+                // Comparisons don't do anything but jump, so one that goes to
+                // the next instruction either way is as good as gone
+                if (instruction->fields.branch.offset == 1)
+                {
+                    removed[i] = true;
+                    stats.empty_jumps++;
+                    continue;
+                }
+
+                if (!branch_is_decided(*instruction, constants, &taken))
+                    continue;
+
+                if (taken)
+                {
+                    *instruction = (instruction_t){ OP_JMP, .fields={ .branch={ 0, 0, instruction->fields.branch.offset } } };
+                    unreachable = true;
+                    changed = true;
+                }
+                else
+                {
+                    removed[i] = true;
+                    stats.constant_branches++;
+                }
+                continue;
+        }
+
+        clobber(constants, *instruction);
+    }
+
+    // Everything moves back by however much was removed before it. Anything
+    // that jumped to a removed instruction goes to whatever came after it.
+    int32_t *positions = arena_alloc(arena, (size + 1) * sizeof(int32_t));
+    int32_t position = 0;
+
+    for (size_t i = 0; i <= size; i++)
+    {
+        positions[i] = position;
+        if (i < size && !removed[i])
+            position++;
+    }
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (removed[i])
+        {
+            changed = true;
+            continue;
+        }
+
+        instruction_t instruction = block->code[i];
+
+        if (is_branch(instruction.opcode))
+            instruction.fields.branch.offset = positions[targets[i]] - positions[i];
+
+        block->code[positions[i]] = instruction;
+    }
+
+    block->size = position;
+    return changed;
+}
+
+void peephole_optimize(code_collection_t *code, arena_t *arena)
+{
+    for (size_t i = 0; i < code->size; i++)
+    {
+        while (peephole_block(code->blocks[i], arena))
+            ;
+    }
+}
+
+peephole_stats_t peephole_stats(void)
+{
+    return stats;
+}
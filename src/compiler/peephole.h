@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <stddef.h>
+
+#include "machine/bytecode.h"
+#include "util/arena.h"
+
+// How many instructions the peephole optimizer has removed, by pattern, over
+// everything compiled so far
+typedef struct
+{
+    // move $a $a, or a move undoing the one before it
+    size_t self_moves;
+    // Loads of a constant into a register that already holds it
+    size_t redundant_loads;
+    // Loads and moves into a register that is overwritten before it is read
+    size_t dead_writes;
+    // Branches on registers holding constants, which never jump. The ones
+    // that always jump become plain jumps.
+    size_t constant_branches;
+    // Instructions after a jump or return that nothing jumps to
+    size_t unreachable;
+    // A push straight into a pop, which is just a move
+    size_t push_pops;
+    // Jumps to the next instruction
+    size_t empty_jumps;
+} peephole_stats_t;
+
+// Look over a small window of instructions at a time in each block of the
+// collection, removing the ones that do nothing, and fixing up jump offsets
+// around what was removed. Scratch space is allocated from arena.
+void peephole_optimize(code_collection_t *code, arena_t *arena);
+
+peephole_stats_t peephole_stats(void);
+
+#endif
@@ -19,6 +19,19 @@ symbol_map_t *symbol_map_create(void)
     // We want items to be zero'd out so that we can test for existence
     symbol_map->items = calloc(symbol_map->capacity, sizeof(symbol_t));
     symbol_map->parent = NULL;
+    symbol_map->arena = NULL;
+    return symbol_map;
+}
+
+symbol_map_t *symbol_map_create_in(arena_t *arena)
+{
+    symbol_map_t *symbol_map = arena_alloc(arena, sizeof(symbol_map_t));
+    symbol_map->capacity = 8;
+    symbol_map->size = 0;
+    // Arena memory is already zero'd
+    symbol_map->items = arena_alloc(arena, symbol_map->capacity * sizeof(symbol_t));
+    symbol_map->parent = NULL;
+    symbol_map->arena = arena;
     return symbol_map;
 }
 
@@ -41,18 +54,28 @@ void symbol_map_set(symbol_map_t *symbol_map, symbol_t symbol)
     {
         symbol_t *new_items;
         uint32_t new_capacity = symbol_map->capacity * 2;
-        new_items = calloc(new_capacity, sizeof(symbol_t));
+        if (symbol_map->arena != NULL)
+            new_items = arena_alloc(symbol_map->arena, new_capacity * sizeof(symbol_t));
+        else
+            new_items = calloc(new_capacity, sizeof(symbol_t));
 
         for (int i = 0; i < symbol_map->capacity; i++)
         {
             symbol_t symbol = symbol_map->items[i];
             if (symbol.name != NULL)
             {
-                new_items[pjw_hash(symbol.name) & (new_capacity - 1)] = symbol;
+                // Symbols that collided before may collide again, so probe
+                // for a free spot just like below
+                uint32_t index = pjw_hash(symbol.name) & (new_capacity - 1);
+                while (new_items[index].name != NULL)
+                    index = (index + 1) & (new_capacity - 1);
+
+                new_items[index] = symbol;
             }
         }
 
-        free(symbol_map->items);
+        if (symbol_map->arena == NULL)
+            free(symbol_map->items);
         symbol_map->capacity = new_capacity;
         symbol_map->items = new_items;
     }
@@ -65,11 +88,14 @@ void symbol_map_set(symbol_map_t *symbol_map, symbol_t symbol)
     while (symbol_map->items[index].name != NULL &&
            strcmp(symbol.name, symbol_map->items[index].name) != 0)
     {
-        index += 1;
+        index = (index + 1) & (symbol_map->capacity - 1);
     }
 
+    // Only a new symbol makes the map any fuller
+    if (symbol_map->items[index].name == NULL)
+        symbol_map->size += 1;
+
     symbol_map->items[index] = symbol;
-    symbol_map->size += 1;
 }
 
 symbol_t symbol_map_get_local(symbol_map_t *symbol_map, char *name)
@@ -83,7 +109,7 @@ symbol_t symbol_map_get_local(symbol_map_t *symbol_map, char *name)
     // If we have a collision, advance until we find the correct symbol
     while (symbol.name != NULL && strcmp(symbol.name, name))
     {
-        index += 1;
+        index = (index + 1) & (symbol_map->capacity - 1);
         // TODO: Should we really be assigning here?
         symbol = symbol_map->items[index];
     }
@@ -121,7 +147,7 @@ symbol_map_t *symbol_map_context(symbol_map_t *symbol_map, char *name)
         if (context == NULL)
             return context;
 
-        symbol = symbol_map_get(context, name);
+        symbol = symbol_map_get_local(context, name);
     }
 
     return context;
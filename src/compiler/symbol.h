@@ -7,6 +7,11 @@
 #ifndef SYMBOL_H
 #define SYMBOL_H
 
+#include <stdint.h>
+
+#include "machine/value.h"
+#include "util/arena.h"
+
 typedef enum {
     SYM_NONE,
     SYM_VAR,
@@ -23,6 +28,8 @@ typedef struct
         LOC_UNDEF,
         LOC_REGISTER,
         LOC_MEMORY,
+        // A variable that didn't fit in the registers, kept in memory instead
+        LOC_SPILLED,
         LOC_CODE,
         LOC_BUILTIN,
         // Used to indicate a symbol has been declared but not assigned
@@ -38,6 +45,10 @@ typedef struct
     const char *name;
     sym_type_e type;
     sym_pointer_t location;
+    // Function nesting depth the symbol was declared at (0 is the top level)
+    uint8_t depth;
+    // The type of the symbol's value, if known at compile time
+    value_type_e value_type;
 } symbol_t;
 
 // Symbol hash map, containing an array of symbols
@@ -48,9 +59,14 @@ typedef struct sym_map_t
     uint32_t capacity;
     symbol_t *items;
     struct sym_map_t *parent;
+    // The arena this map allocates from, or NULL for the heap
+    arena_t *arena;
 } symbol_map_t;
 
 symbol_map_t *symbol_map_create(void);
+// Create a map for a scope that only lasts as long as the arena does. It is
+// freed along with the arena, rather than by symbol_map_destroy.
+symbol_map_t *symbol_map_create_in(arena_t *arena);
 void symbol_map_destroy(symbol_map_t *);
 
 // Adding / getting items
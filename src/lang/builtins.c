@@ -6,8 +6,11 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include "builtins.h"
+#include "machine/gc.h"
 #include "machine/memory.h"
 #include "machine/value.h"
 #include "machine/vm.h"
@@ -18,23 +21,23 @@ void print_internal(value_t val)
     tuple_t *t1;
     iterator_t *i1;
 
-    switch(val.type)
+    switch (value_type_of(val))
     {
         case VAL_STRING:
-            s1 = (string_t *)val.contents.object;
-            printf("%s", s1->string);
+            s1 = (string_t *)value_as_object(val);
+            printf("%s", string_chars(s1));
             break;
 
         case VAL_INT:
-            printf("%d", val.contents.number);
+            printf("%d", value_as_int(val));
             break;
 
         case VAL_FLOAT:
-            printf("%f", val.contents.real);
+            printf("%f", value_as_float(val));
             break;
 
         case VAL_BOOLEAN:
-            printf("%s", val.contents.boolean ? "true" : "false");
+            printf("%s", value_as_bool(val) ? "true" : "false");
             break;
 
         case VAL_ABSENT:
@@ -42,7 +45,7 @@ void print_internal(value_t val)
             break;
 
         case VAL_TUPLE:
-            t1 = (tuple_t *)val.contents.object;
+            t1 = (tuple_t *)value_as_object(val);
             printf("(");
             for (int i = 0; i < t1->length; i++)
             {
@@ -52,8 +55,19 @@ void print_internal(value_t val)
             }
             printf(")");
             break;
+        // Ranges print the same as the tuple they describe
+        case VAL_RANGE:
+            printf("(");
+            for (int i = 0; i < range_length(val); i++)
+            {
+                printf("%d", range_at(val, i));
+                if (i < range_length(val) - 1)
+                    printf(", ");
+            }
+            printf(")");
+            break;
         case VAL_ITERATOR:
-            i1 = (iterator_t *)val.contents.object;
+            i1 = (iterator_t *)value_as_object(val);
             printf("Iterator over ");
             print_internal((i1->iterable));
             break;
@@ -76,7 +90,7 @@ void print_internal(value_t val)
 // Returns true
 void builtin__print(vm_t *vm)
 {
-    int num_args = vm->registers[0].contents.number;
+    int num_args = value_as_int(vm->registers[0]);
 
     if (!num_args)
     {
@@ -84,36 +98,28 @@ void builtin__print(vm_t *vm)
         goto print_ret;
     }
 
-    value_t result;
     value_t val = vm_stack_pop(vm);
 
     print_internal(val);
     printf("\n");
 
 print_ret:
-    result.type = VAL_BOOLEAN;
-    result.contents.boolean = true;
-
-    vm_stack_push(vm, result);
+    vm_stack_push(vm, value_from_bool(true));
 }
 
 void builtin__time(vm_t *vm)
 {
-    value_t result;
     time_t tm = time(NULL);
 
-    result.type = VAL_INT;
-    result.contents.number = tm;
-
-    vm_stack_push(vm, result);
+    vm_stack_push(vm, value_from_int(tm));
 }
 
 // -- Object creation
 
 void builtin__iter(vm_t *vm)
 {
-    assert(vm->registers[0].type == VAL_INT);
-    int num_args = vm->registers[0].contents.number;
+    assert(value_type_of(vm->registers[0]) == VAL_INT);
+    int num_args = value_as_int(vm->registers[0]);
 
     // TODO: Handle errors
     assert(num_args == 1);
@@ -129,14 +135,15 @@ void builtin__iter(vm_t *vm)
 
 void builtin__tuple(vm_t *vm)
 {
-    assert(vm->registers[0].type == VAL_INT);
-    int num_args = vm->registers[0].contents.number;
+    assert(value_type_of(vm->registers[0]) == VAL_INT);
+    int num_args = value_as_int(vm->registers[0]);
     value_t val = tuple_create(num_args);
-    tuple_t *tuple = (tuple_t *)val.contents.object;
+    tuple_t *tuple = (tuple_t *)value_as_object(val);
 
     for (int i = 0; i < num_args; i++)
     {
         tuple->values[i] = vm_stack_pop(vm);
+        gc_write_barrier(tuple->values[i]);
     }
 
     vm_stack_push(vm, val);
@@ -144,45 +151,24 @@ void builtin__tuple(vm_t *vm)
 
 void builtin__range(vm_t *vm)
 {
-    assert(vm->registers[0].type == VAL_INT);
-    assert(vm->registers[0].contents.number == 2);
+    assert(value_type_of(vm->registers[0]) == VAL_INT);
+    assert(value_as_int(vm->registers[0]) == 2);
 
     value_t begin = vm_stack_pop(vm);
     value_t end = vm_stack_pop(vm);
-    value_t val;
 
     // TODO: Error handling!
-    assert(begin.type == end.type);
-    assert(begin.type == VAL_INT);
+    assert(value_type_of(begin) == value_type_of(end));
+    assert(value_type_of(begin) == VAL_INT);
 
-    if (begin.contents.number == end.contents.number)
-    {
-        val = tuple_create(0);
-    }
-    else if (begin.contents.number < end.contents.number)
+    if (!range_fits(value_as_int(begin), value_as_int(end)))
     {
-        int len = end.contents.number - begin.contents.number + 1;
-        val = tuple_create(len);
-        tuple_t *tuple = (tuple_t *)val.contents.object;
-
-        for (int i = 0; i < len; i++)
-        {
-            tuple->values[i] = (value_t){VAL_INT, .contents={ .number=begin.contents.number + i } };
-        }
-    }
-    else
-    {
-        int len = begin.contents.number - end.contents.number + 1;
-        val = tuple_create(len);
-        tuple_t *tuple = (tuple_t *)val.contents.object;
-
-        for (int i = 0; i < len; i++)
-        {
-            tuple->values[i] = (value_t){VAL_INT, .contents={ .number=begin.contents.number - i } };
-        }
+        asprintf(&vm->error, "Range bounds must be between %d and %d",
+                 VALUE_RANGE_MIN, VALUE_RANGE_MAX);
+        return;
     }
 
-    vm_stack_push(vm, val);
+    vm_stack_push(vm, range_create(value_as_int(begin), value_as_int(end)));
 }
 
 // -- Type handling
@@ -190,44 +176,48 @@ void builtin__range(vm_t *vm)
 void builtin__type(vm_t *vm)
 {
     // Error handling!
-    assert(vm->registers[0].contents.number == 1);
+    assert(value_as_int(vm->registers[0]) == 1);
     value_t val = vm_stack_pop(vm);
-    switch (val.type)
+    switch (value_type_of(val))
     {
         case VAL_FLOAT:
-            vm_stack_push(vm, string_create("float"));
+            vm_stack_push(vm, string_intern("float"));
             break;
 
         case VAL_INT:
-            vm_stack_push(vm, string_create("integer"));
+            vm_stack_push(vm, string_intern("integer"));
             break;
 
         case VAL_BOOLEAN:
-            vm_stack_push(vm, string_create("boolean"));
+            vm_stack_push(vm, string_intern("boolean"));
             break;
 
         case VAL_STRING:
-            vm_stack_push(vm, string_create("string"));
+            vm_stack_push(vm, string_intern("string"));
             break;
 
         case VAL_TUPLE:
-            vm_stack_push(vm, string_create("tuple"));
+            vm_stack_push(vm, string_intern("tuple"));
+            break;
+
+        case VAL_RANGE:
+            vm_stack_push(vm, string_intern("range"));
             break;
 
         case VAL_ITERATOR:
-            vm_stack_push(vm, string_create("iterator"));
+            vm_stack_push(vm, string_intern("iterator"));
             break;
 
         case VAL_NIL:
-            vm_stack_push(vm, string_create("nil"));
+            vm_stack_push(vm, string_intern("nil"));
             break;
 
         case VAL_FUNCTION:
-            vm_stack_push(vm, string_create("function"));
+            vm_stack_push(vm, string_intern("function"));
             break;
 
         case VAL_MODULE:
-            vm_stack_push(vm, string_create("module"));
+            vm_stack_push(vm, string_intern("module"));
             break;
 
         case VAL_ABSENT:
@@ -243,18 +233,14 @@ void builtin__type(vm_t *vm)
 void builtin__int(vm_t *vm)
 {
     value_t val = vm_stack_pop(vm);
-    switch(val.type)
+    switch (value_type_of(val))
     {
         case VAL_FLOAT:
-            val.contents.number = (int)val.contents.real;
-            val.type = VAL_INT;
-            vm_stack_push(vm, val);
+            vm_stack_push(vm, value_from_int((int)value_as_float(val)));
             break;
 
         case VAL_BOOLEAN:
-            val.contents.number = (val.contents.boolean) ? 1 : 0;
-            val.type = VAL_INT;
-            vm_stack_push(vm, val);
+            vm_stack_push(vm, value_from_int(value_as_bool(val) ? 1 : 0));
             break;
 
         // TODO: Handle strings
@@ -265,23 +251,25 @@ void builtin__int(vm_t *vm)
 
 void builtin__string(vm_t *vm)
 {
-    char *str;
+    // Big enough for any int or float printed with %f
+    char str[64];
+    int length;
     value_t val = vm_stack_pop(vm);
-    switch(val.type)
+    switch (value_type_of(val))
     {
         case VAL_INT:
-            asprintf(&str, "%d", val.contents.number);
-            vm_stack_push(vm, string_create(str));
+            length = snprintf(str, sizeof(str), "%d", value_as_int(val));
+            vm_stack_push(vm, string_create_length(str, length));
             break;
 
         case VAL_FLOAT:
-            asprintf(&str, "%f", val.contents.real);
-            vm_stack_push(vm, string_create(str));
+            length = snprintf(str, sizeof(str), "%f", value_as_float(val));
+            vm_stack_push(vm, string_create_length(str, length));
             break;
 
         case VAL_BOOLEAN:
-            asprintf(&str, "%s", (val.contents.boolean) ? "true" : "false");
-            vm_stack_push(vm, string_create(str));
+            length = snprintf(str, sizeof(str), "%s", (value_as_bool(val)) ? "true" : "false");
+            vm_stack_push(vm, string_create_length(str, length));
             break;
 
         // TODO: Handle strings
@@ -289,3 +277,75 @@ void builtin__string(vm_t *vm)
             break;
     }
 }
+
+// -- Memory
+
+// Collect garbage now, returning the number of objects freed
+void builtin__gc(vm_t *vm)
+{
+    vm_stack_push(vm, value_from_int(gc_collect()));
+}
+
+// Returns a tuple of how many major and minor collections there have been,
+// then the longest and total time spent paused for them, in microseconds
+void builtin__gc_stats(vm_t *vm)
+{
+    gc_stats_t stats = gc_stats();
+    value_t val = tuple_create(4);
+    tuple_t *tuple = (tuple_t *)value_as_object(val);
+
+    tuple->values[0] = value_from_int(stats.collections);
+    tuple->values[1] = value_from_int(stats.minor_collections);
+    tuple->values[2] = value_from_int(stats.pause_max_ns / 1000);
+    tuple->values[3] = value_from_int(stats.pause_total_ns / 1000);
+
+    vm_stack_push(vm, val);
+}
+
+// Lower the heap limit of the running VM to the given number of bytes. A
+// script can't raise or remove its own limit.
+void builtin__heap_limit(vm_t *vm)
+{
+    value_t val = vm_stack_pop(vm);
+
+    if (value_type_of(val) != VAL_INT || value_as_int(val) <= 0)
+    {
+        asprintf(&vm->error, "heap_limit expects a positive number of bytes");
+        return;
+    }
+
+    size_t limit = value_as_int(val);
+
+    if (vm->heap.limit == 0 || limit < vm->heap.limit)
+        vm_set_heap_limit(vm, limit);
+}
+
+// -- Registry
+
+const builtin_t builtins[] = {
+    { "print", builtin__print },
+    { "time", builtin__time },
+    { "iter", builtin__iter },
+    { "tuple", builtin__tuple },
+    { "range", builtin__range },
+    { "type", builtin__type },
+    { "int", builtin__int },
+    { "string", builtin__string },
+    { "gc", builtin__gc },
+    { "gc_stats", builtin__gc_stats },
+    { "heap_limit", builtin__heap_limit },
+    { NULL, NULL },
+};
+
+const int builtin_count = sizeof(builtins) / sizeof(builtins[0]) - 1;
+
+int builtin_lookup(const char *name)
+{
+    for (int i = 0; builtins[i].name != NULL; i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "machine/vm.h"
+
+// Builtins are native functions which operate directly on the VM. Arguments
+// are passed on the stack, with the number of arguments in $0, and the result
+// is pushed back onto the stack.
+typedef void (*builtin_fn_t)(vm_t *);
+
+typedef struct
+{
+    const char *name;
+    builtin_fn_t function;
+} builtin_t;
+
+// Registry of all builtins, terminated by an entry with a NULL name. A
+// builtin's index in this table is what the callb instruction refers to.
+extern const builtin_t builtins[];
+
+// How many builtins there are, not counting the terminating entry
+extern const int builtin_count;
+
+// Returns the index of the named builtin, or -1 if no such builtin exists
+int builtin_lookup(const char *name);
+
+#endif
@@ -38,7 +38,18 @@ binary_t *binary_load(const char *path)
     read(fd, &binary->magic, 4);
     read(fd, &binary->version, 2);
 
-    assert(binary->magic == 0xBABABEEF);
+    if (binary->magic != 0xBABABEEF || binary->version != VERSION)
+    {
+        if (binary->magic != 0xBABABEEF)
+            fprintf(stderr, "%s: Not a nord binary\n", path);
+        else
+            fprintf(stderr, "%s: Binary is version %d, but only version %d can be loaded\n",
+                    path, binary->version, VERSION);
+
+        close(fd);
+        free(binary);
+        return NULL;
+    }
 
     read(fd, &binary->reserved, 2);
 
@@ -46,7 +57,8 @@ binary_t *binary_load(const char *path)
 
     // Load data section
     lseek(fd, binary->sections.data_offset, SEEK_SET);
-    memory_t *mem = memory_create(1);
+    // Every value takes at least a descriptor, which bounds how many there are
+    memory_t *mem = memory_create((binary->sections.code_offset - binary->sections.data_offset) / sizeof(packed_memory_value_t));
     size_t bytes_read = 0;
     int i = 0;
     while (bytes_read < binary->sections.code_offset - binary->sections.data_offset)
@@ -54,25 +66,32 @@ binary_t *binary_load(const char *path)
         // First, read off our packed memory value descriptor and create a value_t
         value_t val;
         char *str;
+        int number;
+        float real;
+        bool boolean;
         packed_memory_value_t packed;
         read(fd, &packed, sizeof(packed_memory_value_t));
         bytes_read += sizeof(packed_memory_value_t);
-        val.type = packed.type;
-        switch (val.type)
+        val = value_from_type(packed.type);
+        switch (packed.type)
         {
             case VAL_INT:
-                read(fd, &val.contents.number, packed.v_size);
+                read(fd, &number, packed.v_size);
+                val = value_from_int(number);
                 break;
             case VAL_FLOAT:
-                read(fd, &val.contents.real, packed.v_size);
+                read(fd, &real, packed.v_size);
+                val = value_from_float(real);
                 break;
             case VAL_BOOLEAN:
-                read(fd, &val.contents.boolean, packed.v_size);
+                read(fd, &boolean, packed.v_size);
+                val = value_from_bool(boolean);
                 break;
             case VAL_STRING:
                 str = (char *)malloc(packed.v_size);
                 read(fd, str, packed.v_size);
-                val = string_create(str);
+                val = string_intern(str);
+                free(str);
                 break;
             default:
                 ;
@@ -113,8 +132,8 @@ void binary_write(binary_t *binary, const char *path)
     for (int i = 0; i < binary->data->capacity; i++)
     {
         uint32_t size = 0;
-        packed_values[i].type = binary->data->contents[i].type;
-        switch(binary->data->contents[i].type)
+        packed_values[i].type = value_type_of(memory_get(binary->data, i));
+        switch (value_type_of(memory_get(binary->data, i)))
         {
             case VAL_INT:
                 size = sizeof(int);
@@ -126,8 +145,8 @@ void binary_write(binary_t *binary, const char *path)
                 size = sizeof(bool);
                 break;
             case VAL_STRING:
-                s1 = (string_t *)binary->data->contents[i].contents.object;
-                size = strlen(s1->string) + 1;
+                s1 = (string_t *)value_as_object(memory_get(binary->data, i));
+                size = s1->length + 1;
                 break;
             default:
                 ;
@@ -148,26 +167,36 @@ void binary_write(binary_t *binary, const char *path)
     for (int i = 0; i < binary->data->capacity; i++)
     {
         write(fd, &packed_values[i], sizeof(packed_memory_value_t));
-        switch(binary->data->contents[i].type)
+        value_t val = memory_get(binary->data, i);
+        int number;
+        float real;
+        bool boolean;
+        switch (value_type_of(val))
         {
             case VAL_INT:
-                write(fd, &binary->data->contents[i].contents.number, packed_values[i].v_size);
+                number = value_as_int(val);
+                write(fd, &number, packed_values[i].v_size);
                 break;
             case VAL_FLOAT:
-                write(fd, &binary->data->contents[i].contents.real, packed_values[i].v_size);
+                real = value_as_float(val);
+                write(fd, &real, packed_values[i].v_size);
                 break;
             case VAL_BOOLEAN:
-                write(fd, &binary->data->contents[i].contents.boolean, packed_values[i].v_size);
+                boolean = value_as_bool(val);
+                write(fd, &boolean, packed_values[i].v_size);
                 break;
             case VAL_STRING:
-                s1 = (string_t *)binary->data->contents[i].contents.object;
-                write(fd, s1->string, packed_values[i].v_size);
+                s1 = (string_t *)value_as_object(val);
+                write(fd, string_chars(s1), packed_values[i].v_size);
                 break;
             case VAL_ABSENT:
                 ;
             case VAL_TUPLE:
                 // TODO: Handle
                 ;
+            case VAL_RANGE:
+                // TODO: Handle
+                ;
             case VAL_ITERATOR:
                 // TODO: Handle
                 ;
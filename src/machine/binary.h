@@ -13,7 +13,9 @@
 #include "bytecode.h"
 #include "memory.h"
 
-#define VERSION            1
+// Bump this whenever the layout of instructions or data changes, since a
+// binary from another version would load fine and then do the wrong thing
+#define VERSION            2
 
 typedef struct
 {
@@ -39,6 +41,7 @@ typedef struct
 } binary_t;
 
 binary_t *binary_create(void);
+// Returns NULL, after saying why, for anything but a binary of this VERSION
 binary_t *binary_load(const char *);
 void binary_write(binary_t *binary, const char *);
 
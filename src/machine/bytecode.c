@@ -33,22 +33,14 @@ void code_block_write(code_block_t *block, instruction_t val)
     // Grow our capacity if necessary
     if (block->size >= (block->capacity - 1))
     {
+        block->code = realloc(block->code, sizeof(instruction_t) * block->capacity * 2);
         block->capacity = block->capacity * 2;
-        block->code = realloc(block->code, sizeof(instruction_t) * block->capacity);
     }
 
     block->code[block->size] = val;
     block->size = block->size + 1;
 }
 
-void code_block_merge(code_block_t *into, code_block_t *from)
-{
-    for (int i = 0; i < from->size; i++)
-    {
-        code_block_write(into, from->code[i]);
-    }
-}
-
 code_collection_t *code_collection_create(void)
 {
     return calloc(1, sizeof(code_collection_t));
@@ -32,6 +32,13 @@ typedef enum
     // move <register-out> <register-in>
     //      Move a value from one register to another
     OP_MOVE,
+    // getglobal <register-out> <global-register>
+    //      Copy a top-level register into a register in the current window.
+    //      Registers are otherwise relative to the current call frame.
+    OP_GETGLOBAL,
+    // setglobal <global-register> <register-in>
+    //      Copy a register in the current window into a top-level register
+    OP_SETGLOBAL,
 
     // -- Stack manipulation
 
@@ -41,15 +48,44 @@ typedef enum
     // pop <register>
     //      Pop the next value on the stack into the given register
     OP_POP,
-    // restore <num-registers>
-    OP_RESTORE,
 
     // -- Jumps
+    //
+    // Jump offsets are signed immediates, relative to the jump instruction
+    // itself.
 
-    // jump <register>
-    //      Jump a given number of instructions based on the value in the
-    //      target register
+    // jump <offset>
+    //      Jump a given number of instructions
     OP_JMP,
+    // jumpt / jumpf <register> <offset>
+    //      Jump if the value in the register is truthy / falsy
+    OP_JMP_TRUE,
+    OP_JMP_FALSE,
+    // jumpeq / jumpne <register-in> <register-in> <offset>
+    //      Jump if the two registers are equal / not equal
+    OP_JMP_EQUAL,
+    OP_JMP_NOT_EQUAL,
+    // jumplt / jumpnlt <register-in> <register-in> <offset>
+    //      Jump if the first register is less than / not less than the second
+    OP_JMP_LESSTHAN,
+    OP_JMP_NOT_LESSTHAN,
+
+    // Type-specialized compare-and-jumps. Like the type-specialized
+    // arithmetic below, these don't check the types of their operands.
+
+    // jumpeq.i / jumpne.i / jumplt.i / jumpnlt.i
+    OP_JMP_EQUAL_INT,
+    OP_JMP_NOT_EQUAL_INT,
+    OP_JMP_LESSTHAN_INT,
+    OP_JMP_NOT_LESSTHAN_INT,
+    // jumpeq.f / jumpne.f / jumplt.f / jumpnlt.f
+    OP_JMP_EQUAL_FLOAT,
+    OP_JMP_NOT_EQUAL_FLOAT,
+    OP_JMP_LESSTHAN_FLOAT,
+    OP_JMP_NOT_LESSTHAN_FLOAT,
+    // jumpeq.s / jumpne.s
+    OP_JMP_EQUAL_STRING,
+    OP_JMP_NOT_EQUAL_STRING,
 
     // -- Arithmetic operations
 
@@ -66,6 +102,23 @@ typedef enum
     // modulo <register-out> <register-in> <register-in>
     OP_MODULO,
 
+    // Type-specialized arithmetic. The compiler emits these in place of the
+    // generic instructions above when it knows the types of both operands,
+    // so they don't check them at runtime.
+
+    // add.i / add.f <register-out> <register-in> <register-in>
+    OP_ADD_INT,
+    OP_ADD_FLOAT,
+    // subtract.i / subtract.f <register-out> <register-in> <register-in>
+    OP_SUBTRACT_INT,
+    OP_SUBTRACT_FLOAT,
+    // multiply.i / multiply.f <register-out> <register-in> <register-in>
+    OP_MULTIPLY_INT,
+    OP_MULTIPLY_FLOAT,
+    // concat <register-out> <register-in> <register-in>
+    //      Add two strings
+    OP_CONCAT,
+
     // -- Logic
 
     // and <register-out> <register-in> <register-in>
@@ -75,41 +128,55 @@ typedef enum
     // not <register-out> <register-in>
     OP_NOT,
 
-    // equal <value-desired> <register-in> <register-in>
-    //      If the result comparing the two in-registers for equality results
-    //      in the value specified in arg1, execute the next instruction.
-    //      Otherwise, jump over it.
-    OP_EQUAL,
-    // lt <value-desired> <register-in> <register-in>
-    //      If the result of comparing the first in-register to the second by
-    //      '<' martches the desired value specified in arg1, execute the next
-    //      instruction. Otherwise, jump over it.
-    OP_LESSTHAN,
+    // -- Collections
+
+    // tuple <register-out> <register-in> <count>
+    //      Build a tuple out of <count> registers, starting at <register-in>
+    OP_TUPLE,
 
     // -- Iteration
 
-    // deref <register-out> <register-in> <register-post-advance>
-    //      TODO: This instruction should be renamed
-    //      Dereference the value pointed to by the iterator in register-in,
-    //      storing the value at that index in register-out. Finally, advance
-    //      the iterator by the value in register-post-advance.
-    OP_DEREF,
+    // foriter <register> <offset>
+    //      Step a for loop. The loop keeps the collection being iterated in
+    //      <register>, the index of the next element in the register after
+    //      it, and the loop variable in the one after that. If there is a
+    //      next element, load it into the loop variable, advance the index,
+    //      and jump by <offset> back to the top of the loop body. Otherwise,
+    //      fall through.
+    OP_FORITER,
 
     // -- Functions
 
-    // call
+    // call <register> @<memory-addr>
+    //      Call the function stored at the given address. The callee's
+    //      register window starts at <register>, so the arguments are passed
+    //      in the registers following it, and the return value is left in it.
     OP_CALL,
 
     // calld @<memory-addr>
+    //      Call the builtin whose name is stored at the given address. These
+    //      are bound to callb instructions when the VM is created.
     OP_CALL_DYNAMIC,
 
+    // callb <builtin-index>
+    //      Call a builtin by its index in the builtin registry
+    OP_CALL_BUILTIN,
+
     // return <register>
+    //      Copy a register into $0 (the caller's result register), and slide
+    //      the register window back to the caller's
     OP_RETURN,
 
     // -- Modules
 
     // import @<memory-addr>
     OP_IMPORT,
+    // setinbound <register> @<module-addr>
+    //      Hand the value in a register to the module's inbound queue
+    OP_SETINBOUND,
+    // getoutbound <register> @<module-addr>
+    //      Take the next value off the module's outbound queue
+    OP_GETOUTBOUND,
 } opcode_t;
 
 // An instruction is an opcode paired with several operands
@@ -132,6 +199,12 @@ typedef struct
             uint8_t arg2;
             uint8_t arg3;
         } triplet;
+        // Represents a jump of the form OP A B <offset>
+        struct {
+            uint8_t arg1;
+            uint8_t arg2;
+            int16_t offset;
+        } branch;
     } fields;
 } instruction_t;
 
@@ -152,7 +225,6 @@ typedef struct
 
 code_block_t *code_block_create(void);
 void code_block_write(code_block_t *, instruction_t);
-void code_block_merge(code_block_t *, code_block_t *);
 void code_block_free(code_block_t *);
 
 code_collection_t *code_collection_create(void);
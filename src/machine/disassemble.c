@@ -10,10 +10,12 @@
 
 #include "disassemble.h"
 #include "memory.h"
+#include "lang/builtins.h"
 
 #define FORMAT_SINGLE           "%-10s $%d\n"
 #define FORMAT_SINGLE_CONST     "%-10s %d\n"
 #define FORMAT_SINGLE_ADDR      "%-10s @%d\n"
+#define FORMAT_SINGLE_NAME      "%-10s %s\n"
 #define FORMAT_PAIR             "%-10s $%d $%d\n"
 #define FORMAT_PAIR_ADDR        "%-10s $%d @%d\n"
 #define FORMAT_PAIR_ADDR2       "%-10s @%d $%d\n"
@@ -23,6 +25,7 @@
 #define FORMAT_TRIPLET          "%-10s $%d $%d $%d\n"
 #define FORMAT_TRIPLET_CMP      "%-10s %d $%d $%d\n"
 #define FORMAT_TRIPLET_VAL      "%-10s $%d $%d %d\n"
+#define FORMAT_BRANCH           "%-10s $%d $%d %d\n"
 
 char *disassemble_instruction(memory_t *mem, instruction_t);
 
@@ -90,12 +93,12 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                     );
             break;
 
-        case OP_DEREF:
-            asprintf(&assembly, FORMAT_TRIPLET_VAL,
-                     "deref",
-                     instruction.fields.triplet.arg1,
-                     instruction.fields.triplet.arg2,
-                     instruction.fields.triplet.arg3
+        // foriter <register> <offset>
+        case OP_FORITER:
+            asprintf(&assembly, FORMAT_PAIR_CONST_NUM,
+                     "foriter",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.offset
                     );
             break;
 
@@ -103,7 +106,8 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
         case OP_LOAD:
             value = memory_get(mem, instruction.fields.pair.arg2);
 
-            if (value.type == VAL_ABSENT)
+            // Spill slots start out as nil, and aren't constants
+            if (value_type_of(value) == VAL_ABSENT || value_type_of(value) == VAL_NIL)
             {
                 asprintf(&assembly, FORMAT_PAIR_ADDR,
                         "load",
@@ -116,18 +120,18 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
             // registers. We do this only for "constant" values though.
             else
             {
-                if (value.type == VAL_INT)
-                    asprintf(&str, "%d", value.contents.number);
-                else if (value.type == VAL_STRING)
+                if (value_type_of(value) == VAL_INT)
+                    asprintf(&str, "%d", value_as_int(value));
+                else if (value_type_of(value) == VAL_STRING)
                 {
-                    s1 = (string_t *)value.contents.object;
-                    asprintf(&str, "\"%s\"", s1->string);
+                    s1 = (string_t *)value_as_object(value);
+                    asprintf(&str, "\"%s\"", string_chars(s1));
                 }
-                else if (value.type == VAL_FLOAT)
-                    asprintf(&str, "%f", value.contents.real);
-                else if (value.type == VAL_BOOLEAN)
-                    asprintf(&str, "%s", (value.contents.boolean == true) ? "true" : "false");
-                else if (value.type == VAL_FUNCTION)
+                else if (value_type_of(value) == VAL_FLOAT)
+                    asprintf(&str, "%f", value_as_float(value));
+                else if (value_type_of(value) == VAL_BOOLEAN)
+                    asprintf(&str, "%s", (value_as_bool(value) == true) ? "true" : "false");
+                else if (value_type_of(value) == VAL_FUNCTION)
                     asprintf(&str, "@%d ; Function", instruction.fields.pair.arg2);
                 asprintf(&assembly, FORMAT_PAIR_CONST_STR,
                         "set",
@@ -152,8 +156,8 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
         case OP_STORE:
             asprintf(&assembly, FORMAT_PAIR_ADDR2,
                      "store",
-                     instruction.fields.pair.arg1,
-                     instruction.fields.pair.arg2
+                     instruction.fields.pair.arg2,
+                     instruction.fields.pair.arg1
                     );
             break;
 
@@ -166,6 +170,24 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                     );
             break;
 
+        // getglobal <register-out> <global-register>
+        case OP_GETGLOBAL:
+            asprintf(&assembly, FORMAT_PAIR,
+                     "getglobal",
+                     instruction.fields.pair.arg1,
+                     instruction.fields.pair.arg2
+                    );
+            break;
+
+        // setglobal <global-register> <register-in>
+        case OP_SETGLOBAL:
+            asprintf(&assembly, FORMAT_PAIR,
+                     "setglobal",
+                     instruction.fields.pair.arg1,
+                     instruction.fields.pair.arg2
+                    );
+            break;
+
         // push <register>
         case OP_PUSH:
             asprintf(&assembly, FORMAT_SINGLE,
@@ -182,18 +204,153 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                     );
             break;
 
-        case OP_RESTORE:
+        // jump <offset>
+        case OP_JMP:
             asprintf(&assembly, FORMAT_SINGLE_CONST,
-                     "restore",
-                     instruction.fields.pair.arg2
+                     "jump",
+                     instruction.fields.branch.offset
                     );
             break;
 
-        // jump <instruction #>
-        case OP_JMP:
-            asprintf(&assembly, FORMAT_SINGLE,
-                     "jump",
-                     instruction.fields.pair.arg2
+        case OP_JMP_TRUE:
+            asprintf(&assembly, FORMAT_PAIR_CONST_NUM,
+                     "jumpt",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_FALSE:
+            asprintf(&assembly, FORMAT_PAIR_CONST_NUM,
+                     "jumpf",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_EQUAL:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpeq",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_EQUAL:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpne",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_LESSTHAN:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumplt",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_LESSTHAN:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpnlt",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_EQUAL_INT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpeq.i",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_EQUAL_INT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpne.i",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_LESSTHAN_INT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumplt.i",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_LESSTHAN_INT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpnlt.i",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_EQUAL_FLOAT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpeq.f",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_EQUAL_FLOAT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpne.f",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_LESSTHAN_FLOAT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumplt.f",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_LESSTHAN_FLOAT:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpnlt.f",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_EQUAL_STRING:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpeq.s",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
+                    );
+            break;
+
+        case OP_JMP_NOT_EQUAL_STRING:
+            asprintf(&assembly, FORMAT_BRANCH,
+                     "jumpne.s",
+                     instruction.fields.branch.arg1,
+                     instruction.fields.branch.arg2,
+                     instruction.fields.branch.offset
                     );
             break;
 
@@ -227,32 +384,85 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                     );
             break;
 
-        // divide <register-out> <register-in> <register-in>
-        case OP_DIVIDE:
+        // add.i <register-out> <register-in> <register-in>
+        case OP_ADD_INT:
             asprintf(&assembly, FORMAT_TRIPLET,
-                     "divide",
+                     "add.i",
+                     instruction.fields.triplet.arg1,
+                     instruction.fields.triplet.arg2,
+                     instruction.fields.triplet.arg3
+                    );
+            break;
+
+        // add.f <register-out> <register-in> <register-in>
+        case OP_ADD_FLOAT:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "add.f",
+                     instruction.fields.triplet.arg1,
+                     instruction.fields.triplet.arg2,
+                     instruction.fields.triplet.arg3
+                    );
+            break;
+
+        // subtract.i <register-out> <register-in> <register-in>
+        case OP_SUBTRACT_INT:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "subtract.i",
                      instruction.fields.triplet.arg1,
                      instruction.fields.triplet.arg2,
                      instruction.fields.triplet.arg3
                     );
             break;
-        case OP_EQUAL:
-            asprintf(&assembly, FORMAT_TRIPLET_CMP,
-                     "eq",
+
+        // subtract.f <register-out> <register-in> <register-in>
+        case OP_SUBTRACT_FLOAT:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "subtract.f",
+                     instruction.fields.triplet.arg1,
+                     instruction.fields.triplet.arg2,
+                     instruction.fields.triplet.arg3
+                    );
+            break;
+
+        // multiply.i <register-out> <register-in> <register-in>
+        case OP_MULTIPLY_INT:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "multiply.i",
                      instruction.fields.triplet.arg1,
                      instruction.fields.triplet.arg2,
                      instruction.fields.triplet.arg3
                     );
             break;
-        case OP_LESSTHAN:
-            asprintf(&assembly, FORMAT_TRIPLET_CMP,
-                     "lt",
+
+        // multiply.f <register-out> <register-in> <register-in>
+        case OP_MULTIPLY_FLOAT:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "multiply.f",
+                     instruction.fields.triplet.arg1,
+                     instruction.fields.triplet.arg2,
+                     instruction.fields.triplet.arg3
+                    );
+            break;
+
+        // concat <register-out> <register-in> <register-in>
+        case OP_CONCAT:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "concat",
                      instruction.fields.triplet.arg1,
                      instruction.fields.triplet.arg2,
                      instruction.fields.triplet.arg3
                     );
             break;
 
+        // divide <register-out> <register-in> <register-in>
+        case OP_DIVIDE:
+            asprintf(&assembly, FORMAT_TRIPLET,
+                     "divide",
+                     instruction.fields.triplet.arg1,
+                     instruction.fields.triplet.arg2,
+                     instruction.fields.triplet.arg3
+                    );
+            break;
         case OP_AND:
             asprintf(&assembly, FORMAT_TRIPLET,
                      "and",
@@ -288,10 +498,23 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                     );
             break;
 
+        // -- Collections
+
+        // tuple <register-out> <register-in> <count>
+        case OP_TUPLE:
+            asprintf(&assembly, FORMAT_TRIPLET_VAL,
+                     "tuple",
+                     instruction.fields.triplet.arg1,
+                     instruction.fields.triplet.arg2,
+                     instruction.fields.triplet.arg3
+                    );
+            break;
+
         // -- Functions
         case OP_CALL:
-            asprintf(&assembly, FORMAT_SINGLE_ADDR,
+            asprintf(&assembly, FORMAT_PAIR_ADDR,
                      "call",
+                     instruction.fields.pair.arg1,
                      instruction.fields.pair.arg2
                     );
             break;
@@ -303,6 +526,23 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                     );
             break;
 
+        // Show the index of a builtin that doesn't exist instead of its name
+        case OP_CALL_BUILTIN:
+            if (instruction.fields.pair.arg2 >= builtin_count)
+            {
+                asprintf(&assembly, FORMAT_SINGLE_CONST,
+                         "callb",
+                         instruction.fields.pair.arg2
+                        );
+                break;
+            }
+
+            asprintf(&assembly, FORMAT_SINGLE_NAME,
+                     "callb",
+                     builtins[instruction.fields.pair.arg2].name
+                    );
+            break;
+
         case OP_RETURN:
             asprintf(&assembly, FORMAT_SINGLE,
                      "return",
@@ -316,6 +556,22 @@ char *disassemble_instruction(memory_t *mem, instruction_t instruction)
                      instruction.fields.pair.arg2
                      );
             break;
+
+        case OP_SETINBOUND:
+            asprintf(&assembly, FORMAT_PAIR_ADDR,
+                     "setinbound",
+                     instruction.fields.pair.arg1,
+                     instruction.fields.pair.arg2
+                     );
+            break;
+
+        case OP_GETOUTBOUND:
+            asprintf(&assembly, FORMAT_PAIR_ADDR,
+                     "getoutbound",
+                     instruction.fields.pair.arg1,
+                     instruction.fields.pair.arg2
+                     );
+            break;
     }
 
     if (assembly == NULL)
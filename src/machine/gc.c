@@ -0,0 +1,879 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc.h"
+#include "vm.h"
+
+// A generational collector. New strings, tuples and iterators are bump
+// allocated in a nursery. Most of them are temporaries, so a minor collection
+// copies out the few that are still reachable, promoting them to the old
+// generation, and then empties the nursery in one go.
+//
+// Every old object is on a single list, from which a major collection sweeps
+// anything that marking couldn't reach from the VMs. In incremental mode, a
+// major collection is spread over many safe points, marking or sweeping at
+// most GC_SLICE_SIZE objects at each one. Marking is tri-color: white objects
+// are unmarked, gray ones are marked and on the gray stack, and black ones are
+// marked and have had their children marked. The mutator keeps running while
+// we mark, so any value stored into an object or memory in the meantime goes
+// through gc_write_barrier, which grays it so that no black object can end up
+// pointing at a white one. Registers and the stack are written without a
+// barrier, so we scan them again before sweeping.
+
+typedef enum
+{
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING,
+} gc_phase_e;
+
+// A growable stack of objects
+typedef struct
+{
+    object_t **objects;
+    size_t count;
+    size_t capacity;
+} object_stack_t;
+
+bool gc_requested = false;
+bool gc_marking = false;
+
+#ifdef NORD_INCREMENTAL_GC
+static bool incremental = true;
+#else
+static bool incremental = false;
+#endif
+
+static gc_phase_e phase = GC_IDLE;
+
+static object_t *objects = NULL;
+static size_t threshold = GC_INITIAL_THRESHOLD;
+static gc_stats_t stats;
+
+static char *nursery = NULL;
+static char *nursery_top = NULL;
+static char *nursery_end = NULL;
+// Objects allocated in the nursery since it was last emptied
+static size_t young_count = 0;
+// Set when an allocation didn't fit in the nursery
+static bool nursery_full = false;
+
+// Old objects which may point into the nursery. We never write a young object
+// into an old one after creating it, so these are only the objects which
+// didn't fit in the nursery.
+static object_stack_t remembered;
+// Nursery objects which own a malloc'd buffer, which has to be freed if they
+// die
+static object_stack_t young_buffers;
+// Promoted objects, whose children may still need promoting
+static object_stack_t promoted;
+
+static struct vm_t **vms = NULL;
+static size_t num_vms = 0;
+static size_t vms_capacity = 0;
+
+// The VM new objects are charged to, and the limit new VMs start out with
+static struct vm_t *running = NULL;
+static size_t heap_limit = 0;
+// Set when some VM has gone over its heap limit
+static bool over_limit = false;
+
+// Objects we've marked, but whose children we haven't yet
+static object_stack_t gray;
+
+// The old generation as it was when sweeping started. Anything allocated
+// since goes on the regular list, and survives this collection.
+static object_t *unswept = NULL;
+// What this major collection has freed, and how many bytes survived it
+static size_t cycle_freed = 0;
+static size_t cycle_live = 0;
+
+static void object_stack_push(object_stack_t *stack, object_t *object)
+{
+    if (stack->count >= stack->capacity)
+    {
+        stack->capacity = (stack->capacity == 0) ? 64 : stack->capacity * 2;
+        stack->objects = realloc(stack->objects, stack->capacity * sizeof(object_t *));
+    }
+
+    stack->objects[stack->count++] = object;
+}
+
+static object_t *object_stack_pop(object_stack_t *stack)
+{
+    return stack->objects[--stack->count];
+}
+
+//-- Accounting
+
+static gc_kind_e kind_of(value_type_e type)
+{
+    switch (type)
+    {
+        case VAL_TUPLE:
+            return GC_KIND_TUPLE;
+        case VAL_ITERATOR:
+            return GC_KIND_ITERATOR;
+        case VAL_FUNCTION:
+            return GC_KIND_FUNCTION;
+        case VAL_MODULE:
+            return GC_KIND_MODULE;
+        default:
+            return GC_KIND_STRING;
+    }
+}
+
+static gc_heap_t *heap_of(object_t *object)
+{
+    return (object->owner == 0) ? NULL : &vms[object->owner - 1]->heap;
+}
+
+static void heap_charge(object_t *object, size_t objects, size_t bytes, bool young)
+{
+    gc_heap_t *heap = heap_of(object);
+
+    if (heap == NULL)
+        return;
+
+    gc_kind_e kind = kind_of(object->type);
+
+    heap->objects[kind] += objects;
+    heap->bytes[kind] += bytes;
+    if (young)
+    {
+        heap->young_objects[kind] += objects;
+        heap->young[kind] += bytes;
+    }
+    heap->total += bytes;
+
+    if (heap->limit > 0 && heap->total > heap->limit && !heap->exceeded)
+    {
+        over_limit = true;
+        gc_requested = true;
+    }
+}
+
+static void heap_refund(object_t *object, size_t bytes)
+{
+    gc_heap_t *heap = heap_of(object);
+
+    if (heap == NULL)
+        return;
+
+    heap->objects[kind_of(object->type)]--;
+    heap->bytes[kind_of(object->type)] -= bytes;
+    heap->total -= bytes;
+}
+
+// Charge an old object for some objects and bytes
+static void account(object_t *object, size_t objects, size_t bytes)
+{
+    stats.bytes_allocated += bytes;
+    heap_charge(object, objects, bytes, false);
+
+    if (stats.bytes_allocated >= threshold)
+        gc_requested = true;
+}
+
+static uint16_t running_id(void)
+{
+    return (running == NULL) ? 0 : running->heap.id;
+}
+
+//-- Allocation
+
+static object_t *allocate_old(size_t size, value_type_e type, uint16_t owner)
+{
+    object_t *object = malloc(size);
+
+    object->type = type;
+    // Objects allocated while marking are black, since nothing they point to
+    // yet can be white. Anything stored into them later goes through the
+    // write barrier.
+    object->marked = (phase == GC_MARKING);
+    object->owner = owner;
+    object->next = objects;
+    objects = object;
+
+    account(object, 1, size);
+
+    return object;
+}
+
+object_t *gc_allocate(size_t size, value_type_e type)
+{
+    return allocate_old(size, type, running_id());
+}
+
+object_t *gc_allocate_young(size_t size, size_t extra, value_type_e type, void **storage)
+{
+    if (nursery == NULL)
+    {
+        nursery = malloc(GC_NURSERY_SIZE);
+        nursery_top = nursery;
+        nursery_end = nursery + GC_NURSERY_SIZE;
+    }
+
+    // Keep everything in the nursery 8-byte aligned
+    size_t total = (size + extra + 7) & ~(size_t)7;
+
+    if (total <= (size_t)(nursery_end - nursery_top))
+    {
+        object_t *object = (object_t *)nursery_top;
+        nursery_top += total;
+        young_count++;
+
+        object->type = type;
+        object->marked = false;
+        object->owner = running_id();
+        object->next = NULL;
+        heap_charge(object, 1, total, true);
+
+        *storage = (char *)object + size;
+        return object;
+    }
+
+    // Time for a minor collection, but we can't move anything until we're at
+    // a safe point
+    nursery_full = true;
+    gc_requested = true;
+
+    object_t *object = gc_allocate(size + extra, type);
+    *storage = (char *)object + size;
+
+    if (type == VAL_STRING || type == VAL_TUPLE || type == VAL_ITERATOR)
+        object_stack_push(&remembered, object);
+
+    return object;
+}
+
+static bool in_nursery(void *pointer)
+{
+    return (char *)pointer >= nursery && (char *)pointer < nursery_end;
+}
+
+bool gc_is_young(object_t *object)
+{
+    return in_nursery(object);
+}
+
+void gc_account(object_t *object, size_t bytes)
+{
+    account(object, 0, bytes);
+}
+
+void gc_adopt_buffer(object_t *object, size_t size)
+{
+    if (gc_is_young(object))
+    {
+        object_stack_push(&young_buffers, object);
+        heap_charge(object, 0, size, true);
+    }
+    else
+    {
+        gc_account(object, size);
+    }
+}
+
+void gc_register_vm(struct vm_t *vm)
+{
+    if (num_vms >= vms_capacity)
+    {
+        vms_capacity = (vms_capacity == 0) ? 4 : vms_capacity * 2;
+        vms = realloc(vms, vms_capacity * sizeof(struct vm_t *));
+    }
+
+    vms[num_vms++] = vm;
+
+    memset(&vm->heap, 0, sizeof(gc_heap_t));
+    vm->heap.id = (num_vms <= UINT16_MAX) ? num_vms : 0;
+    vm->heap.limit = heap_limit;
+
+    // Whatever is already in the new VM's memory was never seen by the write
+    // barrier
+    if (gc_marking)
+    {
+        for (size_t i = 0; i < vm->memory->num_pages; i++)
+        {
+            for (size_t j = 0; j < MEMORY_PAGE_SIZE; j++)
+                gc_shade(vm->memory->pages[i][j]);
+        }
+    }
+}
+
+struct vm_t *gc_set_running(struct vm_t *vm)
+{
+    struct vm_t *previous = running;
+    running = vm;
+    return previous;
+}
+
+void gc_set_heap_limit(size_t limit)
+{
+    heap_limit = limit;
+}
+
+void gc_set_incremental(bool enabled)
+{
+    incremental = enabled;
+}
+
+gc_stats_t gc_stats(void)
+{
+    return stats;
+}
+
+static size_t object_size(object_t *object)
+{
+    switch (object->type)
+    {
+        case VAL_STRING:
+            // A rope doesn't have characters of its own until it's flattened
+            if (((string_t *)object)->string == NULL)
+                return sizeof(string_t);
+            return sizeof(string_t) + ((string_t *)object)->length + 1;
+        case VAL_TUPLE:
+            return sizeof(tuple_t) + ((tuple_t *)object)->length * sizeof(value_t);
+        case VAL_ITERATOR:
+            return sizeof(iterator_t);
+        case VAL_FUNCTION:
+            return sizeof(function_t) + strlen(((function_t *)object)->name) + 1;
+        case VAL_MODULE:
+            return sizeof(module_t) + strlen(((module_t *)object)->name) + 1;
+        default:
+            return 0;
+    }
+}
+
+// Returns whether an object's storage was allocated along with it
+static bool is_inline(object_t *object, size_t size, void *storage)
+{
+    return storage == (char *)object + size;
+}
+
+static void object_free(object_t *object)
+{
+    switch (object->type)
+    {
+        case VAL_STRING:
+            if (((string_t *)object)->interned)
+                string_forget_interned((string_t *)object);
+            if (!is_inline(object, sizeof(string_t), ((string_t *)object)->string))
+                free(((string_t *)object)->string);
+            break;
+        case VAL_FUNCTION:
+            free(((function_t *)object)->name);
+            break;
+        case VAL_MODULE:
+            free(((module_t *)object)->name);
+            break;
+        default:
+            ;
+    }
+
+    free(object);
+}
+
+//-- Marking
+
+static void mark_object(object_t *object)
+{
+    // Young objects are found by promoting them instead, and their marked
+    // flag means they have been forwarded
+    if (object == NULL || object->marked || gc_is_young(object))
+        return;
+
+    object->marked = true;
+    object_stack_push(&gray, object);
+}
+
+static void mark_value(value_t value)
+{
+    switch (value_type_of(value))
+    {
+        case VAL_STRING:
+        case VAL_TUPLE:
+        case VAL_ITERATOR:
+        case VAL_FUNCTION:
+        case VAL_MODULE:
+            mark_object(value_as_object(value));
+            break;
+        default:
+            ;
+    }
+}
+
+static void mark_values(value_t *values, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        mark_value(values[i]);
+}
+
+static void mark_children(object_t *object)
+{
+    switch (object->type)
+    {
+        case VAL_STRING:
+            mark_object((object_t *)((string_t *)object)->left);
+            mark_object((object_t *)((string_t *)object)->right);
+            break;
+        case VAL_TUPLE:
+            mark_values(((tuple_t *)object)->values, ((tuple_t *)object)->length);
+            break;
+        case VAL_ITERATOR:
+            mark_value(((iterator_t *)object)->iterable);
+            break;
+        default:
+            ;
+    }
+}
+
+void gc_shade(value_t value)
+{
+    mark_value(value);
+}
+
+void gc_revive(object_t *object)
+{
+    // Marking it means the sweep will keep it. If it has already been swept,
+    // it just stays marked until the next collection, which keeps it alive
+    // one collection longer than it would otherwise be. That's only safe
+    // because nothing revived has children.
+    if (phase == GC_SWEEPING)
+        object->marked = true;
+}
+
+// Mark the first count values in memory
+static void mark_memory(memory_t *memory, size_t count)
+{
+    for (size_t i = 0; i < memory->num_pages && i * MEMORY_PAGE_SIZE < count; i++)
+    {
+        size_t left = count - i * MEMORY_PAGE_SIZE;
+        mark_values(memory->pages[i], (left < MEMORY_PAGE_SIZE) ? left : MEMORY_PAGE_SIZE);
+    }
+}
+
+// The roots that are written without a barrier
+static void mark_vm_registers(struct vm_t *vm)
+{
+    mark_values(vm->stack, vm->sp);
+    mark_memory(vm->inbound, vm->size_inbound);
+    mark_memory(vm->outbound, vm->size_outbound);
+
+    // Everything above the current window is left over from earlier calls
+    mark_values(vm->register_file, vm->base + VM_NUM_REGISTERS);
+
+    for (int i = 0; i < vm->fp; i++)
+        mark_object((object_t *)vm->frames[i].function);
+}
+
+static void mark_vm(struct vm_t *vm)
+{
+    mark_memory(vm->memory, vm->memory->capacity);
+    mark_vm_registers(vm);
+}
+
+//-- Promotion
+
+static object_t *promote(object_t *young)
+{
+    // A promoted object leaves a forwarding pointer behind
+    if (young->marked)
+        return young->next;
+
+    object_t *old;
+
+    switch (young->type)
+    {
+        case VAL_STRING:
+        {
+            string_t *source = (string_t *)young;
+            string_t *string;
+
+            // Characters come along in the same allocation, unless they're a
+            // flattened rope's buffer, which we can just take
+            if (in_nursery(source->string))
+            {
+                string = (string_t *)allocate_old(sizeof(string_t) + source->length + 1, VAL_STRING, young->owner);
+                string->string = (char *)(string + 1);
+                memcpy(string->string, source->string, source->length + 1);
+            }
+            else
+            {
+                string = (string_t *)allocate_old(sizeof(string_t), VAL_STRING, young->owner);
+                string->string = source->string;
+                if (string->string != NULL)
+                    gc_account((object_t *)string, source->length + 1);
+            }
+
+            string->length = source->length;
+            string->interned = false;
+            string->hash = 0;
+            string->left = source->left;
+            // If it's still a rope, its halves are forwarded below
+            string->right = source->right;
+
+            old = (object_t *)string;
+            break;
+        }
+        case VAL_TUPLE:
+        {
+            size_t length = ((tuple_t *)young)->length;
+            tuple_t *tuple = (tuple_t *)allocate_old(sizeof(tuple_t) + sizeof(value_t) * length, VAL_TUPLE, young->owner);
+            tuple->length = length;
+            memcpy(tuple->values, ((tuple_t *)young)->values, sizeof(value_t) * length);
+            old = (object_t *)tuple;
+            break;
+        }
+        case VAL_ITERATOR:
+        {
+            iterator_t *iterator = (iterator_t *)allocate_old(sizeof(iterator_t), VAL_ITERATOR, young->owner);
+            iterator->index = ((iterator_t *)young)->index;
+            iterator->length = ((iterator_t *)young)->length;
+            iterator->iterable = ((iterator_t *)young)->iterable;
+            old = (object_t *)iterator;
+            break;
+        }
+        default:
+            // Nothing else is allocated in the nursery
+            assert(false);
+            return young;
+    }
+
+    young->marked = true;
+    young->next = old;
+    stats.objects_promoted++;
+
+    // Its children may still be young
+    object_stack_push(&promoted, old);
+
+    // While marking, promoted objects are allocated black, but their children
+    // haven't been marked yet
+    if (phase == GC_MARKING)
+        object_stack_push(&gray, old);
+
+    return old;
+}
+
+static void forward_value(value_t *value)
+{
+    switch (value_type_of(*value))
+    {
+        case VAL_STRING:
+        case VAL_TUPLE:
+        case VAL_ITERATOR:
+            if (gc_is_young(value_as_object(*value)))
+                *value = value_from_object(value_type_of(*value), promote(value_as_object(*value)));
+            break;
+        default:
+            ;
+    }
+}
+
+static void forward_values(value_t *values, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        forward_value(&values[i]);
+}
+
+static void forward_string(string_t **string)
+{
+    if (*string != NULL && gc_is_young((object_t *)*string))
+        *string = (string_t *)promote((object_t *)*string);
+}
+
+static void forward_children(object_t *object)
+{
+    switch (object->type)
+    {
+        case VAL_STRING:
+            forward_string(&((string_t *)object)->left);
+            forward_string(&((string_t *)object)->right);
+            break;
+        case VAL_TUPLE:
+            forward_values(((tuple_t *)object)->values, ((tuple_t *)object)->length);
+            break;
+        case VAL_ITERATOR:
+            forward_value(&((iterator_t *)object)->iterable);
+            break;
+        default:
+            ;
+    }
+}
+
+static void forward_memory(memory_t *memory, size_t count)
+{
+    for (size_t i = 0; i < memory->num_pages && i * MEMORY_PAGE_SIZE < count; i++)
+    {
+        size_t left = count - i * MEMORY_PAGE_SIZE;
+        forward_values(memory->pages[i], (left < MEMORY_PAGE_SIZE) ? left : MEMORY_PAGE_SIZE);
+    }
+}
+
+static void forward_vm(struct vm_t *vm)
+{
+    forward_memory(vm->memory, vm->memory->capacity);
+    forward_values(vm->stack, vm->sp);
+    forward_memory(vm->inbound, vm->size_inbound);
+    forward_memory(vm->outbound, vm->size_outbound);
+    forward_values(vm->register_file, vm->base + VM_NUM_REGISTERS);
+
+    // Functions are never allocated in the nursery, since translated code
+    // points straight at them
+}
+
+//-- Collection
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record_pause(uint64_t start)
+{
+    uint64_t pause = now() - start;
+
+    stats.pauses++;
+    stats.pause_total_ns += pause;
+    if (pause > stats.pause_max_ns)
+        stats.pause_max_ns = pause;
+}
+
+static size_t collect_young(void)
+{
+    size_t promoted_before = stats.objects_promoted;
+
+    // The whole nursery is about to go. Whatever survives is charged again as
+    // it's promoted.
+    for (size_t i = 0; i < num_vms; i++)
+    {
+        gc_heap_t *heap = &vms[i]->heap;
+
+        for (int kind = 0; kind < GC_NUM_KINDS; kind++)
+        {
+            heap->objects[kind] -= heap->young_objects[kind];
+            heap->bytes[kind] -= heap->young[kind];
+            heap->total -= heap->young[kind];
+            heap->young_objects[kind] = 0;
+            heap->young[kind] = 0;
+        }
+    }
+
+    for (size_t i = 0; i < num_vms; i++)
+        forward_vm(vms[i]);
+
+    while (remembered.count > 0)
+        forward_children(object_stack_pop(&remembered));
+
+    while (promoted.count > 0)
+        forward_children(object_stack_pop(&promoted));
+
+    size_t freed = young_count - (stats.objects_promoted - promoted_before);
+
+    // Promoted objects took their buffers with them
+    while (young_buffers.count > 0)
+    {
+        object_t *object = object_stack_pop(&young_buffers);
+
+        if (!object->marked)
+            free(((string_t *)object)->string);
+    }
+
+    nursery_top = nursery;
+    young_count = 0;
+    nursery_full = false;
+
+    stats.minor_collections++;
+    stats.objects_freed += freed;
+
+    return freed;
+}
+
+static void begin_marking(void)
+{
+    phase = GC_MARKING;
+    gc_marking = true;
+    cycle_freed = 0;
+    cycle_live = 0;
+
+    for (size_t i = 0; i < num_vms; i++)
+        mark_vm(vms[i]);
+}
+
+// Mark the children of up to budget gray objects, returning whether there are
+// none left
+static bool mark_some(size_t budget)
+{
+    while (gray.count > 0 && budget-- > 0)
+        mark_children(object_stack_pop(&gray));
+
+    return gray.count == 0;
+}
+
+static void finish_marking(void)
+{
+    // Nursery objects aren't marked, and may be all that points to some old
+    // objects, so promote the live ones. Then go over the roots the barrier
+    // doesn't cover.
+    cycle_freed += collect_young();
+
+    for (size_t i = 0; i < num_vms; i++)
+        mark_vm_registers(vms[i]);
+
+    mark_some(SIZE_MAX);
+
+    phase = GC_SWEEPING;
+    gc_marking = false;
+
+    unswept = objects;
+    objects = NULL;
+}
+
+// Sweep up to budget objects, returning whether there are none left
+static bool sweep_some(size_t budget)
+{
+    while (unswept != NULL && budget-- > 0)
+    {
+        object_t *object = unswept;
+        unswept = object->next;
+
+        if (object->marked)
+        {
+            object->marked = false;
+            object->next = objects;
+            objects = object;
+            cycle_live += object_size(object);
+            continue;
+        }
+
+        size_t size = object_size(object);
+        stats.bytes_allocated -= size;
+        heap_refund(object, size);
+        object_free(object);
+        cycle_freed++;
+    }
+
+    return unswept == NULL;
+}
+
+static void finish_sweeping(void)
+{
+    phase = GC_IDLE;
+
+    stats.bytes_live = cycle_live;
+    stats.collections++;
+    stats.objects_freed += cycle_freed;
+
+    threshold = stats.bytes_live * GC_GROWTH_FACTOR;
+    if (threshold < GC_INITIAL_THRESHOLD)
+        threshold = GC_INITIAL_THRESHOLD;
+}
+
+// Finish the current major collection, or do a whole one, all at once
+static size_t collect(void)
+{
+    if (phase == GC_IDLE)
+        begin_marking();
+
+    if (phase == GC_MARKING)
+        finish_marking();
+
+    sweep_some(SIZE_MAX);
+    finish_sweeping();
+
+    return cycle_freed;
+}
+
+static void update_requested(void)
+{
+    gc_requested = nursery_full || over_limit || phase != GC_IDLE || stats.bytes_allocated >= threshold;
+}
+
+size_t gc_collect_young(void)
+{
+    uint64_t start = now();
+    size_t freed = collect_young();
+
+    update_requested();
+    record_pause(start);
+
+    return freed;
+}
+
+size_t gc_collect(void)
+{
+    uint64_t start = now();
+    size_t freed = collect();
+
+    update_requested();
+    record_pause(start);
+
+    return freed;
+}
+
+// Some VM has gone over its limit, so see what a full collection leaves it
+// with. Anything still over is stopped.
+static void enforce_limits(void)
+{
+    collect_young();
+    collect();
+
+    for (size_t i = 0; i < num_vms; i++)
+    {
+        gc_heap_t *heap = &vms[i]->heap;
+
+        if (heap->limit > 0 && heap->total > heap->limit)
+            heap->exceeded = true;
+    }
+
+    over_limit = false;
+}
+
+void gc_poll(void)
+{
+    uint64_t start = now();
+
+    if (over_limit)
+        enforce_limits();
+
+    if (nursery_full)
+        collect_young();
+
+    if (!incremental)
+    {
+        if (stats.bytes_allocated >= threshold)
+            collect();
+    }
+    else
+    {
+        switch (phase)
+        {
+            case GC_IDLE:
+                if (stats.bytes_allocated >= threshold)
+                    begin_marking();
+                break;
+            case GC_MARKING:
+                if (mark_some(GC_SLICE_SIZE))
+                    finish_marking();
+                break;
+            case GC_SWEEPING:
+                if (sweep_some(GC_SLICE_SIZE))
+                    finish_sweeping();
+                break;
+        }
+    }
+
+    update_requested();
+    record_pause(start);
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef GC_H
+#define GC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+struct vm_t;
+
+// Collect once this many bytes of objects are allocated, to start with
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+// After a collection, collect again once the heap has grown by this factor
+#define GC_GROWTH_FACTOR 2
+// Size of the nursery, where short-lived objects are allocated
+#define GC_NURSERY_SIZE (256 * 1024)
+// In incremental mode, the most objects we mark or sweep at one safe point
+#define GC_SLICE_SIZE 512
+
+// Kinds of object, for accounting
+typedef enum
+{
+    GC_KIND_STRING,
+    GC_KIND_TUPLE,
+    GC_KIND_ITERATOR,
+    GC_KIND_FUNCTION,
+    GC_KIND_MODULE,
+    GC_NUM_KINDS,
+} gc_kind_e;
+
+// What one VM has allocated and not yet freed. Every object is charged to the
+// VM that was running when it was allocated, or to nobody if none was.
+typedef struct
+{
+    // Which VM this is, as objects record it. 0 means we aren't keeping track.
+    uint16_t id;
+    // Objects and bytes by kind, including what's in the nursery
+    size_t objects[GC_NUM_KINDS];
+    size_t bytes[GC_NUM_KINDS];
+    // How much of the above is in the nursery, which is emptied all at once
+    size_t young_objects[GC_NUM_KINDS];
+    size_t young[GC_NUM_KINDS];
+    size_t total;
+    // If total is still over this after a full collection, the VM stops with
+    // an error. 0 means there's no limit.
+    size_t limit;
+    bool exceeded;
+} gc_heap_t;
+
+typedef struct
+{
+    size_t collections;
+    size_t minor_collections;
+    size_t objects_freed;
+    // Nursery objects that survived a minor collection
+    size_t objects_promoted;
+    // Bytes of objects currently allocated, live or not
+    size_t bytes_allocated;
+    // Bytes of objects that survived the last collection
+    size_t bytes_live;
+    // Every time the VM stopped to collect, and for how long
+    size_t pauses;
+    uint64_t pause_total_ns;
+    uint64_t pause_max_ns;
+} gc_stats_t;
+
+// Set once enough has been allocated that the VM should collect at its next
+// safe point
+extern bool gc_requested;
+
+// Set while an incremental collection is marking
+extern bool gc_marking;
+
+// Allocate a new object of the given type, and track it for collection
+object_t *gc_allocate(size_t size, value_type_e type);
+
+// Allocate a new object in the nursery, along with extra bytes of storage it
+// owns (like a string's characters), which are returned in *storage. Nursery
+// objects move when they are promoted, so they may only be referenced from
+// roots and other objects. If the nursery is full, this falls back to
+// gc_allocate, with the storage still in the same allocation.
+object_t *gc_allocate_young(size_t size, size_t extra, value_type_e type, void **storage);
+
+// Note memory an object owns beyond its own struct, like a string's characters
+void gc_account(object_t *object, size_t bytes);
+
+// An object has taken ownership of a malloc'd buffer since it was allocated,
+// like a rope that has been flattened. If the object is young, the buffer is
+// freed along with it, or handed over when it's promoted.
+void gc_adopt_buffer(object_t *object, size_t size);
+
+// Returns whether an object is in the nursery
+bool gc_is_young(object_t *object);
+
+// Mark a value gray, if it is a white object
+void gc_shade(value_t value);
+
+// An object found through a weak reference, like the intern table, may be
+// garbage that hasn't been swept yet. Call this before handing it out again.
+void gc_revive(object_t *object);
+
+// Call when storing a value into an object or memory, so that an incremental
+// collection doesn't miss it
+static inline void gc_write_barrier(value_t value)
+{
+    if (gc_marking)
+        gc_shade(value);
+}
+
+// Every VM's registers, stack, memory and frames are roots
+void gc_register_vm(struct vm_t *vm);
+
+// Charge whatever is allocated from now on to vm, returning the VM that was
+// being charged before
+struct vm_t *gc_set_running(struct vm_t *vm);
+
+// The heap limit given to VMs when they're registered
+void gc_set_heap_limit(size_t limit);
+
+// Free every object that isn't reachable from a root, returning how many were
+// freed. Only call this where every object still in use is in a root.
+size_t gc_collect(void);
+
+// Promote the nursery objects that are reachable from a root and empty the
+// nursery, returning how many objects were left behind. Same rules as above.
+size_t gc_collect_young(void);
+
+// Do whichever collection was requested. In incremental mode, this only does
+// a slice of a major collection at a time.
+void gc_poll(void);
+
+// Spread major collections out over many safe points, instead of stopping the
+// world for each one. Builds with GC=incremental start out this way.
+void gc_set_incremental(bool enabled);
+
+gc_stats_t gc_stats(void);
+
+#endif
@@ -1,11 +1,51 @@
+#include <sys/mman.h>
+
 #include "memory.h"
+#include "gc.h"
+
+static void memory_add_page(memory_t *mem, value_t *page)
+{
+    if (mem->num_pages >= mem->pages_capacity)
+    {
+        mem->pages_capacity = (mem->pages_capacity == 0) ? 4 : mem->pages_capacity * 2;
+        mem->pages = realloc(mem->pages, mem->pages_capacity * sizeof(value_t *));
+    }
+
+    mem->pages[mem->num_pages++] = page;
+    mem->capacity += MEMORY_PAGE_SIZE;
+}
+
+// Add pages until address fits. Fresh pages are zeroed, which is VAL_ABSENT.
+static void memory_grow(memory_t *mem, size_t address)
+{
+    while (address >= mem->capacity)
+        memory_add_page(mem, calloc(MEMORY_PAGE_SIZE, sizeof(value_t)));
+}
 
 memory_t *memory_create(size_t size)
 {
-    memory_t *mem = malloc(sizeof(memory_t));
+    memory_t *mem = calloc(1, sizeof(memory_t));
+    size_t num_pages = (size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+    size_t page_bytes = MEMORY_PAGE_SIZE * sizeof(value_t);
 
-    mem->capacity = size;
-    mem->contents = calloc(mem->capacity, sizeof(value_t));
+    if (num_pages * page_bytes >= MEMORY_MMAP_THRESHOLD)
+    {
+        void *mapping = mmap(NULL, num_pages * page_bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        // If we can't map it, just fall back to malloc
+        if (mapping != MAP_FAILED)
+        {
+            mem->mapping = mapping;
+            mem->mapped_pages = num_pages;
+
+            for (size_t i = 0; i < num_pages; i++)
+                memory_add_page(mem, (value_t *)((char *)mapping + i * page_bytes));
+        }
+    }
+
+    if (size > 0)
+        memory_grow(mem, size - 1);
 
     return mem;
 }
@@ -13,33 +53,34 @@ memory_t *memory_create(size_t size)
 void memory_free(memory_t *mem)
 {
     // TODO: Free values
+    for (size_t i = mem->mapped_pages; i < mem->num_pages; i++)
+        free(mem->pages[i]);
+
+    if (mem->mapping != NULL)
+        munmap(mem->mapping, mem->mapped_pages * MEMORY_PAGE_SIZE * sizeof(value_t));
+
+    free(mem->pages);
     free(mem);
 }
 
-void memory_set(memory_t *mem, int address, value_t val)
+value_t *memory_slot(memory_t *mem, int address)
 {
-    if (mem->capacity - 1 < address)
-    {
-        int old = mem->capacity;
-        mem->capacity = (address > old * 2) ? address * 2 : old * 2;
-        mem->contents = realloc(mem->contents, mem->capacity * sizeof(value_t));
+    if ((size_t)address >= mem->capacity)
+        memory_grow(mem, address);
 
-        // Ensure that we zero out our new memory
-        for (int i = old; i < mem->capacity; i++)
-        {
-            mem->contents[i].type = VAL_ABSENT;
-        }
-    }
+    return &mem->pages[address / MEMORY_PAGE_SIZE][address % MEMORY_PAGE_SIZE];
+}
 
-    mem->contents[address] = val;
+void memory_set(memory_t *mem, int address, value_t val)
+{
+    gc_write_barrier(val);
+    *memory_slot(mem, address) = val;
 }
 
 value_t memory_get(memory_t *mem, int address)
 {
-    value_t none = {VAL_ABSENT};
-    if (address > mem->capacity)
-        return none;
+    if (address < 0 || (size_t)address >= mem->capacity)
+        return value_from_type(VAL_ABSENT);
 
-    // TODO: Error checking
-    return mem->contents[address];
+    return mem->pages[address / MEMORY_PAGE_SIZE][address % MEMORY_PAGE_SIZE];
 }
@@ -12,10 +12,26 @@
 
 #include "value.h"
 
+// Number of values in a page of memory
+#define MEMORY_PAGE_SIZE 512
+// Memories created at least this big, in bytes, get their first pages from a
+// single anonymous mapping instead of from malloc
+#define MEMORY_MMAP_THRESHOLD (1024 * 1024)
+
+// Memory is a table of fixed-size pages. It grows by adding pages, and never
+// moves the ones it already has, so the address of a value in memory stays
+// good for as long as the memory does.
 typedef struct
 {
+    // Number of addressable values, always a whole number of pages
     size_t capacity;
-    value_t *contents;
+    value_t **pages;
+    size_t num_pages;
+    size_t pages_capacity;
+
+    // Backs the first mapped_pages pages, if the memory was created big
+    void *mapping;
+    size_t mapped_pages;
 } memory_t;
 
 memory_t *memory_create(size_t size);
@@ -23,4 +39,7 @@ void memory_free(memory_t *);
 void memory_set(memory_t *, int address, value_t val);
 value_t memory_get(memory_t *, int address);
 
+// Returns where the value at address is kept, growing memory to include it
+value_t *memory_slot(memory_t *, int address);
+
 #endif
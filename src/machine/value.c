@@ -8,11 +8,25 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "gc.h"
 #include "value.h"
+#include "util/hash.h"
+
+// The intern table is a set of strings, found by hash with linear probing. It
+// doesn't keep anything alive; the collector tells us when a string in it is
+// freed, and we leave a tombstone in its place.
+#define INTERN_TOMBSTONE ((string_t *)1)
+
+static string_t **interned = NULL;
+static size_t interned_capacity = 0;
+// Live strings plus tombstones, since both make probing longer
+static size_t interned_used = 0;
 
 bool is_collection(value_t value)
 {
-    return value.type == VAL_STRING || value.type == VAL_TUPLE;
+    value_type_e type = value_type_of(value);
+
+    return type == VAL_STRING || type == VAL_TUPLE || type == VAL_RANGE;
 }
 
 value_t iterator_create(value_t collection)
@@ -20,96 +34,267 @@ value_t iterator_create(value_t collection)
     // TODO: Handle errors
     assert(is_collection(collection));
 
-    value_t val;
-    iterator_t *iter = (iterator_t *)malloc(sizeof(iterator_t));
+    void *unused;
+    iterator_t *iter = (iterator_t *)gc_allocate_young(sizeof(iterator_t), 0, VAL_ITERATOR, &unused);
 
-    iter->object.type = VAL_ITERATOR;
+    gc_write_barrier(collection);
     iter->iterable = collection;
     iter->index = 0;
 
-    switch (collection.type)
+    switch (value_type_of(collection))
     {
         case VAL_STRING:
-            iter->length = ((string_t *)collection.contents.object)->length;
+            iter->length = ((string_t *)value_as_object(collection))->length;
             break;
 
         case VAL_TUPLE:
-            iter->length = ((tuple_t *)collection.contents.object)->length;
+            iter->length = ((tuple_t *)value_as_object(collection))->length;
+            break;
+
+        case VAL_RANGE:
+            iter->length = range_length(collection);
             break;
 
         default:
             ;
     }
 
-    val.type = VAL_ITERATOR;
-    val.contents.object = (object_t *)iter;
+    return value_from_object(VAL_ITERATOR, (object_t *)iter);
+}
+
+// Allocate a string with room for length characters, which the caller fills in
+static string_t *string_allocate(size_t length)
+{
+    void *characters;
+    string_t *str = (string_t *)gc_allocate_young(sizeof(string_t), length + 1, VAL_STRING, &characters);
 
-    return val;
+    str->length = length;
+    str->interned = false;
+    str->hash = 0;
+    str->string = characters;
+    str->string[length] = '\0';
+    str->left = NULL;
+    str->right = NULL;
+
+    return str;
 }
 
 value_t string_create(char *string)
 {
-    value_t val;
-    string_t *str = (string_t *)malloc(sizeof(string_t));
+    return string_create_length(string, strlen(string));
+}
+
+value_t string_create_length(const char *string, size_t length)
+{
+    string_t *str = string_allocate(length);
+
+    memcpy(str->string, string, length);
+
+    return value_from_object(VAL_STRING, (object_t *)str);
+}
+
+value_t string_concat(value_t a, value_t b)
+{
+    string_t *left = (string_t *)value_as_object(a);
+    string_t *right = (string_t *)value_as_object(b);
+    size_t length = left->length + right->length;
+
+    // Strings never change, so there's no need for a new one
+    if (left->length == 0)
+        return b;
+    if (right->length == 0)
+        return a;
+
+    if (length < STRING_ROPE_MIN_LENGTH)
+    {
+        string_t *str = string_allocate(length);
+
+        memcpy(str->string, string_chars(left), left->length);
+        memcpy(str->string + left->length, string_chars(right), right->length);
+
+        return value_from_object(VAL_STRING, (object_t *)str);
+    }
+
+    void *unused;
+    string_t *rope = (string_t *)gc_allocate_young(sizeof(string_t), 0, VAL_STRING, &unused);
+
+    rope->length = length;
+    rope->interned = false;
+    rope->hash = 0;
+    rope->string = NULL;
+
+    gc_write_barrier(a);
+    gc_write_barrier(b);
+    rope->left = left;
+    rope->right = right;
+
+    return value_from_object(VAL_STRING, (object_t *)rope);
+}
+
+void string_flatten(string_t *rope)
+{
+    char *buffer = malloc(rope->length + 1);
+    size_t position = 0;
+
+    // Appending in a loop builds ropes that lean far to the left, so walk the
+    // leaves with a stack of right halves instead of recursing
+    string_t **pending = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    string_t *node = rope;
 
-    str->object.type = VAL_STRING;
-    str->length = strlen(string);
+    for (;;)
+    {
+        while (node->string == NULL)
+        {
+            if (count >= capacity)
+            {
+                capacity = (capacity == 0) ? 64 : capacity * 2;
+                pending = realloc(pending, capacity * sizeof(string_t *));
+            }
 
-    char *our_string = (char *)malloc(str->length + 1);
-    strcpy(our_string, string);
-    str->string = our_string;
+            pending[count++] = node->right;
+            node = node->left;
+        }
 
-    val.type = VAL_STRING;
-    val.contents.object = (object_t *)str;
+        memcpy(buffer + position, node->string, node->length);
+        position += node->length;
+
+        if (count == 0)
+            break;
 
-    return val;
+        node = pending[--count];
+    }
+
+    free(pending);
+    buffer[rope->length] = '\0';
+
+    // The halves are garbage now, unless something else points at them
+    rope->string = buffer;
+    rope->left = NULL;
+    rope->right = NULL;
+    gc_adopt_buffer((object_t *)rope, rope->length + 1);
+}
+
+static void intern_insert(string_t *string)
+{
+    size_t index = string->hash & (interned_capacity - 1);
+
+    while (interned[index] != NULL && interned[index] != INTERN_TOMBSTONE)
+        index = (index + 1) & (interned_capacity - 1);
+
+    if (interned[index] == NULL)
+        interned_used++;
+
+    interned[index] = string;
+}
+
+static void intern_grow(void)
+{
+    string_t **old = interned;
+    size_t old_capacity = interned_capacity;
+
+    // Tombstones are dropped as we go, so this may not actually grow
+    interned_capacity = (old_capacity == 0) ? 64 : old_capacity * 2;
+    interned = calloc(interned_capacity, sizeof(string_t *));
+    interned_used = 0;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i] != NULL && old[i] != INTERN_TOMBSTONE)
+            intern_insert(old[i]);
+    }
+
+    free(old);
+}
+
+value_t string_intern(const char *string)
+{
+    size_t length = strlen(string);
+    uint64_t hash = pjw_hash(string);
+
+    // Keep the table at most half full
+    if ((interned_used + 1) * 2 > interned_capacity)
+        intern_grow();
+
+    size_t index = hash & (interned_capacity - 1);
+
+    while (interned[index] != NULL)
+    {
+        string_t *candidate = interned[index];
+
+        if (candidate != INTERN_TOMBSTONE && candidate->hash == hash &&
+            candidate->length == length && !memcmp(candidate->string, string, length))
+        {
+            gc_revive((object_t *)candidate);
+            return value_from_object(VAL_STRING, (object_t *)candidate);
+        }
+
+        index = (index + 1) & (interned_capacity - 1);
+    }
+
+    // Interned strings go straight to the old generation, since the table
+    // points at them
+    string_t *str = (string_t *)gc_allocate(sizeof(string_t) + length + 1, VAL_STRING);
+    str->length = length;
+    str->interned = true;
+    str->hash = hash;
+    str->string = (char *)(str + 1);
+    memcpy(str->string, string, length + 1);
+    str->left = NULL;
+    str->right = NULL;
+
+    intern_insert(str);
+
+    return value_from_object(VAL_STRING, (object_t *)str);
+}
+
+void string_forget_interned(string_t *string)
+{
+    size_t index = string->hash & (interned_capacity - 1);
+
+    while (interned[index] != string)
+        index = (index + 1) & (interned_capacity - 1);
+
+    interned[index] = INTERN_TOMBSTONE;
 }
 
 value_t tuple_create(int length)
 {
-    value_t val;
-    tuple_t *tuple = (tuple_t *)malloc(sizeof(tuple_t));
+    void *unused;
+    tuple_t *tuple = (tuple_t *)gc_allocate_young(sizeof(tuple_t), sizeof(value_t) * length, VAL_TUPLE, &unused);
 
-    tuple->object.type = VAL_TUPLE;
     tuple->length = length;
-    tuple->values = (value_t *)malloc(sizeof(value_t) * length);
 
-    val.type = VAL_TUPLE;
-    val.contents.object = (object_t *)tuple;
+    return value_from_object(VAL_TUPLE, (object_t *)tuple);
+}
 
-    return val;
+value_t range_create(int begin, int end)
+{
+    assert(range_fits(begin, end));
+
+    return value_from_range(begin, end);
 }
 
-value_t function_def_create(char *name, address_t address, uint8_t nargs, uint8_t *locals, uint8_t low)
+value_t function_def_create(char *name, address_t address, uint8_t nargs)
 {
-    value_t val;
-    function_t *func = (function_t *)malloc(sizeof(function_t));
+    function_t *func = (function_t *)gc_allocate(sizeof(function_t), VAL_FUNCTION);
 
-    func->object.type = VAL_FUNCTION;
-    func->name = name;
+    func->name = strdup(name);
+    gc_account((object_t *)func, strlen(name) + 1);
     func->address = address;
     func->nargs = nargs;
-    func->locals = locals;
-    func->low_reg = low;
-    func->save = NULL;
-
-    val.type = VAL_FUNCTION;
-    val.contents.object = (object_t *)func;
 
-    return val;
+    return value_from_object(VAL_FUNCTION, (object_t *)func);
 }
 
 value_t module_create(char *name, struct vm_t *vm)
 {
-    value_t val;
+    module_t *module = (module_t *)gc_allocate(sizeof(module_t), VAL_MODULE);
 
-    module_t *module = (module_t *)malloc(sizeof(module_t));
-
-    module->name = name;
+    module->name = strdup(name);
+    gc_account((object_t *)module, strlen(name) + 1);
     module->vm = vm;
 
-    val.type = VAL_MODULE;
-    val.contents.object = (object_t *)module;
-
-    return val;
+    return value_from_object(VAL_MODULE, (object_t *)module);
 }
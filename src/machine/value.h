@@ -7,8 +7,10 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "address.h"
 
@@ -33,6 +35,7 @@ typedef enum
     VAL_FLOAT,
     VAL_BOOLEAN,
     VAL_TUPLE,
+    VAL_RANGE,
     VAL_ITERATOR,
     VAL_FUNCTION,
     VAL_MODULE,
@@ -42,6 +45,106 @@ typedef enum
 // For simple primitives, like integers, floats, and booleans the value is
 // held in the structure. For more complex types, we use struct punning to
 // approximate "inheritance".
+//
+// There are two layouts, and nothing outside of this header should depend on
+// either one; go through the value_* accessors below instead. By default a
+// value is a tag next to a union, which is 16 bytes once padded. Building with
+// NORD_PACKED_VALUES packs the tag into the top 4 bits of a single 64-bit
+// word, halving the size of registers, memory and tuples. That works because
+// numbers are only 32 bits wide and user-space pointers fit in 48, but it
+// limits ranges to bounds that fit in 30 bits each.
+#ifdef NORD_PACKED_VALUES
+typedef struct
+{
+    uint64_t bits;
+} value_t;
+
+#define VALUE_TAG_SHIFT 60
+#define VALUE_PAYLOAD_MASK ((UINT64_C(1) << VALUE_TAG_SHIFT) - 1)
+#define VALUE_RANGE_BITS 30
+#define VALUE_RANGE_MASK ((UINT64_C(1) << VALUE_RANGE_BITS) - 1)
+#define VALUE_RANGE_MIN (-(1 << (VALUE_RANGE_BITS - 1)))
+#define VALUE_RANGE_MAX ((1 << (VALUE_RANGE_BITS - 1)) - 1)
+
+static inline value_t value_pack(value_type_e type, uint64_t payload)
+{
+    return (value_t){ ((uint64_t)type << VALUE_TAG_SHIFT) | (payload & VALUE_PAYLOAD_MASK) };
+}
+
+static inline value_type_e value_type_of(value_t v)
+{
+    return (value_type_e)(v.bits >> VALUE_TAG_SHIFT);
+}
+
+static inline int value_as_int(value_t v)
+{
+    return (int32_t)(uint32_t)v.bits;
+}
+
+static inline float value_as_float(value_t v)
+{
+    union { uint32_t bits; float real; } pun = { (uint32_t)v.bits };
+    return pun.real;
+}
+
+static inline bool value_as_bool(value_t v)
+{
+    return v.bits & 1;
+}
+
+static inline struct obj_t *value_as_object(value_t v)
+{
+    return (struct obj_t *)(uintptr_t)(v.bits & VALUE_PAYLOAD_MASK);
+}
+
+// Sign-extend a 30-bit range bound
+static inline int value_range_bound(uint64_t bits)
+{
+    return (int32_t)((uint32_t)(bits & VALUE_RANGE_MASK) << (32 - VALUE_RANGE_BITS)) >> (32 - VALUE_RANGE_BITS);
+}
+
+static inline int range_begin(value_t v)
+{
+    return value_range_bound(v.bits);
+}
+
+static inline int range_end(value_t v)
+{
+    return value_range_bound(v.bits >> VALUE_RANGE_BITS);
+}
+
+static inline value_t value_from_int(int x)
+{
+    return value_pack(VAL_INT, (uint32_t)x);
+}
+
+static inline value_t value_from_float(double x)
+{
+    union { float real; uint32_t bits; } pun = { (float)x };
+    return value_pack(VAL_FLOAT, pun.bits);
+}
+
+static inline value_t value_from_bool(bool x)
+{
+    return value_pack(VAL_BOOLEAN, x);
+}
+
+static inline value_t value_from_object(value_type_e type, struct obj_t *object)
+{
+    return value_pack(type, (uintptr_t)object);
+}
+
+static inline value_t value_from_range(int begin, int end)
+{
+    return value_pack(VAL_RANGE, ((uint64_t)(end & VALUE_RANGE_MASK) << VALUE_RANGE_BITS) | (begin & VALUE_RANGE_MASK));
+}
+
+// A value that carries nothing but its type, like nil
+static inline value_t value_from_type(value_type_e type)
+{
+    return value_pack(type, 0);
+}
+#else
 typedef struct
 {
     value_type_e type;
@@ -50,14 +153,92 @@ typedef struct
         int number;
         float real;
         bool boolean;
+        struct {
+            int begin;
+            int end;
+        } range;
         struct obj_t *object;
     } contents;
 } value_t;
 
-// All complex types inherit from object_t.
+#define VALUE_RANGE_MIN INT_MIN
+#define VALUE_RANGE_MAX INT_MAX
+
+static inline value_type_e value_type_of(value_t v)
+{
+    return v.type;
+}
+
+static inline int value_as_int(value_t v)
+{
+    return v.contents.number;
+}
+
+static inline float value_as_float(value_t v)
+{
+    return v.contents.real;
+}
+
+static inline bool value_as_bool(value_t v)
+{
+    return v.contents.boolean;
+}
+
+static inline struct obj_t *value_as_object(value_t v)
+{
+    return v.contents.object;
+}
+
+static inline int range_begin(value_t v)
+{
+    return v.contents.range.begin;
+}
+
+static inline int range_end(value_t v)
+{
+    return v.contents.range.end;
+}
+
+static inline value_t value_from_int(int x)
+{
+    return (value_t){ .type=VAL_INT, .contents={ .number=x } };
+}
+
+static inline value_t value_from_float(double x)
+{
+    return (value_t){ .type=VAL_FLOAT, .contents={ .real=x } };
+}
+
+static inline value_t value_from_bool(bool x)
+{
+    return (value_t){ .type=VAL_BOOLEAN, .contents={ .boolean=x } };
+}
+
+static inline value_t value_from_object(value_type_e type, struct obj_t *object)
+{
+    return (value_t){ .type=type, .contents={ .object=object } };
+}
+
+static inline value_t value_from_range(int begin, int end)
+{
+    return (value_t){ .type=VAL_RANGE, .contents={ .range={ begin, end } } };
+}
+
+static inline value_t value_from_type(value_type_e type)
+{
+    return (value_t){ .type=type };
+}
+#endif
+
+// All complex types inherit from object_t. Objects are allocated and freed by
+// the garbage collector (see gc.h), which threads them all onto one list.
 typedef struct obj_t
 {
     value_type_e type;
+    bool marked;
+    // Which VM allocated this, for per-VM accounting (see gc_heap_t)
+    uint16_t owner;
+    struct obj_t *next;
 } object_t;
 
 // Iterator
@@ -74,38 +255,135 @@ value_t iterator_create(value_t collection);
 // Returns whether or not the specified value is a collection
 bool is_collection(value_t value);
 
-// String object
-typedef struct
+// String object. Concatenating long strings doesn't copy them; instead the
+// result is a rope, which just points at its two halves. The characters are
+// only gathered up the first time someone reads them, so building a string by
+// appending to it over and over takes linear time instead of quadratic.
+typedef struct string_t
 {
     object_t object;
     int length;
+    // Interned strings are unique, so two of them are equal only if they are
+    // the same object
+    bool interned;
+    // Only computed for interned strings
+    uint64_t hash;
+    // Usually points just past the struct, where the characters are stored in
+    // the same allocation. A flattened rope has a buffer of its own, and one
+    // that hasn't been flattened yet has NULL. Use string_chars to read it.
     char *string;
+    // The halves of a rope, until it's flattened
+    struct string_t *left;
+    struct string_t *right;
 } string_t;
 
+// Concatenations shorter than this are just copied, since a rope wouldn't save
+// anything
+#define STRING_ROPE_MIN_LENGTH 64
+
 value_t string_create(char *string);
+// Like string_create, for when the length is already known
+value_t string_create_length(const char *string, size_t length);
+value_t string_concat(value_t a, value_t b);
+
+// Returns the interned string with the given contents, creating it if there
+// isn't one yet. Interned strings are never moved, so they're safe to keep in
+// the constant pool.
+value_t string_intern(const char *string);
+
+// The collector calls this as it frees an interned string
+void string_forget_interned(string_t *string);
+
+// Gather up the characters of a rope into a single buffer
+void string_flatten(string_t *string);
+
+// Returns a string's characters, flattening it first if it's a rope
+static inline char *string_chars(string_t *string)
+{
+    if (string->string == NULL)
+        string_flatten(string);
+
+    return string->string;
+}
 
+static inline bool string_equals(string_t *a, string_t *b)
+{
+    if (a == b)
+        return true;
+
+    if (a->interned && b->interned)
+        return false;
+
+    return a->length == b->length && memcmp(string_chars(a), string_chars(b), a->length) == 0;
+}
+
+// Order strings by their bytes, with a string sorting before anything longer
+// that it begins
+static inline int string_compare(string_t *a, string_t *b)
+{
+    if (a == b)
+        return 0;
+
+    size_t length = (a->length < b->length) ? a->length : b->length;
+    int order = memcmp(string_chars(a), string_chars(b), length);
+
+    if (order != 0)
+        return order;
+
+    return (a->length > b->length) - (a->length < b->length);
+}
+
+// Tuple object. The elements are stored inline, in the same allocation.
 typedef struct
 {
     object_t object;
     int length;
-    value_t *values;
+    value_t values[];
 } tuple_t;
 
 value_t tuple_create(int length);
 
+// Ranges live entirely inside a value_t, and produce their elements on demand.
+// They're inclusive, and count down when end is less than begin. A range that
+// begins and ends on the same number is empty. Both bounds must fit, see
+// range_fits.
+value_t range_create(int begin, int end);
+
+// Whether a range with these bounds can be represented. Only packed values
+// limit them.
+static inline bool range_fits(int begin, int end)
+{
+    return begin >= VALUE_RANGE_MIN && begin <= VALUE_RANGE_MAX &&
+           end >= VALUE_RANGE_MIN && end <= VALUE_RANGE_MAX;
+}
+
+static inline int range_length(value_t range)
+{
+    int begin = range_begin(range), end = range_end(range);
+
+    if (begin == end)
+        return 0;
+
+    return (begin < end) ? end - begin + 1 : begin - end + 1;
+}
+
+static inline int range_at(value_t range, int index)
+{
+    if (range_begin(range) < range_end(range))
+        return range_begin(range) + index;
+
+    return range_begin(range) - index;
+}
+
 typedef struct
 {
     object_t object;
     char *name;
     address_t address;        // Where this function lives in code
-    address_t return_address;
     uint8_t nargs;            // number of args
-    uint8_t *locals;          // Which registers are used by this function, 0 terminated
-    uint8_t low_reg;
-    value_t *save;            // Registers to restore upon return
 } function_t;
 
-value_t function_def_create(char *name, address_t address, uint8_t nargs, uint8_t *locals, uint8_t low);
+value_t function_def_create(char *name, address_t address, uint8_t nargs);
 
 typedef struct
 {
@@ -116,16 +394,6 @@ typedef struct
 
 value_t module_create(char *name, struct vm_t *vm);
 
-static inline value_t value_from_int(int x)
-{
-    return (value_t){ .type=VAL_INT, .contents={ .number=x } };
-}
-
-static inline value_t value_from_float(double x)
-{
-    return (value_t){ .type=VAL_FLOAT, .contents={ .real=x } };
-}
-
 static inline value_type_e arithmetic_cast(value_type_e first, value_type_e second)
 {
     if (first == VAL_UNKNOWN || second == VAL_UNKNOWN)
@@ -10,48 +10,189 @@
 
 #include "bytecode.h"
 #include "disassemble.h"
+#include "gc.h"
 #include "vm.h"
 #include "value.h"
-#include "util/dl.h"
 #include "compiler/compile.h"
 #include "compiler/parse.h"
 #include "compiler/lex.h"
+#include "lang/builtins.h"
+
+// Labels-as-values are a GCC / Clang extension. Where available we use them to
+// jump straight from one instruction handler to the next, rather than bouncing
+// back through the switch statement at the top of the loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
+
+// Dispatch helpers for vm_run(). Every handler is both a case label and (when
+// threaded) a jump target, so the body reads the same either way. Translated
+// code always ends in a halt, so fetching never checks for the end of a block.
+#define VM_FETCH() instruction = ip++
+
+#ifdef VM_THREADED_DISPATCH
+#define VM_CASE(op) case op: TARGET_##op
+#define VM_NEXT() do { VM_FETCH(); goto *instruction->handler; } while (0)
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT() continue
+#endif
+
+// Collect garbage if enough has been allocated. Handlers that allocate poll
+// once whatever they allocated is safely in a register or on the stack. This
+// is also where a VM that has gone over its heap limit stops.
+#define VM_GC_POLL() \
+    if (gc_requested) \
+    { \
+        gc_poll(); \
+        if (vm->heap.exceeded) \
+            goto heap_exceeded; \
+    }
+
+// Builtins report bad arguments by setting vm->error, which stops the VM
+#define VM_BUILTIN_CHECK() \
+    if (vm->error != NULL) \
+        goto done
 
-// Defines to make handling type information less verbose
-#define REG_TYPE3(a, t) vm->registers[instruction.fields.triplet.a].type == t
-#define BOOL2(a) vm->registers[instruction.fields.pair.a].contents.boolean
-#define FLOAT2(a) vm->registers[instruction.fields.pair.a].contents.real
-#define NUM2(a) vm->registers[instruction.fields.pair.a].contents.number
-#define STR2(a) ((string_t *)vm->registers[instruction.fields.pair.a].contents.object)->string
-#define NUM3(a) vm->registers[instruction.fields.triplet.a].contents.number
-#define NUM_OR_FLOAT3(a) ((vm->registers[instruction.fields.triplet.a].type == VAL_FLOAT) ? vm->registers[instruction.fields.triplet.a].contents.real : vm->registers[instruction.fields.triplet.a].contents.number)
-#define NUM_OR_FLOAT_OR_BOOL3(a) ((vm->registers[instruction.fields.triplet.a].type == VAL_FLOAT) ? vm->registers[instruction.fields.triplet.a].contents.real : \
-                                 ((vm->registers[instruction.fields.triplet.a].type == VAL_INT) ? vm->registers[instruction.fields.triplet.a].contents.number : \
-                                   vm->registers[instruction.fields.triplet.a].contents.boolean))
-#define IS_NUMBERISH3(a) (vm->registers[instruction.fields.triplet.a].type == VAL_INT || vm->registers[instruction.fields.triplet.a].type == VAL_FLOAT || vm->registers[instruction.fields.triplet.a].type == VAL_BOOLEAN)
-#define IS_NUMBERISH2(a) (vm->registers[instruction.fields.pair.a].type == VAL_INT || vm->registers[instruction.fields.pair.a].type == VAL_FLOAT || vm->registers[instruction.fields.pair.a].type == VAL_BOOLEAN)
-#define STRING3(a) ((string_t *)vm->registers[instruction.fields.triplet.a].contents.object)->string
+// Translated code can also contain a few instructions of its own, numbered
+// after the last real opcode
+enum
+{
+    // Ends every translated code block
+    VM_OP_HALT = OP_GETOUTBOUND + 1,
+    VM_NUM_OPS,
+};
+
+// Sync the program counter to and from our locals around anything that moves
+// between code regions or register windows.
+#define VM_SAVE_PC() vm->pc = ip - code
+#define VM_LOAD_FRAME() \
+    registers = vm->registers; \
+    code = vm->code[vm->region].code; \
+    ip = code + vm->pc
+
+#define REG_TYPE3(a, t) (value_type_of(registers[instruction->a]) == t)
+#define BOOL2(a) value_as_bool(registers[instruction->a])
+#define FLOAT2(a) value_as_float(registers[instruction->a])
+#define NUM2(a) value_as_int(registers[instruction->a])
+#define STR2(a) ((string_t *)value_as_object(registers[instruction->a]))
+#define NUM3(a) value_as_int(registers[instruction->a])
+#define FLOAT3(a) value_as_float(registers[instruction->a])
+#define NUM_OR_FLOAT3(a) ((value_type_of(registers[instruction->a]) == VAL_FLOAT) ? value_as_float(registers[instruction->a]) : value_as_int(registers[instruction->a]))
+#define NUM_OR_FLOAT_OR_BOOL3(a) ((value_type_of(registers[instruction->a]) == VAL_FLOAT) ? value_as_float(registers[instruction->a]) : \
+                                 ((value_type_of(registers[instruction->a]) == VAL_INT) ? value_as_int(registers[instruction->a]) : \
+                                   value_as_bool(registers[instruction->a])))
+#define IS_NUMBERISH3(a) (value_type_of(registers[instruction->a]) == VAL_INT || value_type_of(registers[instruction->a]) == VAL_FLOAT || value_type_of(registers[instruction->a]) == VAL_BOOLEAN)
+#define IS_NUMBERISH2(a) (value_type_of(registers[instruction->a]) == VAL_INT || value_type_of(registers[instruction->a]) == VAL_FLOAT || value_type_of(registers[instruction->a]) == VAL_BOOLEAN)
+#define BRANCH_REG(a) registers[instruction->a]
+#define BRANCH_STRING(a) ((string_t *)value_as_object(registers[instruction->a]))
+
+// Numbers and booleans compare with each other by value
+static inline bool value_is_numberish(value_t v)
+{
+    return value_type_of(v) == VAL_INT || value_type_of(v) == VAL_FLOAT || value_type_of(v) == VAL_BOOLEAN;
+}
+
+static inline double value_as_number(value_t v)
+{
+    switch (value_type_of(v))
+    {
+        case VAL_FLOAT:
+            return value_as_float(v);
+        case VAL_BOOLEAN:
+            return value_as_bool(v);
+        default:
+            return value_as_int(v);
+    }
+}
+
+// Whether a value counts as true when a jump tests it. This agrees with the
+// not instruction.
+static inline bool value_truthy(value_t v)
+{
+    switch (value_type_of(v))
+    {
+        case VAL_INT:
+            return value_as_int(v) != 0;
+        case VAL_FLOAT:
+            return value_as_float(v) != 0;
+        case VAL_BOOLEAN:
+            return value_as_bool(v);
+        case VAL_STRING:
+            return ((string_t *)value_as_object(v))->length != 0;
+        case VAL_ABSENT:
+        case VAL_NIL:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static inline bool values_equal(value_t a, value_t b)
+{
+    if (value_is_numberish(a) && value_is_numberish(b))
+        return value_as_number(a) == value_as_number(b);
+
+    // If both aren't number-like things, then differing types naturally mean
+    // they're not equal
+    if (value_type_of(a) != value_type_of(b))
+        return false;
+
+    switch (value_type_of(a))
+    {
+        case VAL_STRING:
+            return string_equals((string_t *)value_as_object(a), (string_t *)value_as_object(b));
+        case VAL_NIL:
+        case VAL_ABSENT:
+            return true;
+        case VAL_RANGE:
+            return range_begin(a) == range_begin(b) && range_end(a) == range_end(b);
+        default:
+            return value_as_object(a) == value_as_object(b);
+    }
+}
+
+// Numbers order with each other, and strings with each other. Nothing else
+// has an order.
+static inline bool values_orderable(value_t a, value_t b)
+{
+    if (value_is_numberish(a) && value_is_numberish(b))
+        return true;
+
+    return value_type_of(a) == VAL_STRING && value_type_of(b) == VAL_STRING;
+}
+
+// Both values must be orderable
+static inline bool values_less_than(value_t a, value_t b)
+{
+    if (value_type_of(a) == VAL_STRING)
+        return string_compare((string_t *)value_as_object(a), (string_t *)value_as_object(b)) < 0;
+
+    return value_as_number(a) < value_as_number(b);
+}
 
 void vm_stack_create(vm_t *);
-void vm_cstack_create(vm_t *);
+void vm_frames_create(vm_t *);
+void vm_registers_create(vm_t *);
+void vm_translate(vm_t *);
 
 void value_print(value_t v)
 {
     string_t *s;
-    switch (v.type)
+    switch (value_type_of(v))
     {
         case VAL_INT:
-            printf("{INT:%d}\n", v.contents.number);
+            printf("{INT:%d}\n", value_as_int(v));
             break;
         case VAL_STRING:
-            s = (string_t *)v.contents.object;
-            printf("{STRING:%s}\n", s->string);
+            s = (string_t *)value_as_object(v);
+            printf("{STRING:%s}\n", string_chars(s));
             break;
         case VAL_FLOAT:
-            printf("{FLOAT:%f}\n", v.contents.real);
+            printf("{FLOAT:%f}\n", value_as_float(v));
             break;
         case VAL_BOOLEAN:
-            printf("{BOOLEAN:%s}\n", (v.contents.boolean) ? "true" : "false");
+            printf("{BOOLEAN:%s}\n", (value_as_bool(v)) ? "true" : "false");
             break;
         case VAL_ABSENT:
             printf("{NONE}\n");
@@ -59,6 +200,9 @@ void value_print(value_t v)
         case VAL_TUPLE:
             printf("{TUPLE}\n");
             break;
+        case VAL_RANGE:
+            printf("{RANGE:%d..%d}\n", range_begin(v), range_end(v));
+            break;
         case VAL_ITERATOR:
             printf("{ITERATOR}\n");
             break;
@@ -88,7 +232,10 @@ vm_t *vm_create(binary_t *binary)
     vm_stack_create(vm);
 
     // Set up the call stack
-    vm_cstack_create(vm);
+    vm_frames_create(vm);
+
+    // Set up the register file
+    vm_registers_create(vm);
 
     vm->regions = binary->code;
     vm->region = 0;
@@ -99,45 +246,88 @@ vm_t *vm_create(binary_t *binary)
     vm->size_inbound = vm->size_outbound = 0;
 
     vm->symbols = binary->symbols;
+    vm->error = NULL;
+
+    vm_translate(vm);
 
-    memset(&vm->registers, 0, 128 * sizeof(value_t));
+    gc_register_vm(vm);
 
     return vm;
 }
 
 void vm_stack_create(vm_t *vm)
 {
-    vm->stack = memory_create(VM_STACK_SIZE);
+    vm->stack_capacity = VM_STACK_SIZE;
+    vm->stack = calloc(vm->stack_capacity, sizeof(value_t));
     vm->sp = 0;
 }
 
-// Push a value onto the stack of a vm_t, returning the register it is stored in
-void vm_stack_push(vm_t *vm, value_t val)
+void vm_stack_grow(vm_t *vm)
+{
+    vm->stack_capacity *= 2;
+    vm->stack = realloc(vm->stack, vm->stack_capacity * sizeof(value_t));
+}
+
+void vm_frames_create(vm_t *vm)
 {
-    memory_set(vm->stack, vm->sp++, val);
+    vm->frames_capacity = VM_FRAME_STACK_SIZE;
+    vm->frames = malloc(vm->frames_capacity * sizeof(frame_t));
+    vm->fp = 0;
+}
+
+// Push a new call frame, making it the current frame. The frame stack only
+// grows when it overflows.
+frame_t *vm_frame_push(vm_t *vm, function_t *function)
+{
+    if (vm->fp >= vm->frames_capacity)
+    {
+        vm->frames_capacity *= 2;
+        vm->frames = realloc(vm->frames, vm->frames_capacity * sizeof(frame_t));
+    }
+
+    frame_t *frame = vm->frames + vm->fp++;
+    frame->function = function;
+
+    return frame;
 }
 
-value_t vm_stack_pop(vm_t *vm)
+static inline frame_t *vm_frame_current(vm_t *vm)
 {
-    vm->sp--;
-    return memory_get(vm->stack, vm->sp);
+    return vm->frames + vm->fp - 1;
 }
 
-void vm_cstack_create(vm_t *vm)
+// Pop the current frame, making its caller the current frame
+void vm_frame_pop(vm_t *vm)
 {
-    vm->call_stack = memory_create(VM_STACK_SIZE);
-    vm->csp = 0;
+    vm->fp--;
 }
 
-void vm_cstack_push(vm_t *vm, value_t val)
+void vm_registers_create(vm_t *vm)
 {
-    memory_set(vm->call_stack, vm->csp++, val);
+    vm->register_file_size = VM_REGISTER_FILE_SIZE;
+    vm->register_file = calloc(vm->register_file_size, sizeof(value_t));
+    vm->base = 0;
+    vm->registers = vm->register_file;
 }
 
-value_t vm_cstack_pop(vm_t *vm)
+// Slide the register window to start at the given offset into the register
+// file, growing the file if the window would run off the end of it.
+void vm_registers_slide(vm_t *vm, size_t base)
 {
-    vm->csp--;
-    return memory_get(vm->call_stack, vm->csp);
+    if (base + VM_NUM_REGISTERS > vm->register_file_size)
+    {
+        size_t size = vm->register_file_size;
+
+        while (base + VM_NUM_REGISTERS > size)
+            size *= 2;
+
+        vm->register_file = realloc(vm->register_file, size * sizeof(value_t));
+        memset(vm->register_file + vm->register_file_size, 0, (size - vm->register_file_size) * sizeof(value_t));
+        vm->register_file_size = size;
+    }
+
+    vm->base = base;
+    vm->registers = vm->register_file + base;
 }
 
 void vm_add_inbound_value(vm_t *vm, value_t value)
@@ -155,7 +345,7 @@ value_t *vm_get_inbound_values(vm_t *vm)
         values[i] = memory_get(vm->inbound, i);
     }
 
-    values[vm->size_inbound] = (value_t){.type=VAL_NIL };
+    values[vm->size_inbound] = value_from_type(VAL_NIL);
 
     vm->size_inbound = 0;
 
@@ -177,394 +367,714 @@ void vm_add_outbound_value(vm_t *vm, value_t value)
 
 //-- Instructions
 
-void instruction_call(vm_t *vm, instruction_t instruction)
+void instruction_call(vm_t *vm, function_t *fn, uint8_t call_register)
 {
-    function_t *fn;
-    value_t function_def;
-
-    function_def = memory_get(vm->memory, instruction.fields.pair.arg2);
-
-    // This must be of type VAL_FUNCTION
-    assert(function_def.type == VAL_FUNCTION);
-
-    // Save the current frame if it's set
-    if (vm->frame.type == VAL_FUNCTION)
-    {
-        vm_cstack_push(vm, vm->frame);
-    }
-
-    // Make a copy so we don't pollute the function definition later
-    fn = (function_t *)function_def.contents.object;
-    function_def = function_def_create(
-            fn->name,
-            fn->address,
-            fn->nargs,
-            fn->locals,
-            fn->low_reg
-    );
-
-    vm->frame = function_def;
-
-    fn = (function_t *)vm->frame.contents.object;
+    frame_t *frame = vm_frame_push(vm, fn);
 
-    // First, set the return address in the current frame
-    fn->return_address = (address_t){ .region=vm->region, .offset=vm->pc };
+    // First, set the return address and the caller's window in the new frame
+    frame->return_address = (address_t){ .region=vm->region, .offset=vm->pc };
+    frame->base = vm->base;
 
     // Now set the program counter / region
     vm->region = fn->address.region;
     vm->pc = fn->address.offset;
 
-    // Initialize save buffer, if null
-    if (fn->save == NULL)
-    {
-        uint8_t count = 0;
-
-        while (fn->locals[count] != 0)
-        {
-            count += 1;
-        }
-
-        fn->save = (value_t *)malloc(sizeof(value_t) * count);
-    }
-
-    // Finally, save out locals
-    for (uint8_t i = fn->nargs, reg = fn->locals[i]; reg != 0; i++, reg = fn->locals[i])
-    {
-        fn->save[i] = vm->registers[reg];
-    }
+    // Finally, slide the register window up to the call register. Our
+    // arguments are already sitting right after it.
+    vm_registers_slide(vm, vm->base + call_register);
 }
 
-void instruction_call_builtin(vm_t *vm, instruction_t instruction)
+// Resolve the builtin named by a calld instruction's operand to its index in
+// the builtin registry
+int instruction_resolve_builtin(value_t function_name)
 {
-    value_t function_name;
     string_t *strobj;
 
-    function_name = memory_get(vm->memory, instruction.fields.pair.arg2);
-
     // Function names must be string values. Not sure how they wouldn't
     // be, so we assert here.
-    assert(function_name.type == VAL_STRING);
+    assert(value_type_of(function_name) == VAL_STRING);
 
-    strobj = (string_t *)function_name.contents.object;
+    strobj = (string_t *)value_as_object(function_name);
 
-    char *builtin_name;
-    asprintf(&builtin_name, "builtin__%s", strobj->string);
-    void (*builtin)(vm_t *);
-    builtin = (void (*)(vm_t *))dynamic_load_self(builtin_name);
-    free(builtin_name);
+    return builtin_lookup(string_chars(strobj));
+}
 
-    // TODO: Maintain a symbol map for future calls?
+void instruction_call_builtin(vm_t *vm, value_t function_name)
+{
+    int builtin = instruction_resolve_builtin(function_name);
 
     // TODO: Proper error handling-- we couldn't find the supplied
     // runtime symbol
-    assert(builtin != NULL);
+    assert(builtin >= 0);
 
-    (*builtin)(vm);
+    builtins[builtin].function(vm);
 }
 
-void vm_execute(vm_t *vm)
+//-- Translation
+
+static void **vm_run(vm_t *);
+
+// Translate a single instruction. Jump targets are resolved against the
+// translated block, which lives at code.
+static vm_instruction_t vm_translate_instruction(vm_t *vm, instruction_t instruction, vm_instruction_t *code, size_t pc)
 {
-    while (vm->pc < vm->regions->blocks[vm->region]->size)
+    vm_instruction_t translated = { .opcode=instruction.opcode };
+    value_t value;
+    int builtin;
+
+    switch (instruction.opcode)
     {
-        // Pull off the next instruction
-        instruction_t instruction = vm->regions->blocks[vm->region]->code[vm->pc++];
-        value_t ret;
-        value_t result;
-        string_t *s1, *s2;
-        tuple_t *t1;
-        iterator_t *iter;
-        char *stmp;
-        memory_t *mem;
-        function_t *fn;
-
-        switch (instruction.opcode)
-        {
-            case OP_NIL:
-                result.type = VAL_NIL;
-                vm->registers[instruction.fields.pair.arg2] = result;
-                break;
+        // Jumps, and anything else that branches
+        case OP_JMP:
+        case OP_JMP_TRUE:
+        case OP_JMP_FALSE:
+        case OP_JMP_EQUAL:
+        case OP_JMP_NOT_EQUAL:
+        case OP_JMP_LESSTHAN:
+        case OP_JMP_NOT_LESSTHAN:
+        case OP_JMP_EQUAL_INT:
+        case OP_JMP_NOT_EQUAL_INT:
+        case OP_JMP_LESSTHAN_INT:
+        case OP_JMP_NOT_LESSTHAN_INT:
+        case OP_JMP_EQUAL_FLOAT:
+        case OP_JMP_NOT_EQUAL_FLOAT:
+        case OP_JMP_LESSTHAN_FLOAT:
+        case OP_JMP_NOT_LESSTHAN_FLOAT:
+        case OP_JMP_EQUAL_STRING:
+        case OP_JMP_NOT_EQUAL_STRING:
+        case OP_FORITER:
+            translated.arg1 = instruction.fields.branch.arg1;
+            translated.arg2 = instruction.fields.branch.arg2;
+            translated.operand.target = code + pc + instruction.fields.branch.offset;
+            break;
 
-            // Load a value into the specified register
-            case OP_LOAD:
-                if (instruction.fields.pair.arg1 & 0x70)
-                {
-                    mem = vm->stack;
-                }
-                else
-                {
-                    mem = vm->memory;
-                }
+        // Three registers
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_ADD_INT:
+        case OP_ADD_FLOAT:
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_FLOAT:
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_FLOAT:
+        case OP_CONCAT:
+        case OP_AND:
+        case OP_OR:
+        case OP_TUPLE:
+            translated.arg1 = instruction.fields.triplet.arg1;
+            translated.arg2 = instruction.fields.triplet.arg2;
+            translated.arg3 = instruction.fields.triplet.arg3;
+            break;
 
-                vm->registers[instruction.fields.pair.arg1] = memory_get(mem, instruction.fields.pair.arg2);
-                break;
+        // A register and a memory address
+        case OP_LOAD:
+        case OP_STORE:
+        case OP_IMPORT:
+        case OP_SETINBOUND:
+        case OP_GETOUTBOUND:
+            translated.arg1 = instruction.fields.pair.arg1;
+            translated.operand.slot = memory_slot(vm->memory, instruction.fields.pair.arg2);
+            break;
 
-            case OP_LOADV:
-                result.type = VAL_INT;
-                result.contents.number = instruction.fields.pair_signed.arg2;
-                vm->registers[instruction.fields.pair.arg1] = result;
-                break;
+        case OP_LOADV:
+            translated.arg1 = instruction.fields.pair_signed.arg1;
+            translated.operand.immediate = instruction.fields.pair_signed.arg2;
+            break;
 
-            case OP_STORE:
-                memory_set(vm->memory, instruction.fields.pair.arg1, vm->registers[instruction.fields.pair.arg2]);
-                break;
+        case OP_CALL:
+            value = memory_get(vm->memory, instruction.fields.pair.arg2);
 
-            case OP_MOVE:
-                vm->registers[instruction.fields.pair.arg1] = vm->registers[instruction.fields.pair.arg2];
-                break;
+            // This must be of type VAL_FUNCTION
+            assert(value_type_of(value) == VAL_FUNCTION);
 
-            case OP_PUSH:
-                vm_stack_push(vm, vm->registers[instruction.fields.pair.arg2]);
-                break;
+            translated.arg1 = instruction.fields.pair.arg1;
+            translated.operand.function = (function_t *)value_as_object(value);
+            break;
 
-            case OP_POP:
-                vm->registers[instruction.fields.pair.arg2] = vm_stack_pop(vm);
-                break;
+        case OP_CALL_DYNAMIC:
+            translated.operand.slot = memory_slot(vm->memory, instruction.fields.pair.arg2);
+
+            // Bind the builtin now if we can, and otherwise leave it to fail
+            // when it's called
+            builtin = instruction_resolve_builtin(*translated.operand.slot);
+            if (builtin >= 0)
+            {
+                translated.opcode = OP_CALL_BUILTIN;
+                translated.operand.builtin = builtins[builtin].function;
+            }
+            break;
 
-            case OP_JMP:
-                // We have to account for the fact that we've already incremented our program counter
-                vm->pc += vm->registers[instruction.fields.pair.arg2].contents.number - 1;
+        // A malformed binary can refer to a builtin that doesn't exist, which
+        // stops the VM before it runs, like an unknown opcode does
+        case OP_CALL_BUILTIN:
+            if (instruction.fields.pair.arg2 >= builtin_count)
+            {
+                if (vm->error == NULL)
+                    asprintf(&vm->error, "Unknown builtin %d", instruction.fields.pair.arg2);
+
+                translated.opcode = VM_OP_HALT;
                 break;
+            }
 
-            case OP_EQUAL:
-                if (IS_NUMBERISH3(arg2) && IS_NUMBERISH3(arg3))
-                {
-                    result.contents.boolean = (NUM_OR_FLOAT_OR_BOOL3(arg2) == NUM_OR_FLOAT_OR_BOOL3(arg3));
-                }
-                // If both aren't number-like things, than differing types naturally mean they're not equal
-                else if (vm->registers[instruction.fields.triplet.arg2].type != vm->registers[instruction.fields.triplet.arg3].type)
-                {
-                    result.contents.boolean = false;
-                }
-                else if (REG_TYPE3(arg2, VAL_STRING) && REG_TYPE3(arg3, VAL_STRING))
-                {
-                    s1 = (string_t *)vm->registers[instruction.fields.triplet.arg2].contents.object;
-                    s2 = (string_t *)vm->registers[instruction.fields.triplet.arg3].contents.object;
-                    result.contents.boolean = !strcmp(s1->string, s2->string);
-                }
-                else if (REG_TYPE3(arg2, VAL_NIL) && REG_TYPE3(arg3, VAL_NIL))
-                {
-                    result.contents.boolean = true;
-                }
+            translated.operand.builtin = builtins[instruction.fields.pair.arg2].function;
+            break;
 
-                if (result.contents.boolean != instruction.fields.triplet.arg1)
-                    vm->pc += 1;
+        // Everything else is one or two registers
+        default:
+            translated.arg1 = instruction.fields.pair.arg1;
+            translated.arg2 = instruction.fields.pair.arg2;
+    }
 
-                break;
+    return translated;
+}
 
-            case OP_LESSTHAN:
-                if (IS_NUMBERISH3(arg2) && IS_NUMBERISH3(arg3))
-                {
-                    result.contents.boolean = NUM_OR_FLOAT3(arg2) < NUM_OR_FLOAT3(arg3);
-                }
-                else
-                {
-                    // Error?
-                }
+// Translate every code region for the interpreter loop
+void vm_translate(vm_t *vm)
+{
+    void **dispatch_table = vm_run(NULL);
 
-                if (result.contents.boolean != instruction.fields.triplet.arg1)
-                    vm->pc += 1;
+    // Memory slots are resolved to pointers. Memory never moves what it
+    // already has, so they stay good even if it grows later.
+    vm->code = malloc(vm->regions->size * sizeof(vm_code_t));
 
-                break;
+    for (int i = 0; i < vm->regions->size; i++)
+    {
+        code_block_t *block = vm->regions->blocks[i];
+        vm_code_t *translated = vm->code + i;
+
+        translated->size = block->size;
+        translated->code = malloc((block->size + 1) * sizeof(vm_instruction_t));
 
-            case OP_AND:
+        for (int j = 0; j < block->size; j++)
+        {
+            // Malformed bytecode stops here, so the interpreter loop never
+            // has to deal with an opcode it doesn't know. The block still
+            // gets translated, but the VM won't run.
+            if (block->code[j].opcode >= VM_OP_HALT)
+            {
+                if (vm->error == NULL)
+                    asprintf(&vm->error, "Unknown opcode %d in code region %d", block->code[j].opcode, i);
+
+                translated->code[j] = (vm_instruction_t){ .opcode=VM_OP_HALT };
+                continue;
+            }
+
+            translated->code[j] = vm_translate_instruction(vm, block->code[j], translated->code, j);
+        }
+
+        translated->code[block->size] = (vm_instruction_t){ .opcode=VM_OP_HALT };
+
+        // Finally, point each instruction at its handler
+        if (dispatch_table != NULL)
+        {
+            for (int j = 0; j <= block->size; j++)
+                translated->code[j].handler = dispatch_table[translated->code[j].opcode];
+        }
+    }
+}
+
+void vm_execute(vm_t *vm)
+{
+    // Translation may already have found the code to be malformed
+    if (vm->error != NULL)
+        return;
+
+    vm_t *caller = gc_set_running(vm);
+
+    vm_run(vm);
+
+    gc_set_running(caller);
+}
+
+void vm_set_heap_limit(vm_t *vm, size_t limit)
+{
+    vm->heap.limit = limit;
+}
+
+// The interpreter loop. Passing a NULL vm returns the table of handler
+// addresses instead, or NULL when we aren't using threaded dispatch.
+static void **vm_run(vm_t *vm)
+{
+#ifdef VM_THREADED_DISPATCH
+    // Jump targets for direct-threaded dispatch, indexed by opcode. Every
+    // opcode has one, since vm_translate rejects any it doesn't know about.
+    static void *dispatch_table[VM_NUM_OPS] = {
+        [OP_NIL] = &&TARGET_OP_NIL,
+        [OP_LOAD] = &&TARGET_OP_LOAD,
+        [OP_LOADV] = &&TARGET_OP_LOADV,
+        [OP_STORE] = &&TARGET_OP_STORE,
+        [OP_MOVE] = &&TARGET_OP_MOVE,
+        [OP_GETGLOBAL] = &&TARGET_OP_GETGLOBAL,
+        [OP_SETGLOBAL] = &&TARGET_OP_SETGLOBAL,
+        [OP_PUSH] = &&TARGET_OP_PUSH,
+        [OP_POP] = &&TARGET_OP_POP,
+        [OP_JMP] = &&TARGET_OP_JMP,
+        [OP_JMP_TRUE] = &&TARGET_OP_JMP_TRUE,
+        [OP_JMP_FALSE] = &&TARGET_OP_JMP_FALSE,
+        [OP_JMP_EQUAL] = &&TARGET_OP_JMP_EQUAL,
+        [OP_JMP_NOT_EQUAL] = &&TARGET_OP_JMP_NOT_EQUAL,
+        [OP_JMP_LESSTHAN] = &&TARGET_OP_JMP_LESSTHAN,
+        [OP_JMP_NOT_LESSTHAN] = &&TARGET_OP_JMP_NOT_LESSTHAN,
+        [OP_JMP_EQUAL_INT] = &&TARGET_OP_JMP_EQUAL_INT,
+        [OP_JMP_NOT_EQUAL_INT] = &&TARGET_OP_JMP_NOT_EQUAL_INT,
+        [OP_JMP_LESSTHAN_INT] = &&TARGET_OP_JMP_LESSTHAN_INT,
+        [OP_JMP_NOT_LESSTHAN_INT] = &&TARGET_OP_JMP_NOT_LESSTHAN_INT,
+        [OP_JMP_EQUAL_FLOAT] = &&TARGET_OP_JMP_EQUAL_FLOAT,
+        [OP_JMP_NOT_EQUAL_FLOAT] = &&TARGET_OP_JMP_NOT_EQUAL_FLOAT,
+        [OP_JMP_LESSTHAN_FLOAT] = &&TARGET_OP_JMP_LESSTHAN_FLOAT,
+        [OP_JMP_NOT_LESSTHAN_FLOAT] = &&TARGET_OP_JMP_NOT_LESSTHAN_FLOAT,
+        [OP_JMP_EQUAL_STRING] = &&TARGET_OP_JMP_EQUAL_STRING,
+        [OP_JMP_NOT_EQUAL_STRING] = &&TARGET_OP_JMP_NOT_EQUAL_STRING,
+        [OP_ADD] = &&TARGET_OP_ADD,
+        [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+        [OP_NEGATE] = &&TARGET_OP_NEGATE,
+        [OP_MODULO] = &&TARGET_OP_MODULO,
+        [OP_ADD_INT] = &&TARGET_OP_ADD_INT,
+        [OP_ADD_FLOAT] = &&TARGET_OP_ADD_FLOAT,
+        [OP_SUBTRACT_INT] = &&TARGET_OP_SUBTRACT_INT,
+        [OP_SUBTRACT_FLOAT] = &&TARGET_OP_SUBTRACT_FLOAT,
+        [OP_MULTIPLY_INT] = &&TARGET_OP_MULTIPLY_INT,
+        [OP_MULTIPLY_FLOAT] = &&TARGET_OP_MULTIPLY_FLOAT,
+        [OP_CONCAT] = &&TARGET_OP_CONCAT,
+        [OP_AND] = &&TARGET_OP_AND,
+        [OP_OR] = &&TARGET_OP_OR,
+        [OP_NOT] = &&TARGET_OP_NOT,
+        [OP_TUPLE] = &&TARGET_OP_TUPLE,
+        [OP_FORITER] = &&TARGET_OP_FORITER,
+        [OP_CALL] = &&TARGET_OP_CALL,
+        [OP_CALL_DYNAMIC] = &&TARGET_OP_CALL_DYNAMIC,
+        [OP_CALL_BUILTIN] = &&TARGET_OP_CALL_BUILTIN,
+        [OP_RETURN] = &&TARGET_OP_RETURN,
+        [OP_IMPORT] = &&TARGET_OP_IMPORT,
+        [OP_SETINBOUND] = &&TARGET_OP_SETINBOUND,
+        [OP_GETOUTBOUND] = &&TARGET_OP_GETOUTBOUND,
+        [VM_OP_HALT] = &&TARGET_VM_OP_HALT,
+    };
+
+    if (vm == NULL)
+        return dispatch_table;
+#else
+    if (vm == NULL)
+        return NULL;
+#endif
+
+    // Keep the hot interpreter state in locals, and only write it back to the
+    // vm_t when something else needs to look at it (calls and returns).
+    value_t *registers = vm->registers;
+    vm_instruction_t *code, *ip;
+    vm_instruction_t *instruction;
+
+    value_t ret;
+    value_t result;
+    string_t *s1;
+    tuple_t *t1;
+
+    VM_LOAD_FRAME();
+
+    for (;;)
+    {
+        VM_FETCH();
+
+        switch (instruction->opcode)
+        {
+            // Leave the program counter at the end of the block
+            VM_CASE(VM_OP_HALT):
+                ip--;
+                goto done;
+
+            VM_CASE(OP_NIL):
+                result = value_from_type(VAL_NIL);
+                registers[instruction->arg2] = result;
+                VM_NEXT();
+
+            // Load a value into the specified register
+            VM_CASE(OP_LOAD):
+                registers[instruction->arg1] = *instruction->operand.slot;
+                VM_NEXT();
+
+            VM_CASE(OP_LOADV):
+                result = value_from_int(instruction->operand.immediate);
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_STORE):
+                gc_write_barrier(registers[instruction->arg1]);
+                *instruction->operand.slot = registers[instruction->arg1];
+                VM_NEXT();
+
+            VM_CASE(OP_MOVE):
+                registers[instruction->arg1] = registers[instruction->arg2];
+                VM_NEXT();
+
+            VM_CASE(OP_GETGLOBAL):
+                registers[instruction->arg1] = vm->register_file[instruction->arg2];
+                VM_NEXT();
+
+            VM_CASE(OP_SETGLOBAL):
+                vm->register_file[instruction->arg1] = registers[instruction->arg2];
+                VM_NEXT();
+
+            VM_CASE(OP_PUSH):
+                vm_stack_push(vm, registers[instruction->arg2]);
+                VM_NEXT();
+
+            VM_CASE(OP_POP):
+                registers[instruction->arg2] = vm_stack_pop(vm);
+                VM_NEXT();
+
+            // Jumps are relative to the jump itself, and we've already
+            // advanced past it
+            VM_CASE(OP_JMP):
+                ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_TRUE):
+                if (value_truthy(registers[instruction->arg1]))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_FALSE):
+                if (!value_truthy(registers[instruction->arg1]))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_EQUAL):
+                if (values_equal(BRANCH_REG(arg1), BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_EQUAL):
+                if (!values_equal(BRANCH_REG(arg1), BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_LESSTHAN):
+                if (!values_orderable(BRANCH_REG(arg1), BRANCH_REG(arg2)))
+                    goto unorderable;
+                if (values_less_than(BRANCH_REG(arg1), BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_LESSTHAN):
+                if (!values_orderable(BRANCH_REG(arg1), BRANCH_REG(arg2)))
+                    goto unorderable;
+                if (!values_less_than(BRANCH_REG(arg1), BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            // The type-specialized jumps trust the compiler on the types of
+            // their operands
+            VM_CASE(OP_JMP_EQUAL_INT):
+                if (value_as_int(BRANCH_REG(arg1)) == value_as_int(BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_EQUAL_INT):
+                if (value_as_int(BRANCH_REG(arg1)) != value_as_int(BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_LESSTHAN_INT):
+                if (value_as_int(BRANCH_REG(arg1)) < value_as_int(BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_LESSTHAN_INT):
+                if (!(value_as_int(BRANCH_REG(arg1)) < value_as_int(BRANCH_REG(arg2))))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_EQUAL_FLOAT):
+                if (value_as_float(BRANCH_REG(arg1)) == value_as_float(BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_EQUAL_FLOAT):
+                if (value_as_float(BRANCH_REG(arg1)) != value_as_float(BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_LESSTHAN_FLOAT):
+                if (value_as_float(BRANCH_REG(arg1)) < value_as_float(BRANCH_REG(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_LESSTHAN_FLOAT):
+                if (!(value_as_float(BRANCH_REG(arg1)) < value_as_float(BRANCH_REG(arg2))))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_EQUAL_STRING):
+                if (string_equals(BRANCH_STRING(arg1), BRANCH_STRING(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_JMP_NOT_EQUAL_STRING):
+                if (!string_equals(BRANCH_STRING(arg1), BRANCH_STRING(arg2)))
+                    ip = instruction->operand.target;
+                VM_NEXT();
+
+            VM_CASE(OP_AND):
                 if (IS_NUMBERISH3(arg2) && IS_NUMBERISH3(arg3))
                 {
-                    result.contents.boolean = NUM_OR_FLOAT_OR_BOOL3(arg2) && NUM_OR_FLOAT_OR_BOOL3(arg3);
+                    result = value_from_bool(NUM_OR_FLOAT_OR_BOOL3(arg2) && NUM_OR_FLOAT_OR_BOOL3(arg3));
                 }
                 else
                 {
                     // What do we do for non-numbers?
+                    result = value_from_bool(false);
                 }
-                result.type = VAL_BOOLEAN;
 
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
+                registers[instruction->arg1] = result;
+                VM_NEXT();
 
-            case OP_OR:
+            VM_CASE(OP_OR):
                 if (IS_NUMBERISH3(arg2) && IS_NUMBERISH3(arg3))
                 {
-                    result.contents.boolean = NUM_OR_FLOAT3(arg2) || NUM_OR_FLOAT3(arg3);
+                    result = value_from_bool(NUM_OR_FLOAT3(arg2) || NUM_OR_FLOAT3(arg3));
                 }
                 else
                 {
                     // What do we do for non-numbers?
+                    result = value_from_bool(false);
                 }
-                result.type = VAL_BOOLEAN;
 
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
+                registers[instruction->arg1] = result;
+                VM_NEXT();
 
-            case OP_ADD:
+            VM_CASE(OP_ADD):
                 // TODO: Don't assume numbers
                 if (REG_TYPE3(arg2, VAL_FLOAT) || REG_TYPE3(arg3, VAL_FLOAT))
                 {
-                    result.type = VAL_FLOAT;
-                    result.contents.real = NUM_OR_FLOAT3(arg2) + NUM_OR_FLOAT3(arg3);
+                    result = value_from_float(NUM_OR_FLOAT3(arg2) + NUM_OR_FLOAT3(arg3));
                 }
                 else if (REG_TYPE3(arg2, VAL_STRING) || REG_TYPE3(arg3, VAL_STRING))
                 {
-                    asprintf(&stmp, "%s%s", STRING3(arg2), STRING3(arg3));
-                    result = string_create(stmp);
+                    result = string_concat(registers[instruction->arg2], registers[instruction->arg3]);
                 }
                 else
                 {
-                    result.type = VAL_INT;
-                    result.contents.number = NUM3(arg2) + NUM3(arg3);
+                    result = value_from_int(NUM3(arg2) + NUM3(arg3));
                 }
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
+                registers[instruction->arg1] = result;
+                VM_GC_POLL();
+                VM_NEXT();
 
-            case OP_SUBTRACT:
+            VM_CASE(OP_SUBTRACT):
                 if (REG_TYPE3(arg2, VAL_FLOAT) || REG_TYPE3(arg3, VAL_FLOAT))
                 {
-                    result.type = VAL_FLOAT;
-                    result.contents.real = NUM_OR_FLOAT3(arg2) - NUM_OR_FLOAT3(arg3);
+                    result = value_from_float(NUM_OR_FLOAT3(arg2) - NUM_OR_FLOAT3(arg3));
                 }
                 else
                 {
-                    result.type = VAL_INT;
-                    result.contents.number = NUM3(arg2) - NUM3(arg3);
+                    result = value_from_int(NUM3(arg2) - NUM3(arg3));
                 }
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
+                registers[instruction->arg1] = result;
+                VM_NEXT();
 
-            case OP_MULTIPLY:
+            VM_CASE(OP_MULTIPLY):
                 if (REG_TYPE3(arg2, VAL_FLOAT) || REG_TYPE3(arg3, VAL_FLOAT))
                 {
-                    result.type = VAL_FLOAT;
-                    result.contents.real = (NUM_OR_FLOAT3(arg2)) * (NUM_OR_FLOAT3(arg3));
+                    result = value_from_float((NUM_OR_FLOAT3(arg2)) * (NUM_OR_FLOAT3(arg3)));
                 }
                 else
                 {
-                    result.type = VAL_INT;
-                    result.contents.number = NUM3(arg2) * NUM3(arg3);
+                    result = value_from_int(NUM3(arg2) * NUM3(arg3));
                 }
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
-
-            case OP_DIVIDE:
-                result.type = VAL_FLOAT;
-                result.contents.real = NUM_OR_FLOAT3(arg2) / (float) NUM_OR_FLOAT3(arg3);
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
-
-            case OP_MODULO:
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            // Likewise, the type-specialized arithmetic doesn't check
+            VM_CASE(OP_ADD_INT):
+                result = value_from_int(NUM3(arg2) + NUM3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_ADD_FLOAT):
+                result = value_from_float(FLOAT3(arg2) + FLOAT3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_SUBTRACT_INT):
+                result = value_from_int(NUM3(arg2) - NUM3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_SUBTRACT_FLOAT):
+                result = value_from_float(FLOAT3(arg2) - FLOAT3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_MULTIPLY_INT):
+                result = value_from_int(NUM3(arg2) * NUM3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_MULTIPLY_FLOAT):
+                result = value_from_float(FLOAT3(arg2) * FLOAT3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_CONCAT):
+                registers[instruction->arg1] = string_concat(registers[instruction->arg2], registers[instruction->arg3]);
+                VM_GC_POLL();
+                VM_NEXT();
+
+            VM_CASE(OP_DIVIDE):
+                result = value_from_float(NUM_OR_FLOAT3(arg2) / (float) NUM_OR_FLOAT3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
+
+            VM_CASE(OP_MODULO):
                 // TODO: Handle floats?
-                result.type = VAL_INT;
-                result.contents.number = NUM3(arg2) % NUM3(arg3);
-                vm->registers[instruction.fields.triplet.arg1] = result;
-                break;
+                result = value_from_int(NUM3(arg2) % NUM3(arg3));
+                registers[instruction->arg1] = result;
+                VM_NEXT();
 
-            case OP_NEGATE:
-                result.type = VAL_INT;
-                result.contents.number = -vm->registers[instruction.fields.pair.arg2].contents.number;
-                vm->registers[instruction.fields.pair.arg1] = result;
-                break;
+            VM_CASE(OP_NEGATE):
+                if (value_type_of(registers[instruction->arg2]) == VAL_FLOAT)
+                {
+                    result = value_from_float(-FLOAT2(arg2));
+                }
+                else
+                {
+                    result = value_from_int(-NUM2(arg2));
+                }
+                registers[instruction->arg1] = result;
+                VM_NEXT();
 
-            case OP_NOT:
-                result.type = VAL_BOOLEAN;
-                switch(vm->registers[instruction.fields.pair.arg2].type)
+            VM_CASE(OP_NOT):
+                result = value_from_bool(false);
+                switch (value_type_of(registers[instruction->arg2]))
                 {
                     case VAL_INT:
-                        result.contents.boolean = !NUM2(arg2);
+                        result = value_from_bool(!NUM2(arg2));
                         break;
                     case VAL_FLOAT:
-                        result.contents.boolean = !FLOAT2(arg2);
+                        result = value_from_bool(!FLOAT2(arg2));
                         break;
                     case VAL_BOOLEAN:
-                        result.contents.boolean = !BOOL2(arg2);
+                        result = value_from_bool(!BOOL2(arg2));
                         break;
                     case VAL_ABSENT:
-                        result.contents.boolean = true;
+                        result = value_from_bool(true);
                         break;
                     case VAL_STRING:
-                        result.contents.boolean = (bool)!strlen(STR2(arg2));
+                        result = value_from_bool(STR2(arg2)->length == 0);
                         break;
                     default:
                         ;
                 }
-                vm->registers[instruction.fields.pair.arg1] = result;
-                break;
-
-            case OP_DEREF:
-                ret = vm->registers[instruction.fields.triplet.arg2];
-                // TODO: Error handling!
-                assert(ret.type == VAL_ITERATOR);
-                iter = (iterator_t *)ret.contents.object;
+                registers[instruction->arg1] = result;
+                VM_NEXT();
 
-                if (iter->index == iter->length)
+            VM_CASE(OP_TUPLE):
+                result = tuple_create(instruction->arg3);
+                t1 = (tuple_t *)value_as_object(result);
+                for (int i = 0; i < instruction->arg3; i++)
                 {
-                    result.type = VAL_NIL;
-                    vm->registers[instruction.fields.pair.arg1] = result;
-                    break;
+                    t1->values[i] = registers[instruction->arg2 + i];
+                    gc_write_barrier(t1->values[i]);
                 }
+                registers[instruction->arg1] = result;
+                VM_GC_POLL();
+                VM_NEXT();
 
-                ret = iter->iterable;
-                assert(is_collection(ret));
-                // First store the value referenced by the iterator in arg1
-                switch (ret.type)
+            VM_CASE(OP_FORITER):
+            {
+                // The collection, the index, then the loop variable
+                value_t *loop = registers + instruction->arg1;
+                int index = value_as_int(loop[1]);
+
+                switch (value_type_of(loop[0]))
                 {
                     case VAL_TUPLE:
-                        t1 = (tuple_t *)ret.contents.object;
-                        result = t1->values[iter->index];
-                        break;
+                        t1 = (tuple_t *)value_as_object(loop[0]);
+                        if (index >= t1->length)
+                            VM_NEXT();
 
-                    case VAL_STRING:
-                        // TODO: Handle
+                        loop[2] = t1->values[index];
                         break;
 
-                    default:
-                        ;
-                };
+                    case VAL_RANGE:
+                        if (index >= range_length(loop[0]))
+                            VM_NEXT();
 
-                iter->index += instruction.fields.triplet.arg3;
-                vm->registers[instruction.fields.pair.arg1] = result;
-                break;
+                        loop[2] = value_from_int(range_at(loop[0], index));
+                        break;
 
-            case OP_CALL:
-                instruction_call(vm, instruction);
-                break;
+                    case VAL_STRING:
+                    {
+                        s1 = (string_t *)value_as_object(loop[0]);
+                        if (index >= s1->length)
+                            VM_NEXT();
 
-            case OP_CALL_DYNAMIC:
-                instruction_call_builtin(vm, instruction);
-                break;
+                        char character[2] = { string_chars(s1)[index], '\0' };
+                        loop[2] = string_create(character);
+                        break;
+                    }
 
-            case OP_RETURN:
-                fn = (function_t *)vm->frame.contents.object;
+                    default:
+                        // TODO: Proper error handling for things we can't
+                        //       iterate over
+                        assert(false);
+                }
 
-                vm->region = fn->return_address.region;
-                vm->pc = fn->return_address.offset;
-                vm_stack_push(vm, vm->registers[instruction.fields.pair.arg2]);
+                loop[1] = value_from_int(index + 1);
+                ip = instruction->operand.target;
+                VM_GC_POLL();
+                VM_NEXT();
+            }
 
-                // Restore our save buffer
-                for (uint8_t i = 0, reg = fn->locals[i]; reg != 0; i++, reg = fn->locals[i])
-                {
-                    vm->registers[reg] = fn->save[i];
-                }
+            VM_CASE(OP_CALL):
+                VM_SAVE_PC();
+                instruction_call(vm, instruction->operand.function, instruction->arg1);
+                VM_LOAD_FRAME();
+                VM_NEXT();
+
+            VM_CASE(OP_CALL_DYNAMIC):
+                instruction_call_builtin(vm, *instruction->operand.slot);
+                VM_BUILTIN_CHECK();
+                VM_GC_POLL();
+                VM_NEXT();
+
+            VM_CASE(OP_CALL_BUILTIN):
+                instruction->operand.builtin(vm);
+                VM_BUILTIN_CHECK();
+                VM_GC_POLL();
+                VM_NEXT();
+
+            VM_CASE(OP_RETURN):
+            {
+                frame_t *frame = vm_frame_current(vm);
 
-                // Free our save buffer
-                free(fn->save);
-                free(fn);
-                vm->frame = (value_t){VAL_ABSENT};
+                // Our $0 is the caller's call register
+                registers[0] = registers[instruction->arg2];
 
-                // If our call stack has something on it, pop it into the frame register
-                if (vm->csp > 0)
-                {
-                    vm->frame = vm_cstack_pop(vm);
-                }
+                vm->region = frame->return_address.region;
+                vm->pc = frame->return_address.offset;
+                vm_registers_slide(vm, frame->base);
+                vm_frame_pop(vm);
 
-                break;
+                VM_LOAD_FRAME();
+                VM_NEXT();
+            }
 
-            case OP_IMPORT:
-                ret = memory_get(vm->memory, instruction.fields.pair.arg2);
+            VM_CASE(OP_IMPORT):
+                ret = *instruction->operand.slot;
 
                 // The only valid argument to an import statement is a string
-                assert(ret.type == VAL_STRING);
+                assert(value_type_of(ret) == VAL_STRING);
 
-                s1 = (string_t *)ret.contents.object;
+                s1 = (string_t *)value_as_object(ret);
 
                 char *filepath;
-                asprintf(&filepath, "%s.n", s1->string);
+                asprintf(&filepath, "%s.n", string_chars(s1));
 
                 // TODO: This seems duplicated...
                 FILE *fp = fopen(filepath, "r");
@@ -585,56 +1095,77 @@ void vm_execute(vm_t *vm)
                 context.position = 0;
 
                 ast_t *syntax_tree = parse(&context);
-                binary_t *binary = compile(filepath, input, syntax_tree);
+                binary_t *binary = compile(filepath, input, syntax_tree, context.arena);
                 vm_t *module_vm = vm_create(binary);
                 vm_execute(module_vm);
 
-                result = module_create(s1->string, (struct vm_t *)module_vm);
+                // If the module failed, so do we
+                if (module_vm->error != NULL)
+                {
+                    vm->error = module_vm->error;
+                    free(input);
+                    goto done;
+                }
+
+                // Running the module may have moved the name out of the
+                // nursery, so look it up again
+                s1 = (string_t *)value_as_object(*instruction->operand.slot);
+                result = module_create(string_chars(s1), (struct vm_t *)module_vm);
 
-                // TODO: This definitely leaks memory, clean this up when we
-                //  implement garbage collection
-                memory_set(vm->memory, instruction.fields.pair.arg2, result);
+                gc_write_barrier(result);
+                *instruction->operand.slot = result;
 
                 symbol_t sym;
 
-                sym.name = s1->string;
+                sym.name = ((module_t *)value_as_object(result))->name;
                 sym.type = SYM_MODULE;
                 sym.location.type = LOC_MEMORY;
-                sym.location.address = instruction.fields.pair.arg1;
+                sym.location.address = instruction->arg1;
 
                 symbol_map_set(vm->symbols, sym);
 
                 free(input);
 
-                break;
+                VM_NEXT();
 
-            case OP_SETINBOUND:
+            VM_CASE(OP_SETINBOUND):
             {
-                ret = memory_get(vm->memory, instruction.fields.pair.arg2);
+                ret = *instruction->operand.slot;
 
-                assert(ret.type == VAL_MODULE);
+                assert(value_type_of(ret) == VAL_MODULE);
 
-                module_t *module = (module_t *)ret.contents.object;
+                module_t *module = (module_t *)value_as_object(ret);
 
-                vm_add_inbound_value((vm_t *)module->vm, vm->registers[instruction.fields.pair.arg1]);
+                vm_add_inbound_value((vm_t *)module->vm, registers[instruction->arg1]);
 
-                break;
+                VM_NEXT();
             }
 
-            case OP_GETOUTBOUND:
+            VM_CASE(OP_GETOUTBOUND):
             {
-                ret = memory_get(vm->memory, instruction.fields.pair.arg2);
+                ret = *instruction->operand.slot;
 
-                assert(ret.type == VAL_MODULE);
+                assert(value_type_of(ret) == VAL_MODULE);
 
-                module_t *module = (module_t *)ret.contents.object;
+                module_t *module = (module_t *)value_as_object(ret);
 
-                vm->registers[instruction.fields.pair.arg1] = vm_get_outbound_value((vm_t *)module->vm);
+                registers[instruction->arg1] = vm_get_outbound_value((vm_t *)module->vm);
 
-                break;
+                VM_NEXT();
             }
         }
     }
+
+unorderable:
+    asprintf(&vm->error, "Only numbers or strings can be compared with <, <=, > and >=");
+    goto done;
+
+heap_exceeded:
+    asprintf(&vm->error, "Heap limit of %zu bytes exceeded", vm->heap.limit);
+
+done:
+    VM_SAVE_PC();
+    return NULL;
 }
 
 void vm_dump(vm_t *vm)
@@ -642,24 +1173,24 @@ void vm_dump(vm_t *vm)
     printf("[memory contents]\n");
     for (int i = 0; i < vm->memory->capacity; i++)
     {
-        if (vm->memory->contents[i].type == VAL_ABSENT)
+        if (value_type_of(memory_get(vm->memory, i)) == VAL_ABSENT)
             break;
 
         printf("   %04d ", i);
-        value_print(vm->memory->contents[i]);
+        value_print(memory_get(vm->memory, i));
     }
 
     printf("\n[stack contents]\n");
     for (int i = 0; i < vm->sp; i++)
     {
         printf("   %04d ", i);
-        value_print(vm->stack->contents[i]);
+        value_print(vm->stack[i]);
     }
 
     printf("\n[register contents]\n");
     for (int i = 1; i < VM_NUM_REGISTERS; i++)
     {
-        if (vm->registers[i].type == VAL_ABSENT)
+        if (value_type_of(vm->registers[i]) == VAL_ABSENT)
             break;
 
         printf("   %04d ", i);
@@ -667,4 +1198,18 @@ void vm_dump(vm_t *vm)
     }
 
     printf("\nstack pointer: %d\n", vm->sp);
+
+    static const char *kinds[GC_NUM_KINDS] = {
+        [GC_KIND_STRING] = "strings",
+        [GC_KIND_TUPLE] = "tuples",
+        [GC_KIND_ITERATOR] = "iterators",
+        [GC_KIND_FUNCTION] = "functions",
+        [GC_KIND_MODULE] = "modules",
+    };
+
+    // Byte counts depend on how values are laid out, so only the number of
+    // objects is dumped. The byte counts are in vm->heap.
+    printf("\n[heap contents]\n");
+    for (int i = 0; i < GC_NUM_KINDS; i++)
+        printf("   %-10s %zu\n", kinds[i], vm->heap.objects[i]);
 }
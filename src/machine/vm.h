@@ -8,27 +8,85 @@
 #define VM_H
 
 #include "compiler/symbol.h"
+#include "bytecode.h"
+#include "gc.h"
 #include "memory.h"
 #include "value.h"
 #include "binary.h"
 
 #define VM_NUM_REGISTERS 256
 #define VM_STACK_SIZE 256
-
+// Initial size of the register file, in registers
+#define VM_REGISTER_FILE_SIZE (VM_NUM_REGISTERS * 8)
+// Initial size of the frame stack, in frames
+#define VM_FRAME_STACK_SIZE 256
+
+// A call frame. Registers are addressed relative to the base of the current
+// frame, and a call simply slides the base up so that the callee's window
+// overlaps the caller's argument registers. A frame only needs to remember
+// enough to slide it back.
+typedef struct
+{
+    function_t *function;
+    address_t return_address;
+    // Offset of the caller's register window in the register file
+    size_t base;
+} frame_t;
+
+struct vm_t;
+
+// An instruction as the interpreter loop sees it. When a VM is created, every
+// code block is translated once into an array of these, so that the loop never
+// has to pick an instruction_t apart: register operands get their own fields,
+// and jump targets, memory slots, functions and builtins are all resolved up
+// front. The bytecode itself is left alone.
+typedef struct vm_instruction_t
+{
+    // Address of the handler for this instruction, with threaded dispatch
+    void *handler;
+    uint8_t opcode;
+    uint8_t arg1;
+    uint8_t arg2;
+    uint8_t arg3;
+    union
+    {
+        int immediate;
+        struct vm_instruction_t *target;
+        value_t *slot;
+        function_t *function;
+        void (*builtin)(struct vm_t *);
+    } operand;
+} vm_instruction_t;
+
+// A translated code block. Each one ends in an extra halt instruction, so the
+// loop doesn't need to check whether it has run off the end.
 typedef struct
+{
+    vm_instruction_t *code;
+    size_t size;
+} vm_code_t;
+
+typedef struct vm_t
 {
     memory_t *memory;
 
-    // Stack-related data structures
-    memory_t *stack;
+    // Stack-related data structures. The stack is just an array, which moves
+    // when it grows, so nothing may hold on to a pointer into it.
+    value_t *stack;
+    size_t stack_capacity;
     // Stack pointer
     int sp;
 
-    memory_t *call_stack;
-    int csp;
+    // Call frames
+    frame_t *frames;
+    size_t frames_capacity;
+    // Frame pointer, the number of active frames
+    int fp;
 
     // Code-related data structures
     code_collection_t *regions;
+    // The regions above, translated for the interpreter loop
+    vm_code_t *code;
     // Current code region
     uint64_t region;
     // Program counter
@@ -36,11 +94,12 @@ typedef struct
 
     // Registers
 
-    //-- General purpose registers
-    value_t registers[VM_NUM_REGISTERS];
-
-    //-- Special purpose registers
-    value_t frame;
+    //-- General purpose registers, a window of VM_NUM_REGISTERS into the
+    //   register file starting at the current base
+    value_t *registers;
+    value_t *register_file;
+    size_t register_file_size;
+    size_t base;
 
     //-- VM interface
     // TODO: Multi-threaded support
@@ -54,6 +113,12 @@ typedef struct
 
     //-- Symbols this VM exports
     symbol_map_t *symbols;
+
+    // What this VM has allocated, which the collector keeps up to date
+    gc_heap_t heap;
+
+    // Why execution stopped early, or NULL if it didn't
+    char *error;
 } vm_t;
 
 vm_t *vm_create(binary_t *);
@@ -61,8 +126,30 @@ vm_t *vm_create(binary_t *);
 void vm_execute(vm_t *);
 void vm_dump(vm_t *);
 
-void vm_stack_push(vm_t *, value_t val);
-value_t vm_stack_pop(vm_t *);
+// Stop with an error if this VM's objects take up more than limit bytes,
+// even after a full collection. 0 means no limit. See gc_set_heap_limit for
+// the default.
+void vm_set_heap_limit(vm_t *, size_t limit);
+
+void vm_stack_grow(vm_t *);
+
+static inline void vm_stack_push(vm_t *vm, value_t val)
+{
+    if (vm->sp >= vm->stack_capacity)
+        vm_stack_grow(vm);
+
+    vm->stack[vm->sp++] = val;
+}
+
+// Popping an empty stack gives VAL_ABSENT, which is how builtins find out
+// they were passed fewer arguments than they take
+static inline value_t vm_stack_pop(vm_t *vm)
+{
+    if (vm->sp == 0)
+        return value_from_type(VAL_ABSENT);
+
+    return vm->stack[--vm->sp];
+}
 
 void vm_add_inbound_value(vm_t *vm, value_t value);
 value_t vm_get_outbound_value(vm_t *vm);
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+arena_t *arena_create(void)
+{
+    return calloc(1, sizeof(arena_t));
+}
+
+void arena_destroy(arena_t *arena)
+{
+    arena_chunk_t *chunk = arena->chunks;
+
+    while (chunk != NULL)
+    {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    // Keep every allocation 8-byte aligned
+    size = (size + 7) & ~(size_t)7;
+
+    arena_chunk_t *chunk = arena->chunks;
+
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        // Big allocations get a chunk to themselves, behind the current one so
+        // that we can keep filling it
+        if (size > ARENA_CHUNK_SIZE / 4 && chunk != NULL)
+        {
+            arena_chunk_t *big = calloc(1, sizeof(arena_chunk_t) + size);
+            big->size = size;
+            big->used = size;
+            big->next = chunk->next;
+            chunk->next = big;
+            return big->data;
+        }
+
+        size_t chunk_size = (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE;
+
+        // Chunks come from calloc and are never reused, so everything we hand
+        // out is already zeroed
+        chunk = calloc(1, sizeof(arena_chunk_t) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+
+    return ptr;
+}
+
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    old_size = (old_size + 7) & ~(size_t)7;
+    new_size = (new_size + 7) & ~(size_t)7;
+
+    // If this was the last thing we allocated, it can grow in place
+    if (ptr != NULL && chunk != NULL &&
+        (char *)ptr + old_size == chunk->data + chunk->used &&
+        chunk->size - chunk->used >= new_size - old_size)
+    {
+        chunk->used += new_size - old_size;
+        return ptr;
+    }
+
+    void *grown = arena_alloc(arena, new_size);
+
+    if (ptr != NULL)
+        memcpy(grown, ptr, old_size);
+
+    return grown;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2021, Dana Burkart <dana.burkart@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Size of each chunk an arena allocates from
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct arena_chunk_t
+{
+    struct arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk_t;
+
+// An arena hands out memory by bumping a pointer through large chunks, and
+// frees it all at once. The compiler uses one for everything that doesn't
+// outlive a compile: tokens, syntax trees and scopes.
+typedef struct
+{
+    arena_chunk_t *chunks;
+} arena_t;
+
+arena_t *arena_create(void);
+void arena_destroy(arena_t *);
+
+// Allocate zeroed memory from an arena
+void *arena_alloc(arena_t *, size_t size);
+
+// Grow an allocation, realloc-style. The old memory isn't reclaimed until the
+// arena is destroyed.
+void *arena_grow(arena_t *, void *ptr, size_t old_size, size_t new_size);
+
+#endif
@@ -42,7 +42,7 @@ int main(int argc, char *argv[])
         context.position = 0;
 
         ast_t *syntax_tree = parse(&context);
-        binary_t *binary = compile(argv[i], input, syntax_tree);
+        binary_t *binary = compile(argv[i], input, syntax_tree, context.arena);
 
         char *listing = disassemble(binary);
         printf("%s", listing);
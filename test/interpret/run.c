@@ -43,11 +43,19 @@ int main(int argc, char *argv[])
         context.position = 0;
 
         ast_t *syntax_tree = parse(&context);
-        binary_t *binary = compile(argv[i], input, syntax_tree);
+        binary_t *binary = compile(argv[i], input, syntax_tree, context.arena);
         vm_t *vm = vm_create(binary);
         vm_execute(vm);
 
         free(input);
+
+        if (vm->error != NULL)
+        {
+            fflush(stdout);
+            fprintf(stderr, "%s: %s\n", argv[i], vm->error);
+            status = 1;
+            goto done;
+        }
     }
 
 done:
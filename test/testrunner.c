@@ -13,7 +13,7 @@
 #include <time.h>
 #include <unistd.h>
 
-#define SUBSYSTEM_COUNT 5
+#define SUBSYSTEM_COUNT 6
 #define USAGE "Usage %s:\n    --rebase  Rebaseline failing tests\n"
 #define HRULE "================================================================================\n"
 
@@ -24,6 +24,7 @@ const char *subsystems[SUBSYSTEM_COUNT] = {
     "lex",
     "parse",
     "compile",
+    "ir",
     "vm",
     "interpret"
 };
@@ -43,7 +43,7 @@ int main(int argc, char *argv[])
         context.position = 0;
 
         ast_t *syntax_tree = parse(&context);
-        binary_t *binary = compile(argv[i], input, syntax_tree);
+        binary_t *binary = compile(argv[i], input, syntax_tree, context.arena);
 
         vm_t *vm = vm_create(binary);
         vm_execute(vm);